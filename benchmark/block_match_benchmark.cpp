@@ -0,0 +1,114 @@
+// Compares the block matching methods of block_matcher.hpp on a synthetic rectified pair,
+// a random texture seen on a slanted plane. The vector method is checked against the scalar
+// reference for both costs, several window sizes and disparity ranges, odd widths and
+// images barely wider than the disparity range, where the valid window is small or empty.
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "block_matcher.hpp"
+
+using namespace vrmagic;
+
+struct Resolution {
+  size_t width;
+  size_t height;
+};
+
+struct Range {
+  int minDisparity;
+  int numDisparities;
+};
+
+static const Resolution RESOLUTIONS[] = {{70, 9}, {97, 31}, {754, 480}, {753, 479}, {1280, 1024}};
+static const BlockMatchMethod METHODS[] = {BLOCK_MATCH_SCALAR, BLOCK_MATCH_AVX2};
+static const int BLOCK_SIZES[] = {5, 15};
+static const Range RANGES[] = {{0, 64}, {3, 16}};
+static const int ITERATIONS = 5;
+
+// Random texture whose disparity grows from 4 at the left to 50 at the right border.
+static void buildPair(const Resolution& res, std::vector<uint8_t>& left, std::vector<uint8_t>& right) {
+  left.resize(res.width * res.height);
+  right.resize(left.size());
+  uint32_t state = 12345;
+  for (size_t i = 0; i < left.size(); ++i) {
+    state = state * 1103515245 + 12345;
+    left[i] = state >> 24;
+  }
+  for (size_t y = 0; y < res.height; ++y) {
+    for (size_t x = 0; x < res.width; ++x) {
+      const size_t disparity = 4 + 46 * x / res.width;
+      const size_t source = x + disparity < res.width ? x + disparity : res.width - 1;
+      right[y * res.width + x] = left[y * res.width + source];
+    }
+  }
+}
+
+static double benchmark(BlockMatcher& matcher, BlockMatchMethod method, const std::vector<uint8_t>& left,
+                        const std::vector<uint8_t>& right, const Resolution& res, std::vector<float>& disparity) {
+  matcher.compute(&left[0], &right[0], res.width, res.width, res.height, &disparity[0], method);
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (int i = 0; i < ITERATIONS; ++i) {
+    matcher.compute(&left[0], &right[0], res.width, res.width, res.height, &disparity[0], method);
+  }
+  std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count() / ITERATIONS;
+}
+
+int main() {
+  printf("%-11s %-7s %-6s %-7s %-7s %12s %8s\n", "resolution", "cost", "block", "range", "method", "us/frame",
+         "valid");
+
+  for (size_t r = 0; r < sizeof(RESOLUTIONS) / sizeof(RESOLUTIONS[0]); ++r) {
+    const Resolution& res = RESOLUTIONS[r];
+    std::vector<uint8_t> left, right;
+    buildPair(res, left, right);
+    std::vector<float> reference(res.width * res.height);
+    std::vector<float> disparity(reference.size());
+
+    for (int c = 0; c < 2; ++c) {
+      for (size_t b = 0; b < sizeof(BLOCK_SIZES) / sizeof(BLOCK_SIZES[0]); ++b) {
+        for (size_t g = 0; g < sizeof(RANGES) / sizeof(RANGES[0]); ++g) {
+          BlockMatcherConfig config;
+          config.cost = c == 0 ? MATCH_SAD : MATCH_CENSUS;
+          config.blockSize = BLOCK_SIZES[b];
+          config.minDisparity = RANGES[g].minDisparity;
+          config.numDisparities = RANGES[g].numDisparities;
+          BlockMatcher matcher(config);
+
+          for (size_t m = 0; m < sizeof(METHODS) / sizeof(METHODS[0]); ++m) {
+            if (!blockMatchMethodSupported(METHODS[m])) continue;
+
+            std::vector<float>& out = m == 0 ? reference : disparity;
+            const double us = benchmark(matcher, METHODS[m], left, right, res, out);
+            if (m > 0 && memcmp(&disparity[0], &reference[0], disparity.size() * sizeof(float)) != 0) {
+              printf("%s produced different disparities than the scalar code at %zux%zu\n",
+                     blockMatchMethodName(METHODS[m]), res.width, res.height);
+              return 1;
+            }
+
+            size_t valid = 0;
+            for (size_t i = 0; i < out.size(); ++i) valid += out[i] != INVALID_DISPARITY;
+
+            char resolution[32];
+            char range[32];
+            snprintf(resolution, sizeof(resolution), "%zux%zu", res.width, res.height);
+            snprintf(range, sizeof(range), "%d+%d", config.minDisparity, config.numDisparities);
+            printf("%-11s %-7s %-6d %-7s %-7s %12.1f %7.1f%%\n",
+                   resolution,
+                   c == 0 ? "sad" : "census",
+                   config.blockSize,
+                   range,
+                   blockMatchMethodName(METHODS[m]),
+                   us,
+                   100.0 * valid / out.size());
+          }
+        }
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,78 @@
+// Compares the strided copy methods of image_copy.hpp for common sensor resolutions.
+// The source pitch is padded like the VRmUsbCam target images, the destination is
+// tightly packed like sensor_msgs::Image::data.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "image_copy.hpp"
+
+using namespace vrmagic;
+
+struct Resolution {
+  size_t width;
+  size_t height;
+};
+
+static const Resolution RESOLUTIONS[] = {{640, 480}, {754, 480}, {1280, 1024}, {2048, 1536}};
+static const CopyMethod METHODS[] = {COPY_NAIVE, COPY_MEMCPY, COPY_SSE2, COPY_AVX2};
+static const size_t BYTES_PER_PIXEL = 3;
+static const int ITERATIONS = 200;
+// Destination bytes before each method runs
+static const uint8_t UNCOPIED = 0xa5;
+
+static double benchmark(CopyMethod method, const std::vector<uint8_t>& src, size_t srcPitch,
+                        std::vector<uint8_t>& dst, size_t rowBytes, size_t rows) {
+  // Warm up caches and page tables
+  copyImage(&src[0], srcPitch, &dst[0], rowBytes, rowBytes, rows, method);
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (int i = 0; i < ITERATIONS; ++i) {
+    copyImage(&src[0], srcPitch, &dst[0], rowBytes, rowBytes, rows, method);
+  }
+  std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count() / ITERATIONS;
+}
+
+int main() {
+  printf("%-11s %-8s %-8s %12s %10s\n", "resolution", "pitch", "method", "us/frame", "GB/s");
+
+  for (size_t r = 0; r < sizeof(RESOLUTIONS) / sizeof(RESOLUTIONS[0]); ++r) {
+    const size_t rowBytes = RESOLUTIONS[r].width * BYTES_PER_PIXEL;
+    const size_t rows = RESOLUTIONS[r].height;
+    const size_t pitches[] = {rowBytes, (rowBytes + 63) / 64 * 64 + 64};
+
+    for (size_t p = 0; p < 2; ++p) {
+      std::vector<uint8_t> src(pitches[p] * rows);
+      std::vector<uint8_t> dst(rowBytes * rows);
+      // The source never holds UNCOPIED, so a method that skips bytes leaves them behind
+      for (size_t i = 0; i < src.size(); ++i) src[i] = static_cast<uint8_t>(i % UNCOPIED);
+
+      for (size_t m = 0; m < sizeof(METHODS) / sizeof(METHODS[0]); ++m) {
+        if (!copyMethodSupported(METHODS[m])) continue;
+
+        std::fill(dst.begin(), dst.end(), UNCOPIED);
+        const double us = benchmark(METHODS[m], src, pitches[p], dst, rowBytes, rows);
+        for (size_t y = 0; y < rows; ++y) {
+          if (memcmp(&src[y * pitches[p]], &dst[y * rowBytes], rowBytes) != 0) {
+            printf("%s produced a wrong copy\n", copyMethodName(METHODS[m]));
+            return 1;
+          }
+        }
+
+        char resolution[32];
+        snprintf(resolution, sizeof(resolution), "%zux%zu", RESOLUTIONS[r].width, rows);
+        printf("%-11s %-8s %-8s %12.1f %10.2f\n",
+               resolution,
+               p == 0 ? "packed" : "padded",
+               copyMethodName(METHODS[m]),
+               us,
+               rowBytes * rows / us / 1e3);
+      }
+    }
+  }
+  return 0;
+}
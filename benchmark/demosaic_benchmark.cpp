@@ -0,0 +1,189 @@
+// Compares the built-in demosaicing kernels of demosaic.hpp with VRmUsbCamConvertImage and
+// the converter of the simulated backend, on Bayer test frames of the simulated backend.
+// The vector kernels are checked against the scalar reference, on the benchmarked frames and
+// on crops of them whose rows end at every position within a vector.
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "demosaic.hpp"
+#include "simulated_backend.hpp"
+#include "vrmusbcam_backend.hpp"
+
+using namespace vrmagic;
+
+struct Resolution {
+  int width;
+  int height;
+};
+
+static const Resolution RESOLUTIONS[] = {{754, 480}, {1280, 1024}, {2048, 1536}};
+static const DemosaicMethod METHODS[] = {DEMOSAIC_SCALAR, DEMOSAIC_SSSE3, DEMOSAIC_AVX2, DEMOSAIC_NEON};
+static const BayerPattern PATTERNS[] = {BAYER_RGGB, BAYER_BGGR, BAYER_GRBG, BAYER_GBRG};
+static const int ITERATIONS = 50;
+// Crops up to this width leave every possible number of columns to the scalar code, for
+// vectors of up to 32 pixels
+static const int MAX_CHECK_WIDTH = 2 + 2 * 32 + 2;
+static const int CHECK_HEIGHTS[] = {2, 4, 8};
+
+typedef std::chrono::steady_clock Clock;
+
+static double elapsedUs(Clock::time_point start) {
+  return std::chrono::duration<double, std::micro>(Clock::now() - start).count() / ITERATIONS;
+}
+
+// Microseconds per frame of a backend converter, or a negative value if it failed.
+static double benchmarkBackend(DeviceBackend& backend, const VRmImage* source, VRmImage* target) {
+  if (!backend.convertImage(source, target)) return -1;
+
+  Clock::time_point start = Clock::now();
+  for (int i = 0; i < ITERATIONS; ++i) backend.convertImage(source, target);
+  return elapsedUs(start);
+}
+
+static double benchmarkDemosaic(const std::vector<VRmBYTE>& src,
+                                const Resolution& res,
+                                std::vector<uint8_t>& dst,
+                                size_t channels,
+                                DemosaicAlgorithm algorithm,
+                                DemosaicMethod method) {
+  const DemosaicOutput output = channels == 3 ? DEMOSAIC_BGR8 : DEMOSAIC_MONO8;
+  demosaic(&src[0], res.width, &dst[0], res.width * channels, res.width, res.height, BAYER_GBRG, algorithm, output,
+           method);
+
+  Clock::time_point start = Clock::now();
+  for (int i = 0; i < ITERATIONS; ++i) {
+    demosaic(&src[0], res.width, &dst[0], res.width * channels, res.width, res.height, BAYER_GBRG, algorithm, output,
+             method);
+  }
+  return elapsedUs(start);
+}
+
+// Compares the vector kernels with the scalar one on the top left width x height pixels of
+// frame, for all patterns, algorithms and outputs. Returns false on the first difference.
+static bool checkCrop(const std::vector<VRmBYTE>& frame, size_t pitch, int width, int height) {
+  std::vector<uint8_t> reference(width * height * 3);
+  std::vector<uint8_t> dst(reference.size());
+  for (size_t p = 0; p < sizeof(PATTERNS) / sizeof(PATTERNS[0]); ++p) {
+    for (int a = 0; a < 2; ++a) {
+      const DemosaicAlgorithm algorithm = a == 0 ? DEMOSAIC_BILINEAR : DEMOSAIC_EDGE_AWARE;
+      for (size_t channels = 1; channels <= 3; channels += 2) {
+        const DemosaicOutput output = channels == 3 ? DEMOSAIC_BGR8 : DEMOSAIC_MONO8;
+        demosaic(&frame[0], pitch, &reference[0], width * channels, width, height, PATTERNS[p], algorithm, output,
+                 DEMOSAIC_SCALAR);
+        for (size_t m = 1; m < sizeof(METHODS) / sizeof(METHODS[0]); ++m) {
+          if (!demosaicMethodSupported(METHODS[m])) continue;
+
+          demosaic(&frame[0], pitch, &dst[0], width * channels, width, height, PATTERNS[p], algorithm, output,
+                   METHODS[m]);
+          if (memcmp(&dst[0], &reference[0], width * height * channels) != 0) {
+            printf("%s differs from the scalar kernel on a %dx%d crop\n", demosaicMethodName(METHODS[m]), width,
+                   height);
+            return false;
+          }
+        }
+      }
+    }
+  }
+  return true;
+}
+
+static void printRow(const Resolution& res, const char* output, const char* converter, double us) {
+  char resolution[32];
+  snprintf(resolution, sizeof(resolution), "%dx%d", res.width, res.height);
+  if (us < 0) {
+    printf("%-11s %-6s %-22s %12s\n", resolution, output, converter, "failed");
+  } else {
+    printf("%-11s %-6s %-22s %12.1f %10.1f\n", resolution, output, converter, us, res.width * res.height / us);
+  }
+}
+
+int main() {
+  printf("%-11s %-6s %-22s %12s %10s\n", "resolution", "output", "converter", "us/frame", "Mpx/s");
+
+  for (size_t r = 0; r < sizeof(RESOLUTIONS) / sizeof(RESOLUTIONS[0]); ++r) {
+    const Resolution& res = RESOLUTIONS[r];
+
+    SimulationConfig sim;
+    sim.width = res.width;
+    sim.height = res.height;
+    sim.colorFormat = VRM_BAYER_GBRG_8;
+    sim.frameRate = 1000;
+    SimulatedBackend simulated(sim);
+    VRmUsbCamBackend sdk((std::string()));
+
+    // Grab one test frame and keep a tightly packed copy of it
+    VRmImage* locked = 0;
+    VRmDWORD dropped = 0;
+    if (!simulated.openDevice() || !simulated.start() || !simulated.lockNextImage(1, &locked, &dropped, 1000)) {
+      printf("Simulated backend failed: %s\n", simulated.getLastError());
+      return 1;
+    }
+    std::vector<VRmBYTE> frame(res.width * res.height);
+    for (int y = 0; y < res.height; ++y) {
+      memcpy(&frame[y * res.width], locked->mp_buffer + y * locked->m_pitch, res.width);
+    }
+    simulated.unlockNextImage(&locked);
+
+    // Sizes stay even, as for any Bayer image
+    for (int width = 2; width <= MAX_CHECK_WIDTH; width += 2) {
+      for (size_t h = 0; h < sizeof(CHECK_HEIGHTS) / sizeof(CHECK_HEIGHTS[0]); ++h) {
+        if (!checkCrop(frame, res.width, width, CHECK_HEIGHTS[h])) return 1;
+      }
+    }
+    if (!checkCrop(frame, res.width, res.width - 2, res.height - 2)) return 1;
+
+    VRmImageFormat sourceFormat = VRmImageFormat();
+    sourceFormat.m_width = res.width;
+    sourceFormat.m_height = res.height;
+    sourceFormat.m_color_format = VRM_BAYER_GBRG_8;
+
+    const size_t outputChannels[] = {3, 1};
+    for (size_t o = 0; o < 2; ++o) {
+      const size_t channels = outputChannels[o];
+      const char* output = channels == 3 ? "bgr8" : "mono8";
+      std::vector<uint8_t> reference(res.width * res.height * channels);
+      std::vector<uint8_t> dst(reference.size());
+
+      // Both backends convert between images wrapped around our buffers
+      VRmImageFormat targetFormat = sourceFormat;
+      targetFormat.m_color_format = channels == 3 ? VRM_BGR_3X8 : VRM_GRAY_8;
+      DeviceBackend* backends[] = {&sdk, &simulated};
+      const char* names[] = {"sdk", "simulated backend"};
+      for (size_t b = 0; b < 2; ++b) {
+        DeviceBackend& backend = *backends[b];
+        VRmImage* source = 0;
+        VRmImage* target = 0;
+        double us = -1;
+        if (backend.wrapImage(&source, sourceFormat, &frame[0], res.width) &&
+            backend.wrapImage(&target, targetFormat, &dst[0], res.width * channels)) {
+          us = benchmarkBackend(backend, source, target);
+        }
+        if (source) backend.freeImage(&source);
+        if (target) backend.freeImage(&target);
+        printRow(res, output, names[b], us);
+      }
+
+      for (int a = 0; a < 2; ++a) {
+        const DemosaicAlgorithm algorithm = a == 0 ? DEMOSAIC_BILINEAR : DEMOSAIC_EDGE_AWARE;
+        for (size_t m = 0; m < sizeof(METHODS) / sizeof(METHODS[0]); ++m) {
+          if (!demosaicMethodSupported(METHODS[m])) continue;
+
+          const double us = benchmarkDemosaic(frame, res, m == 0 ? reference : dst, channels, algorithm, METHODS[m]);
+          if (m > 0 && dst != reference) {
+            printf("%s produced a different image than the scalar kernel\n", demosaicMethodName(METHODS[m]));
+            return 1;
+          }
+
+          char converter[32];
+          snprintf(converter, sizeof(converter), "%s %s", a == 0 ? "bilinear" : "edge-aware",
+                   demosaicMethodName(METHODS[m]));
+          printRow(res, output, converter, us);
+        }
+      }
+    }
+  }
+  return 0;
+}
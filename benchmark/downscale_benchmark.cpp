@@ -0,0 +1,116 @@
+// Compares the downscale methods of downscale.hpp, which shrink the preview images, for
+// common sensor resolutions. The vector method is checked against the scalar reference on
+// them and on narrow images whose rows end at every position within a vector, including
+// ones smaller than a block.
+
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+#include "downscale.hpp"
+
+using namespace vrmagic;
+
+struct Resolution {
+  size_t width;
+  size_t height;
+};
+
+static const Resolution RESOLUTIONS[] = {{754, 480}, {753, 479}, {1280, 1024}, {2048, 1536}};
+static const DownscaleMethod METHODS[] = {DOWNSCALE_SCALAR, DOWNSCALE_SSSE3};
+static const size_t CHANNELS[] = {1, 3, 4};
+static const size_t FACTORS[] = {2, 4};
+static const int ITERATIONS = 100;
+// Narrow images up to this width cover every row tail of the 48 byte vectors for all
+// channels and factors
+static const size_t MAX_CHECK_WIDTH = 2 * 48 + 4;
+static const size_t CHECK_HEIGHTS[] = {1, 4, 7};
+
+// Target of src, shrunk by `method`. Returns the microseconds per image if timed.
+static double shrink(DownscaleMethod method, const std::vector<uint8_t>& src, const Resolution& res, size_t channels,
+                     size_t factor, bool timed, std::vector<uint8_t>& dst) {
+  const size_t dstPitch = res.width / factor * channels;
+  // Targets start out different for the scalar and the vector code, so a pixel either one
+  // skips shows up as a difference
+  dst.assign(dstPitch * (res.height / factor), method == DOWNSCALE_SCALAR ? 0x00 : 0xff);
+  std::vector<uint16_t> rowSums;
+  downscale(src.data(), res.width * channels, dst.data(), dstPitch, res.width, res.height, channels, factor, rowSums,
+            method);
+  if (!timed) return 0;
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (int i = 0; i < ITERATIONS; ++i) {
+    downscale(src.data(), res.width * channels, dst.data(), dstPitch, res.width, res.height, channels, factor,
+              rowSums, method);
+  }
+  std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count() / ITERATIONS;
+}
+
+static std::vector<uint8_t> testImage(const Resolution& res, size_t channels) {
+  std::vector<uint8_t> src(res.width * res.height * channels);
+  for (size_t i = 0; i < src.size(); ++i) src[i] = static_cast<uint8_t>(i * 7 + i / (res.width * channels) * 13);
+  return src;
+}
+
+// Compares the vector method with the scalar one, false on the first difference.
+static bool check(const Resolution& res, size_t channels, size_t factor) {
+  const std::vector<uint8_t> src = testImage(res, channels);
+  std::vector<uint8_t> reference, dst;
+  shrink(DOWNSCALE_SCALAR, src, res, channels, factor, false, reference);
+  for (size_t m = 1; m < sizeof(METHODS) / sizeof(METHODS[0]); ++m) {
+    if (!downscaleMethodSupported(METHODS[m])) continue;
+
+    shrink(METHODS[m], src, res, channels, factor, false, dst);
+    if (dst != reference) {
+      printf("%s differs from the scalar code for %zux%zu, %zu channels, factor %zu\n",
+             downscaleMethodName(METHODS[m]), res.width, res.height, channels, factor);
+      return false;
+    }
+  }
+  return true;
+}
+
+int main() {
+  for (size_t c = 0; c < sizeof(CHANNELS) / sizeof(CHANNELS[0]); ++c) {
+    for (size_t f = 0; f < sizeof(FACTORS) / sizeof(FACTORS[0]); ++f) {
+      for (size_t width = 1; width <= MAX_CHECK_WIDTH; ++width) {
+        for (size_t h = 0; h < sizeof(CHECK_HEIGHTS) / sizeof(CHECK_HEIGHTS[0]); ++h) {
+          const Resolution res = {width, CHECK_HEIGHTS[h]};
+          if (!check(res, CHANNELS[c], FACTORS[f])) return 1;
+        }
+      }
+    }
+  }
+
+  printf("%-11s %-8s %-6s %-8s %12s %10s\n", "resolution", "channels", "factor", "method", "us/frame", "Mpx/s");
+  for (size_t r = 0; r < sizeof(RESOLUTIONS) / sizeof(RESOLUTIONS[0]); ++r) {
+    const Resolution& res = RESOLUTIONS[r];
+    for (size_t c = 0; c < sizeof(CHANNELS) / sizeof(CHANNELS[0]); ++c) {
+      const std::vector<uint8_t> src = testImage(res, CHANNELS[c]);
+      for (size_t f = 0; f < sizeof(FACTORS) / sizeof(FACTORS[0]); ++f) {
+        std::vector<uint8_t> reference, dst;
+        for (size_t m = 0; m < sizeof(METHODS) / sizeof(METHODS[0]); ++m) {
+          if (!downscaleMethodSupported(METHODS[m])) continue;
+
+          const double us = shrink(METHODS[m], src, res, CHANNELS[c], FACTORS[f], true, m == 0 ? reference : dst);
+          if (m > 0 && dst != reference) {
+            printf("%s produced a different image than the scalar code\n", downscaleMethodName(METHODS[m]));
+            return 1;
+          }
+
+          char resolution[32];
+          snprintf(resolution, sizeof(resolution), "%zux%zu", res.width, res.height);
+          printf("%-11s %-8zu %-6zu %-8s %12.1f %10.1f\n",
+                 resolution,
+                 CHANNELS[c],
+                 FACTORS[f],
+                 downscaleMethodName(METHODS[m]),
+                 us,
+                 res.width * res.height / us);
+        }
+      }
+    }
+  }
+  return 0;
+}
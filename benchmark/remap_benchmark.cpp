@@ -0,0 +1,99 @@
+// Compares the remap methods of remap.hpp for common sensor resolutions and odd widths,
+// on a barrel distortion whose corners sample outside the source and on the identity,
+// which samples up to the last row and column. The vector method is checked against the
+// scalar reference. Images are tightly packed, so reads past their end show up in a
+// memory checker.
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "remap.hpp"
+
+using namespace vrmagic;
+
+struct Resolution {
+  size_t width;
+  size_t height;
+};
+
+static const Resolution RESOLUTIONS[] = {{13, 7}, {754, 480}, {753, 479}, {1280, 1024}, {2048, 1536}};
+static const RemapMethod METHODS[] = {REMAP_SCALAR, REMAP_AVX2};
+static const int ITERATIONS = 50;
+
+// Source positions of a barrel distortion centered on the image, pushing the corners out
+// by 10 percent, or of the identity if distortion is false.
+static void buildMaps(const Resolution& res, bool distortion, std::vector<float>& mapX, std::vector<float>& mapY) {
+  const float cx = (res.width - 1) / 2.0f;
+  const float cy = (res.height - 1) / 2.0f;
+  const float corner = cx * cx + cy * cy;
+  mapX.resize(res.width * res.height);
+  mapY.resize(res.width * res.height);
+  for (size_t y = 0; y < res.height; ++y) {
+    for (size_t x = 0; x < res.width; ++x) {
+      const float dx = x - cx;
+      const float dy = y - cy;
+      const float factor = distortion ? 1 + 0.1f * (dx * dx + dy * dy) / corner : 1;
+      mapX[y * res.width + x] = cx + dx * factor;
+      mapY[y * res.width + x] = cy + dy * factor;
+    }
+  }
+}
+
+static double benchmark(RemapMethod method, const std::vector<uint8_t>& src, std::vector<uint8_t>& dst,
+                        const RemapTable& table) {
+  remap(&src[0], &dst[0], table, method);
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (int i = 0; i < ITERATIONS; ++i) remap(&src[0], &dst[0], table, method);
+  std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count() / ITERATIONS;
+}
+
+int main() {
+  printf("%-11s %-6s %-9s %-8s %12s %10s\n", "resolution", "output", "map", "method", "us/frame", "Mpx/s");
+
+  for (size_t r = 0; r < sizeof(RESOLUTIONS) / sizeof(RESOLUTIONS[0]); ++r) {
+    const Resolution& res = RESOLUTIONS[r];
+    const size_t outputChannels[] = {3, 1};
+    for (size_t o = 0; o < 2; ++o) {
+      const size_t channels = outputChannels[o];
+      const size_t step = res.width * channels;
+      std::vector<uint8_t> src(step * res.height);
+      for (size_t i = 0; i < src.size(); ++i) src[i] = static_cast<uint8_t>(i * 7 + i / step * 3);
+      std::vector<uint8_t> reference(src.size());
+      std::vector<uint8_t> dst(src.size());
+
+      for (int d = 0; d < 2; ++d) {
+        std::vector<float> mapX, mapY;
+        buildMaps(res, d == 0, mapX, mapY);
+        RemapTable table;
+        buildRemapTable(&mapX[0], &mapY[0], res.width, res.height, step, channels, table);
+
+        for (size_t m = 0; m < sizeof(METHODS) / sizeof(METHODS[0]); ++m) {
+          if (!remapMethodSupported(METHODS[m])) continue;
+
+          const double us = benchmark(METHODS[m], src, m == 0 ? reference : dst, table);
+          if (m > 0 && dst != reference) {
+            printf("%s produced a different image than the scalar code at %zux%zu\n", remapMethodName(METHODS[m]),
+                   res.width, res.height);
+            return 1;
+          }
+
+          char resolution[32];
+          snprintf(resolution, sizeof(resolution), "%zux%zu", res.width, res.height);
+          printf("%-11s %-6s %-9s %-8s %12.1f %10.1f\n",
+                 resolution,
+                 channels == 3 ? "bgr8" : "mono8",
+                 d == 0 ? "barrel" : "identity",
+                 remapMethodName(METHODS[m]),
+                 us,
+                 res.width * res.height / us);
+        }
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,92 @@
+#ifndef VRMAGIC_BLOCK_MATCHER_H
+#define VRMAGIC_BLOCK_MATCHER_H
+
+#include <cstddef>
+#include <stdint.h>
+#include <vector>
+
+namespace vrmagic {
+
+enum MatchCost {
+  // Sum of absolute intensity differences
+  MATCH_SAD,
+  // Hamming distance of census codes, which compare each pixel with 8 neighbours two pixels
+  // away. Robust against gain and exposure differences between the cameras.
+  MATCH_CENSUS
+};
+
+enum BlockMatchMethod {
+  // Widest vector unit supported by the CPU
+  BLOCK_MATCH_AUTO,
+  // Pixel by pixel, the reference implementation
+  BLOCK_MATCH_SCALAR,
+  BLOCK_MATCH_AVX2
+};
+
+struct BlockMatcherConfig {
+  MatchCost cost;
+  // Disparities searched are [minDisparity, minDisparity + numDisparities)
+  int minDisparity;
+  // Multiple of 16
+  int numDisparities;
+  // Side of the square window whose costs are summed, odd, at most MAX_BLOCK_SIZE
+  int blockSize;
+  // A match is rejected if a disparity other than its neighbours costs at most this many
+  // percent more
+  int uniquenessRatio;
+
+  BlockMatcherConfig() : cost(MATCH_SAD), minDisparity(0), numDisparities(64), blockSize(9), uniquenessRatio(15) {}
+};
+
+// Window costs are summed in 16 bits, which holds the SAD of 15x15 pixels.
+static const int MAX_BLOCK_SIZE = 15;
+
+// Disparity of pixels without a reliable match.
+static const float INVALID_DISPARITY = -1;
+
+// Subpixel disparities are rounded to 1/DISPARITY_SUBPIXELS pixel, as by stereo_image_proc.
+static const int DISPARITY_SUBPIXELS = 16;
+
+const char* blockMatchMethodName(BlockMatchMethod method);
+
+// Returns false if the method cannot run on this CPU.
+bool blockMatchMethodSupported(BlockMatchMethod method);
+
+// Winner-takes-all block matching with subpixel refinement on a rectified pair. The costs
+// of all disparities of a pixel lie next to each other and the window sums are updated
+// incrementally, a row at a time, so the working set is one row of costs. All methods give
+// bit-identical results.
+class BlockMatcher {
+ public:
+  explicit BlockMatcher(const BlockMatcherConfig& config_);
+
+  const BlockMatcherConfig& getConfig() const;
+
+  // Pixels in [x0, x1) x [y0, y1) can get a disparity, the others are always invalid.
+  void getValidWindow(size_t width, size_t height, size_t* x0, size_t* y0, size_t* x1, size_t* y1) const;
+
+  // Disparities of the pixels of the left image, INVALID_DISPARITY where there is no unique
+  // match. disparity holds width x height values, row by row.
+  void compute(const uint8_t* left,
+               const uint8_t* right,
+               size_t pitch,
+               size_t width,
+               size_t height,
+               float* disparity,
+               BlockMatchMethod method = BLOCK_MATCH_AUTO);
+
+ private:
+  BlockMatcherConfig config;
+
+  // Census codes of both images, if the cost is census
+  std::vector<uint8_t> codesLeft;
+  std::vector<uint8_t> codesRight;
+  // Current row of the right image, right to left
+  std::vector<uint8_t> reversed;
+  // Costs summed over the window rows, numDisparities per column
+  std::vector<uint16_t> columnCosts;
+  // Costs summed over the whole window of the current pixel
+  std::vector<uint16_t> windowCosts;
+};
+}
+#endif
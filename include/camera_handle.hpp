@@ -1,7 +1,13 @@
 #ifndef VRMAGIC_CAMERA_HANDLE_H
 #define VRMAGIC_CAMERA_HANDLE_H
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <ros/ros.h>
 
@@ -11,29 +17,271 @@
 
 #include "vrmusbcam2.h"
 
+#include "block_matcher.hpp"
+#include "clock_estimator.hpp"
+#include "demosaic.hpp"
+#include "device_backend.hpp"
+#include "image_pool.hpp"
+#include "port_stats.hpp"
+#include "port_worker.hpp"
+#include "recorder.hpp"
+#include "simulated_backend.hpp"
+#include "thread_pool.hpp"
+
 namespace vrmagic {
 
+// Sensor ports of a device, numbered from 1
+static const VRmDWORD NUM_SENSOR_PORTS = 4;
+
+enum TimestampMode {
+  // Host time taken before waiting for the frame
+  TIMESTAMP_HOST,
+  // Sensor timestamp mapped to host time by an online clock offset and drift estimate
+  TIMESTAMP_SENSOR
+};
+
+enum TriggerMode {
+  // Sensors expose continuously at their own rate
+  TRIGGER_FREE_RUNNING,
+  // The driver triggers all sensors at once at triggerRate
+  TRIGGER_SOFTWARE,
+  // Sensors expose on a pulse at the trigger input of the device
+  TRIGGER_EXTERNAL
+};
+
+enum PairMatching { PAIR_BY_FRAME_COUNTER, PAIR_BY_TIMESTAMP };
+
+enum Converter {
+  // VRmUsbCamConvertImage
+  CONVERTER_SDK,
+  // Built-in kernels of demosaic.hpp, for Bayer sources
+  CONVERTER_BILINEAR,
+  CONVERTER_EDGE_AWARE
+};
+
+enum OutputFormat {
+  // Converted by the SDK
+  OUTPUT_BGR8,
+  OUTPUT_MONO8,
+  // Source format of the sensor, e.g. Bayer, published without conversion. Debayering is
+  // left to image_proc.
+  OUTPUT_RAW
+};
+
+// Part of the sensor a port reads out, in pixels of the whole sensor. A width or height of 0
+// reads the whole sensor. subsampling is 1, 2 or 4 and shrinks the window by that factor in
+// both directions.
+struct SensorWindow {
+  int xOffset;
+  int yOffset;
+  int width;
+  int height;
+  int subsampling;
+
+  SensorWindow() : xOffset(0), yOffset(0), width(0), height(0), subsampling(1) {}
+
+  bool isFullSensor() const { return (width == 0 || height == 0) && subsampling == 1; }
+};
+
+// Sensor port published under its own name, on <name>/image_raw and the topics next to it.
+// Every port has its own format, converter, window and calibration.
+struct PortConfig {
+  std::string name;
+  int port;
+  // tf frame of the sensor's optical center, empty for <cameraName>_<name>_optical_frame.
+  std::string frameId;
+  OutputFormat outputFormat;
+  // Converter used for the frames of the port, unless outputFormat is OUTPUT_RAW.
+  Converter converter;
+  // Set through the sensor properties at startup.
+  SensorWindow window;
+
+  PortConfig(const std::string& name_ = "", int port_ = 1)
+      : name(name_), port(port_), outputFormat(OUTPUT_BGR8), converter(CONVERTER_SDK) {}
+};
+
+// Topics publish only every n-th acquired frame, 1 publishes all of them.
+struct Decimation {
+  int imageRaw;
+  int imageRect;
+  int disparity;
+  int previews;
+
+  Decimation() : imageRaw(1), imageRect(1), disparity(1), previews(1) {}
+};
+
 struct Config {
   /////////////
   // Globals //
   /////////////
 
-  std::string frameId;
   bool enableLogging;
 
   // In ms. When locking the image, an error is thrown after the timeout
   // if the image has not been unlocked until then.
   int timeout;
 
+  // Convert directly into the message buffer instead of an intermediate image that is
+  // copied afterwards.
+  bool zeroCopy;
+
+  // In Hz. Limits the acquisition rate, on the sensors if they support it, otherwise by
+  // skipping frames before conversion. 0 runs at the rate of the sensors.
+  double frameRate;
+
+  // Frames that no topic publishes are not converted.
+  Decimation decimation;
+
+  // Number of preallocated target images and message buffers.
+  int poolSize;
+
+  // Grab the frames of all ports on their own threads instead of one after the other.
+  bool parallelAcquisition;
+
+  // Split the conversion of a frame into stripes converted on this many extra threads,
+  // 0 converts on the grabbing thread.
+  int conversionThreads;
+
+  // Split locking, conversion and publishing into pipeline stages running concurrently,
+  // connected by rings of pipelineDepth frames. Takes precedence over parallelAcquisition.
+  bool pipeline;
+  int pipelineDepth;
+
+  TimestampMode timestampMode;
+
+  // With TRIGGER_SOFTWARE, frames stamped by TIMESTAMP_HOST get the time of their trigger.
+  TriggerMode triggerMode;
+  // In Hz
+  double triggerRate;
+
+  // In s. Delay between the sensor timestamp and the earliest possible arrival of the
+  // frame at the host, subtracted from sensor stamps.
+  double sensorLatency;
+
+  // The first two ports form a stereo pair: their frames are paired and stamped alike, and
+  // the disparity is computed from them. All other ports publish their frames on their own.
+  bool stereo;
+
+  // How left and right frames are paired: by equal sensor frame counters (up to
+  // maxFrameCounterSkew apart) or by sensor timestamps up to maxTimeSkew s apart.
+  PairMatching pairMatching;
+  int maxFrameCounterSkew;
+  double maxTimeSkew;
+  // Frames buffered per port while waiting for a partner.
+  int pairBuffer;
+
+  // Only grab and convert ports that have subscribers. With stopIdleSensor, the sensors
+  // are stopped while nobody subscribes at all.
+  bool lazyAcquisition;
+  bool stopIdleSensor;
+
+  // In Hz. Rate at which statistics are published on /diagnostics, 0 disables them.
+  double diagnosticsRate;
+
+  // Also publish rectified images on image_rect, computed from the calibration.
+  bool rectify;
+
+  // Also publish the disparity of the rectified pair, needs rectify.
+  bool disparity;
+  BlockMatcherConfig blockMatching;
+
+  // Also publish the images shrunk by these factors, 2 on half/ and 4 on quarter/.
+  std::vector<int> previewFactors;
+
+  // Also write the image_raw frames of every port to a POSIX shared memory ring of
+  // sharedMemorySlots frames, see shm_ring.hpp. Such ports are always grabbed, the node
+  // cannot see the readers of a segment.
+  bool sharedMemory;
+  int sharedMemorySlots;
+
+  // Records the source frames of all ports, with their metadata. Ports are always grabbed
+  // while recording.
+  RecorderConfig recording;
+
+  // Either "vrmusbcam" for real hardware or "simulated" for the synthetic test device.
+  std::string backend;
+  // Serial number or product name of the device to open, empty opens the first free one.
+  std::string device;
+  // Calibrations are stored as <cameraName>_<port name>, so that every device of a process
+  // has its own.
+  std::string cameraName;
+  SimulationConfig simulation;
+
   //////////////////////////
   // Sensor configuration //
   //////////////////////////
 
-  int portLeft;
-  int portRight;
+  // At most one entry per sensor port. The windows of a stereo pair have the same size, so
+  // its images match, but can sit at different offsets.
+  std::vector<PortConfig> ports;
 
   // Default values
-  Config() : frameId("VRMAGIC"), enableLogging(false), timeout(5000), portLeft(1), portRight(2) {}
+  Config()
+      : enableLogging(false),
+        timeout(5000),
+        zeroCopy(true),
+        frameRate(0.0),
+        poolSize(4),
+        parallelAcquisition(true),
+        conversionThreads(0),
+        pipeline(false),
+        pipelineDepth(4),
+        timestampMode(TIMESTAMP_HOST),
+        triggerMode(TRIGGER_FREE_RUNNING),
+        triggerRate(10.0),
+        sensorLatency(0.0),
+        stereo(true),
+        pairMatching(PAIR_BY_FRAME_COUNTER),
+        maxFrameCounterSkew(0),
+        maxTimeSkew(0.005),
+        pairBuffer(2),
+        lazyAcquisition(true),
+        stopIdleSensor(false),
+        diagnosticsRate(1.0),
+        rectify(false),
+        disparity(false),
+        sharedMemory(false),
+        sharedMemorySlots(4),
+        backend("vrmusbcam"),
+        cameraName("vrmagic") {
+    ports.push_back(PortConfig("left", 1));
+    ports.push_back(PortConfig("right", 3));
+  }
+};
+
+// Metadata of a grabbed frame.
+struct FrameInfo {
+  VRmDWORD port;
+  VRmDWORD frameCounter;
+  // Frames lost on this port since the previous one
+  VRmDWORD framesDropped;
+
+  // In s, sensor clock
+  double sensorTime;
+  // Host time before locking the frame, and when the lock returned
+  ros::Time triggerTime;
+  ros::Time arrivalTime;
+
+  // Stamp published with the frame, depends on the timestamp mode
+  ros::Time stamp;
+
+  FrameInfo() : port(0), frameCounter(0), framesDropped(0), sensorTime(0) {}
+};
+
+// Copy of a source image, taken so the driver buffer can be unlocked before conversion.
+struct RawFrame {
+  VRmImageFormat format;
+  VRmDWORD pitch;
+  std::vector<VRmBYTE> data;
+  FrameInfo info;
+
+  RawFrame() : pitch(0) {}
+};
+
+// Converted frame, ready for publishing. The message is shared with subscribers once published.
+struct Frame {
+  sensor_msgs::ImagePtr image;
+  FrameInfo info;
 };
 
 void cameraShutdown();
@@ -43,24 +291,104 @@ class CameraHandle {
   CameraHandle(Config conf);
   ~CameraHandle();
 
-  void grabFrameLeft(sensor_msgs::Image& img, const ros::Time& triggerTime);
-  void grabFrameRight(sensor_msgs::Image& img, const ros::Time& triggerTime);
+  // Ports are identified by their index in Config::ports. Returns false if no frame could be
+  // locked, img and info are left untouched then.
+  bool grabFrame(size_t index, sensor_msgs::Image& img, const ros::Time& triggerTime, FrameInfo* info = 0);
+
+  // Grabs a frame on every port that has a message in imgs, concurrently if parallel
+  // acquisition is enabled. Returns when all are done, so this takes as long as the slowest
+  // port rather than the sum of all. infos gets one entry per port. The messages of ports
+  // that failed to grab are reset, so that they are not published.
+  void grabFrames(std::vector<sensor_msgs::ImagePtr>& imgs, const ros::Time& triggerTime, std::vector<FrameInfo>& infos);
+
+  // Starts or stops streaming on all sensors.
+  void setStreaming(bool enable);
+
+  // Takes the next frame from the driver and drops it without conversion.
+  bool skipFrame(size_t index);
+
+  // Pipeline stages: lock a frame and copy it out, then convert the copy into a message.
+  bool grabRawFrame(size_t index, RawFrame& frame);
+  void convertRawFrame(size_t index, RawFrame& frame, sensor_msgs::Image& img);
+
+  const Config& getConfig() const;
+  // Statistics of a port, maxima restart with every call.
+  PortStats takePortStats(size_t index);
+  PoolStats getImagePoolStats() const;
+  // 0 unless recording
+  const Recorder* getRecorder() const;
 
  private:
-  VRmUsbCamDevice device;
-  VRmImageFormat sourceFormat;
-  VRmImageFormat targetFormat;
+  // Formats, buffers and statistics of a port
+  struct Port {
+    VRmImageFormat sourceFormat;
+    VRmImageFormat targetFormat;
+    // image_encodings name of targetFormat
+    std::string encoding;
+    // Of the source format, for the built-in converters
+    BayerPattern bayerPattern;
+    ImagePool* pool;
+
+    // The SDK converts the stripes of a frame into scratch images from stripePool. 0 stripes
+    // if the port converts on one thread.
+    ImagePool* stripePool;
+    VRmDWORD stripeRows;
+    VRmDWORD numStripes;
+
+    // 0 without parallel acquisition, and with the pipeline
+    PortWorker* worker;
+    ClockEstimator clock;
+    PortStatsCollector stats;
+
+    // Index of the sensor clock period the port last passed a frame in, see skipPeriod
+    long lastPeriod;
+  };
+
+  DeviceBackend* backend;
+
+  // In the order of Config::ports
+  std::vector<Port*> ports;
+
+  // Stripe-parallel conversion shared by all ports, 0 if disabled
+  ThreadPool* conversionPool;
+
+  // Takes a copy of every locked frame, 0 unless recording
+  Recorder* recorder;
 
   Config conf;
 
   void initCamera();
   void openDevice();
-  void getSourceFormat();
-  void setTargetFormat();
+  void setSensorWindow(VRmDWORD port, const SensorWindow& window);
+  void getSourceFormat(size_t index);
+  void setTargetFormat(size_t index);
+  void setupStripes(size_t index);
+  void setFrameRate();
+  void setTriggerMode();
 
   void startCamera();
+  void startRecording();
+
+  // Software trigger thread and the host times of the recent triggers, newest last
+  std::thread triggerThread;
+  std::mutex triggerMutex;
+  std::condition_variable triggerWake;
+  bool stopTrigger;
+  std::deque<ros::Time> triggerTimes;
+  std::atomic<bool> streaming;
+
+  void triggerLoop();
+  ros::Time triggerTimeBefore(const ros::Time& arrival);
+
+  // In s, 0 unless the frame rate is limited by skipping frames. A port passes one frame per
+  // period of its sensor clock.
+  double skipPeriod;
 
-  void grabFrame(VRmDWORD port, sensor_msgs::Image& img, const ros::Time& triggerTime);
+  bool lockFrame(size_t index, VRmImage** sourceImg, FrameInfo& info);
+  void fillFrameInfo(size_t index, const VRmImage* sourceImg, FrameInfo& info);
+  void recordFrame(const VRmImage* sourceImg, const FrameInfo& info);
+  void convertFrame(size_t index, const VRmImage* sourceImg, sensor_msgs::Image& img, const FrameInfo& info);
+  void convertStripe(size_t index, const VRmImage* sourceImg, sensor_msgs::Image& img, size_t stripe);
 };
 }
 #endif
@@ -0,0 +1,56 @@
+#ifndef VRMAGIC_CLOCK_ESTIMATOR_H
+#define VRMAGIC_CLOCK_ESTIMATOR_H
+
+#include <deque>
+#include <mutex>
+
+namespace vrmagic {
+
+// Online estimate of the mapping from camera clock to host clock, both in seconds.
+//
+// Every frame gives one observation: the sensor timestamp and the host time at which the
+// frame arrived. Arrival = skew * camera + offset + delay, where the delay is always
+// positive but jitters with USB and scheduling. The skew (clock drift) is fitted by least
+// squares over a sliding window, the offset is taken from the lower envelope of the
+// observations, i.e. the frame with the least delay, so jitter does not leak into stamps.
+class ClockEstimator {
+ public:
+  // window: number of observations to fit over.
+  // maxSkew: bound on |skew - 1|, drift of real oscillators is far below 1e-3.
+  explicit ClockEstimator(size_t window = 1000, double maxSkew = 5e-4);
+
+  // Adds an observation and returns the host time of cameraTime under the updated fit.
+  // A camera clock running backwards or jumping by more than a second resets the fit.
+  double update(double cameraTime, double hostTime);
+
+  // Host time of cameraTime under the current fit. Only valid after an update().
+  double toHost(double cameraTime) const;
+
+  double getSkew() const;
+  size_t getNumObservations() const;
+
+  void reset();
+
+ private:
+  struct Observation {
+    double camera;
+    double host;
+  };
+
+  size_t window;
+  double maxSkew;
+
+  // Observations are stored relative to the first one to keep the fit well conditioned
+  double baseCamera;
+  double baseHost;
+  std::deque<Observation> observations;
+
+  double skew;
+  double offset;
+
+  mutable std::mutex mutex;
+
+  void fit();
+};
+}
+#endif
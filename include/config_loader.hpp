@@ -0,0 +1,21 @@
+#ifndef VRMAGIC_CONFIG_LOADER_H
+#define VRMAGIC_CONFIG_LOADER_H
+
+#include <string>
+#include <vector>
+
+#include <ros/ros.h>
+
+#include "camera_handle.hpp"
+
+namespace vrmagic {
+
+// Reads the driver parameters below nh into config, keeping its values for unset ones.
+// Returns false after logging if a parameter has an invalid value.
+bool loadConfig(const ros::NodeHandle& nh, Config& config);
+
+// Names of the devices to run in one process, each configured below nh/<name>. Empty for a
+// single device configured directly below nh.
+std::vector<std::string> loadDeviceNames(const ros::NodeHandle& nh);
+}
+#endif
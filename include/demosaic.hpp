@@ -0,0 +1,70 @@
+#ifndef VRMAGIC_DEMOSAIC_H
+#define VRMAGIC_DEMOSAIC_H
+
+#include <cstddef>
+#include <stdint.h>
+
+namespace vrmagic {
+
+// Colors of the top left 2x2 cell, row by row.
+enum BayerPattern { BAYER_RGGB, BAYER_BGGR, BAYER_GRBG, BAYER_GBRG };
+
+enum DemosaicAlgorithm {
+  // Missing colors are the mean of the nearest samples of that color
+  DEMOSAIC_BILINEAR,
+  // Green is interpolated along the direction with the smaller gradient, which avoids the
+  // zipper artifacts of bilinear interpolation along edges. Red and blue as for bilinear.
+  DEMOSAIC_EDGE_AWARE
+};
+
+enum DemosaicOutput { DEMOSAIC_BGR8, DEMOSAIC_MONO8 };
+
+enum DemosaicMethod {
+  // Widest vector unit supported by the CPU
+  DEMOSAIC_AUTO,
+  // Pixel by pixel, the reference implementation
+  DEMOSAIC_SCALAR,
+  DEMOSAIC_SSSE3,
+  DEMOSAIC_AVX2,
+  DEMOSAIC_NEON
+};
+
+const char* demosaicMethodName(DemosaicMethod method);
+
+// Returns false if the method cannot run on this CPU.
+bool demosaicMethodSupported(DemosaicMethod method);
+
+// The method demosaic() actually runs for `method`: itself if supported, otherwise the
+// widest supported one.
+DemosaicMethod resolveDemosaicMethod(DemosaicMethod method);
+
+// Converts a Bayer image of width x height pixels into BGR or mono. Width and height must
+// be even and at least 2; pixels outside the image are mirrored. All methods give
+// bit-identical results.
+void demosaic(const uint8_t* src,
+              size_t srcPitch,
+              uint8_t* dst,
+              size_t dstPitch,
+              size_t width,
+              size_t height,
+              BayerPattern pattern,
+              DemosaicAlgorithm algorithm,
+              DemosaicOutput output,
+              DemosaicMethod method = DEMOSAIC_AUTO);
+
+// As demosaic(), but only writes rows [rowBegin, rowEnd) of dst. The rows around them are
+// read as needed, so converting an image in stripes gives the same result as in one go.
+void demosaicRows(const uint8_t* src,
+                  size_t srcPitch,
+                  uint8_t* dst,
+                  size_t dstPitch,
+                  size_t width,
+                  size_t height,
+                  BayerPattern pattern,
+                  DemosaicAlgorithm algorithm,
+                  DemosaicOutput output,
+                  size_t rowBegin,
+                  size_t rowEnd,
+                  DemosaicMethod method = DEMOSAIC_AUTO);
+}
+#endif
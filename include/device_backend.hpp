@@ -0,0 +1,61 @@
+#ifndef VRMAGIC_DEVICE_BACKEND_H
+#define VRMAGIC_DEVICE_BACKEND_H
+
+#include <string>
+
+#include "vrmusbcam2.h"
+
+namespace vrmagic {
+
+VRmDWORD bytesPerPixel(VRmColorFormat format);
+
+// Interface between CameraHandle and the device it grabs from. The methods mirror the
+// VRmUsbCam calls the driver needs, so the hardware backend is a thin forwarding layer
+// and alternative backends (e.g. the simulated one) can be dropped in without touching
+// the grab path. All methods return false on failure, getLastError() then describes it.
+class DeviceBackend {
+ public:
+  virtual ~DeviceBackend() {}
+
+  // State of the backend's library shared by all devices of the process. enableLogging() is
+  // called before the device is opened, cleanup() once no device of this backend is open.
+  virtual bool enableLogging() = 0;
+  virtual void cleanup() = 0;
+
+  // Opens the first suitable device. Returns false if none could be opened.
+  virtual bool openDevice() = 0;
+  virtual void closeDevice() = 0;
+
+  virtual bool getSourceFormat(VRmDWORD port, VRmImageFormat* format) = 0;
+  virtual bool getTargetFormatListSize(VRmDWORD port, VRmDWORD* size) = 0;
+  virtual bool getTargetFormatListEntry(VRmDWORD port, VRmDWORD index, VRmImageFormat* format) = 0;
+
+  // Properties of the device. Sensor properties, e.g. the region of interest, apply to the
+  // sensor selected by VRM_PROPID_GRAB_SENSOR_PROPS_SELECT_E.
+  virtual bool getPropertySupported(VRmPropId id, bool* supported) = 0;
+  virtual bool setPropertyValueB(VRmPropId id, bool value) = 0;
+  virtual bool setPropertyValueE(VRmPropId id, VRmPropId value) = 0;
+  virtual bool setPropertyValueF(VRmPropId id, float value) = 0;
+  virtual bool setPropertyValueRectI(VRmPropId id, const VRmRectI& value) = 0;
+
+  virtual bool resetFrameCounter() = 0;
+  virtual bool start() = 0;
+  virtual bool stop() = 0;
+
+  virtual bool lockNextImage(VRmDWORD port, VRmImage** image, VRmDWORD* framesDropped, int timeout) = 0;
+  virtual bool unlockNextImage(VRmImage** image) = 0;
+  // Sensor frame counter of a locked image. Its m_time_stamp holds the sensor time in ms.
+  virtual bool getFrameCounter(const VRmImage* image, VRmDWORD* frameCounter) = 0;
+
+  virtual bool newImage(VRmImage** image, const VRmImageFormat& format) = 0;
+  // Creates an image header around a caller owned buffer, e.g. a message payload, so it can
+  // be used as conversion target. freeImage() releases the header but not the buffer.
+  virtual bool wrapImage(VRmImage** image, const VRmImageFormat& format, VRmBYTE* buffer, VRmDWORD pitch) = 0;
+  virtual bool freeImage(VRmImage** image) = 0;
+  virtual bool convertImage(const VRmImage* source, VRmImage* target) = 0;
+  virtual bool getColorFormatString(VRmColorFormat format, const char** name) = 0;
+
+  virtual const char* getLastError() = 0;
+};
+}
+#endif
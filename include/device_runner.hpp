@@ -0,0 +1,37 @@
+#ifndef VRMAGIC_DEVICE_RUNNER_H
+#define VRMAGIC_DEVICE_RUNNER_H
+
+#include <atomic>
+#include <thread>
+
+#include <ros/callback_queue.h>
+#include <ros/ros.h>
+
+#include "camera_handle.hpp"
+#include "vrmagic_node.hpp"
+
+namespace vrmagic {
+
+// One device with its node, grabbed and published on a thread of its own, so several
+// devices run side by side in one process. Timers of the node are served by the same
+// thread, like spinOnce() does for a single device, so they never run concurrently with
+// publishing.
+class DeviceRunner {
+ public:
+  // Opens the device of config and publishes below nh.
+  DeviceRunner(const ros::NodeHandle& nh_, const Config& config);
+  ~DeviceRunner();
+
+ private:
+  ros::CallbackQueue queue;
+  ros::NodeHandle nh;
+  CameraHandle* cam;
+  VrMagicNode* node;
+
+  std::atomic<bool> running;
+  std::thread thread;
+
+  void run();
+};
+}
+#endif
@@ -0,0 +1,39 @@
+#ifndef VRMAGIC_DOWNSCALE_H
+#define VRMAGIC_DOWNSCALE_H
+
+#include <cstddef>
+#include <stdint.h>
+#include <vector>
+
+namespace vrmagic {
+
+enum DownscaleMethod {
+  // Widest vector unit supported by the CPU
+  DOWNSCALE_AUTO,
+  // Pixel by pixel, the reference implementation
+  DOWNSCALE_SCALAR,
+  DOWNSCALE_SSSE3
+};
+
+const char* downscaleMethodName(DownscaleMethod method);
+
+// Returns false if the method cannot run on this CPU.
+bool downscaleMethodSupported(DownscaleMethod method);
+
+// Shrinks an image of width x height pixels with `channels` bytes each by `factor` in both
+// directions, every target pixel the rounded mean of a factor x factor block. Pixels that
+// do not fill a whole block at the right and bottom are dropped, so the target has
+// width / factor x height / factor pixels. channels is 1, 3 or 4 and factor 2 or 4. `rowSums` is scratch space.
+// All methods give bit-identical results.
+void downscale(const uint8_t* src,
+               size_t srcPitch,
+               uint8_t* dst,
+               size_t dstPitch,
+               size_t width,
+               size_t height,
+               size_t channels,
+               size_t factor,
+               std::vector<uint16_t>& rowSums,
+               DownscaleMethod method = DOWNSCALE_AUTO);
+}
+#endif
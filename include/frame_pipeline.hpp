@@ -0,0 +1,60 @@
+#ifndef VRMAGIC_FRAME_PIPELINE_H
+#define VRMAGIC_FRAME_PIPELINE_H
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <sensor_msgs/Image.h>
+
+#include "camera_handle.hpp"
+#include "message_pool.hpp"
+#include "spsc_ring.hpp"
+
+namespace vrmagic {
+
+// Acquisition pipeline of one sensor port. A lock thread takes frames from the driver and
+// unlocks them right after copying, a convert thread turns them into messages, and the
+// publisher consumes those with pop()/release(). Stages are connected by lock-free rings;
+// frames and messages are preallocated and cycle back through free rings.
+class PortPipeline {
+ public:
+  // Runs the port with the given index in Config::ports.
+  PortPipeline(CameraHandle* cam, size_t index, size_t depth);
+  ~PortPipeline();
+
+  // Next converted frame, or 0 if none arrived within timeout ms.
+  Frame* pop(int timeout);
+  // Hands a frame obtained from pop() back to the convert stage. Its message is dropped, the
+  // publisher may still share it with subscribers.
+  void release(Frame* frame);
+
+  // An inactive pipeline stops locking new frames, frames already in flight still arrive.
+  void setActive(bool active);
+
+  PoolStats getMessageStats() const;
+
+ private:
+  CameraHandle* cam;
+  size_t index;
+  int timeout;
+
+  std::vector<RawFrame> rawFrames;
+  std::vector<Frame> frames;
+  MessagePool<sensor_msgs::Image> messages;
+
+  SpscRing<RawFrame*> freeRaw;
+  SpscRing<RawFrame*> lockedRaw;
+  SpscRing<Frame*> freeFrames;
+  SpscRing<Frame*> convertedFrames;
+
+  std::atomic<bool> active;
+  std::atomic<bool> stopping;
+  std::thread lockThread;
+  std::thread convertThread;
+
+  void lockLoop();
+  void convertLoop();
+};
+}
+#endif
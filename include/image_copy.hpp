@@ -0,0 +1,35 @@
+#ifndef VRMAGIC_IMAGE_COPY_H
+#define VRMAGIC_IMAGE_COPY_H
+
+#include <cstddef>
+#include <stdint.h>
+
+namespace vrmagic {
+
+enum CopyMethod {
+  // Picks the fastest method supported by the CPU
+  COPY_AUTO,
+  // Byte by byte, the reference implementation
+  COPY_NAIVE,
+  // One memcpy per row, or a single one for contiguous images
+  COPY_MEMCPY,
+  COPY_SSE2,
+  COPY_AVX2
+};
+
+const char* copyMethodName(CopyMethod method);
+
+// Returns false if the method cannot run on this CPU.
+bool copyMethodSupported(CopyMethod method);
+
+// Copies `rows` rows of `rowBytes` bytes each between two strided images. The pitches are
+// the distances in bytes between the starts of two consecutive rows.
+void copyImage(const uint8_t* src,
+               size_t srcPitch,
+               uint8_t* dst,
+               size_t dstPitch,
+               size_t rowBytes,
+               size_t rows,
+               CopyMethod method = COPY_AUTO);
+}
+#endif
@@ -0,0 +1,51 @@
+#ifndef VRMAGIC_IMAGE_POOL_H
+#define VRMAGIC_IMAGE_POOL_H
+
+#include <mutex>
+#include <vector>
+
+#include "device_backend.hpp"
+
+namespace vrmagic {
+
+struct PoolStats {
+  unsigned long hits;
+  unsigned long misses;
+
+  PoolStats() : hits(0), misses(0) {}
+};
+
+// Fixed-size pool of conversion target images for one target format. Images are allocated
+// up front by reset(), so grabbing does not touch the heap as long as no more than
+// `capacity` of them are in flight. A miss allocates a fresh image, which is adopted by the
+// pool on release if there is room. Message payloads are recycled with their messages by
+// MessagePool instead.
+class ImagePool {
+ public:
+  explicit ImagePool(DeviceBackend* backend);
+  ~ImagePool();
+
+  // Drops all pooled images and preallocates `capacity` of them for the given format.
+  void reset(const VRmImageFormat& format, size_t capacity);
+
+  // Returns 0 if the backend cannot allocate an image.
+  VRmImage* acquireImage();
+  void releaseImage(VRmImage* image);
+
+  PoolStats getImageStats() const;
+
+ private:
+  DeviceBackend* backend;
+  VRmImageFormat format;
+  size_t capacity;
+
+  std::vector<VRmImage*> images;
+
+  PoolStats imageStats;
+
+  mutable std::mutex mutex;
+
+  void clear();
+};
+}
+#endif
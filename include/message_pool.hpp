@@ -0,0 +1,83 @@
+#ifndef VRMAGIC_MESSAGE_POOL_H
+#define VRMAGIC_MESSAGE_POOL_H
+
+#include <mutex>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+#include "image_pool.hpp"
+
+namespace vrmagic {
+
+// Pool of ROS messages handed out as shared pointers, so they can be published without a
+// copy. A message returns to the pool once the last reference is gone, which for
+// intra-process subscribers may be long after publishing. Its buffers keep their capacity,
+// so refilling a recycled message does not allocate. Messages may outlive the pool.
+template <typename M>
+class MessagePool {
+ public:
+  typedef boost::shared_ptr<M> Ptr;
+
+  explicit MessagePool(size_t capacity) : storage(new Storage(capacity)) {
+    for (size_t i = 0; i < capacity; ++i) storage->messages.push_back(new M());
+  }
+
+  // Always succeeds, allocates a new message if all pooled ones are in use.
+  Ptr acquire() {
+    M* msg = 0;
+    {
+      std::lock_guard<std::mutex> lock(storage->mutex);
+      if (!storage->messages.empty()) {
+        msg = storage->messages.back();
+        storage->messages.pop_back();
+        ++storage->stats.hits;
+      } else {
+        ++storage->stats.misses;
+      }
+    }
+
+    if (!msg) msg = new M();
+    return Ptr(msg, Recycler(storage));
+  }
+
+  PoolStats getStats() const {
+    std::lock_guard<std::mutex> lock(storage->mutex);
+    return storage->stats;
+  }
+
+ private:
+  // Shared with all messages in flight, so it stays alive until the last one is back
+  struct Storage {
+    explicit Storage(size_t capacity_) : capacity(capacity_) { messages.reserve(capacity); }
+    ~Storage() {
+      for (size_t i = 0; i < messages.size(); ++i) delete messages[i];
+    }
+
+    std::mutex mutex;
+    size_t capacity;
+    std::vector<M*> messages;
+    PoolStats stats;
+  };
+
+  struct Recycler {
+    boost::shared_ptr<Storage> storage;
+
+    explicit Recycler(const boost::shared_ptr<Storage>& storage_) : storage(storage_) {}
+
+    void operator()(M* msg) const {
+      {
+        std::lock_guard<std::mutex> lock(storage->mutex);
+        if (storage->messages.size() < storage->capacity) {
+          storage->messages.push_back(msg);
+          return;
+        }
+      }
+      delete msg;
+    }
+  };
+
+  boost::shared_ptr<Storage> storage;
+};
+}
+#endif
@@ -0,0 +1,52 @@
+#ifndef VRMAGIC_PORT_STATS_H
+#define VRMAGIC_PORT_STATS_H
+
+#include <mutex>
+
+namespace vrmagic {
+
+struct PortStats {
+  // Totals since start
+  unsigned long frames;
+  unsigned long framesDropped;
+  unsigned long lockTimeouts;
+  // Locked but dropped without conversion, to limit the frame rate or by decimation
+  unsigned long framesSkipped;
+  unsigned long conversions;
+  // In s
+  double lockWaitTotal;
+  double conversionTotal;
+
+  // Maxima since the previous take()
+  double lockWaitMax;
+  double conversionMax;
+
+  PortStats()
+      : frames(0),
+        framesDropped(0),
+        lockTimeouts(0),
+        framesSkipped(0),
+        conversions(0),
+        lockWaitTotal(0),
+        conversionTotal(0),
+        lockWaitMax(0),
+        conversionMax(0) {}
+};
+
+// Thread-safe accumulator for the statistics of one sensor port.
+class PortStatsCollector {
+ public:
+  void addFrame(unsigned long framesDropped, double lockWait);
+  void addLockTimeout(double lockWait);
+  void addSkipped();
+  void addConversion(double duration);
+
+  // Returns the statistics and restarts the maxima.
+  PortStats take();
+
+ private:
+  PortStats stats;
+  std::mutex mutex;
+};
+}
+#endif
@@ -0,0 +1,33 @@
+#ifndef VRMAGIC_PORT_WORKER_H
+#define VRMAGIC_PORT_WORKER_H
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace vrmagic {
+
+// Thread dedicated to one sensor port. post() hands it a job, wait() blocks until the job
+// has finished, so the jobs of several ports run concurrently between the two calls.
+class PortWorker {
+ public:
+  PortWorker();
+  ~PortWorker();
+
+  // At most one job can be pending, post() waits for the previous one first.
+  void post(const std::function<void()>& job);
+  void wait();
+
+ private:
+  std::thread thread;
+  std::mutex mutex;
+  std::condition_variable cond;
+  std::function<void()> job;
+  bool busy;
+  bool stopping;
+
+  void run();
+};
+}
+#endif
@@ -0,0 +1,173 @@
+#ifndef VRMAGIC_RECORDER_H
+#define VRMAGIC_RECORDER_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Recordings of the source frames of all ports, as the sensors deliver them. A recording is a
+// directory with an index file and segment files. The segments are preallocated and
+// memory-mapped, frames are stored back to back. The index holds one fixed-size entry per
+// frame, in the order the frames were recorded, so frame n is found in O(1). Neither this
+// header nor the library depend on ROS or the camera SDK.
+
+namespace vrmagic {
+
+struct RecorderConfig {
+  // Directory recordings go to, each into a subdirectory named after the camera and the
+  // start time. Empty disables recording.
+  std::string path;
+
+  // In MB. Size the segment files are preallocated with, the last one is truncated.
+  int segmentSize;
+
+  // Frames that can wait for the I/O thread. Frames arriving while all are taken are not
+  // recorded, acquisition never waits for the disk.
+  int bufferFrames;
+
+  RecorderConfig() : segmentSize(1024), bufferFrames(32) {}
+};
+
+// Index entry of a frame. Times are in s and ns since the epoch, except sensorTime.
+struct RecordedFrame {
+  // Byte offset of the pixels in segment file number segment
+  uint64_t offset;
+  uint32_t segment;
+  uint32_t bytes;
+
+  uint32_t port;
+  uint32_t frameCounter;
+  // Frames the driver lost on this port since the previous one
+  uint32_t framesDropped;
+  // Frames of this port the recorder could not keep since the previous recorded one
+  uint32_t framesNotRecorded;
+
+  // VRmColorFormat of the sensor; rows are packed, pitch bytes each
+  uint32_t colorFormat;
+  uint32_t width;
+  uint32_t height;
+  uint32_t pitch;
+
+  // In s, sensor clock
+  double sensorTime;
+  uint32_t stampSec;
+  uint32_t stampNsec;
+  uint32_t arrivalSec;
+  uint32_t arrivalNsec;
+};
+
+struct RecorderStats {
+  uint64_t framesRecorded;
+  uint64_t framesNotRecorded;
+  uint64_t bytesRecorded;
+
+  RecorderStats() : framesRecorded(0), framesNotRecorded(0), bytesRecorded(0) {}
+};
+
+class Recorder {
+ public:
+  Recorder(const RecorderConfig& conf_);
+  ~Recorder();
+
+  // Creates the directory of the recording and starts the I/O thread. Returns false on errors.
+  bool start(const std::string& directory);
+  // Writes the frames still waiting, then closes the recording. Also done on destruction.
+  void stop();
+
+  // Copies a frame for the I/O thread, from rows pitch bytes apart. The recorder fills in
+  // where the frame is stored, its bytes and framesNotRecorded. Safe to call from several
+  // threads. Returns false if the frame could not be kept, or the recording failed.
+  bool record(const RecordedFrame& info, const uint8_t* pixels, size_t pitch);
+
+  RecorderStats getStats() const;
+  // Set once writing failed, e.g. because the disk is full. Nothing is recorded after that.
+  bool failed() const;
+  std::string getLastError() const;
+
+ private:
+  struct Buffer {
+    RecordedFrame info;
+    std::vector<uint8_t> data;
+  };
+
+  RecorderConfig conf;
+  std::string directory;
+
+  std::thread thread;
+  mutable std::mutex mutex;
+  std::condition_variable cond;
+  std::vector<Buffer*> buffers;
+  std::vector<Buffer*> freeBuffers;
+  std::deque<Buffer*> queue;
+  // Per port, frames not recorded since the last recorded one
+  std::map<uint32_t, uint32_t> notRecorded;
+  bool stopping;
+  bool error;
+  std::string lastError;
+  RecorderStats stats;
+
+  // Owned by the I/O thread
+  int segmentFd;
+  uint8_t* segment;
+  uint32_t segmentNumber;
+  size_t segmentUsed;
+  int indexFd;
+  uint8_t* index;
+  size_t indexCapacity;
+  uint64_t frames;
+
+  void run();
+  bool write(Buffer& buffer);
+  bool openSegment();
+  void closeSegment();
+  bool growIndex();
+  void closeIndex();
+  bool fail(const std::string& message);
+};
+
+// Reads a recording, also while it is still being written. Frames recorded after open()
+// are found after calling refresh().
+class RecordingReader {
+ public:
+  RecordingReader();
+  ~RecordingReader();
+
+  bool open(const std::string& directory_);
+  void close();
+  bool refresh();
+
+  uint64_t getFrameCount() const;
+
+  // Entry and pixels of frame n, which stay valid until the reader is closed. Returns false
+  // if there is no such frame.
+  bool getFrame(uint64_t n, RecordedFrame& info, const uint8_t** pixels);
+
+  const char* getLastError() const;
+
+ private:
+  struct Mapping {
+    uint8_t* data;
+    size_t size;
+  };
+
+  std::string directory;
+  Mapping index;
+  uint64_t frames;
+  std::vector<Mapping> segments;
+  std::string lastError;
+
+  bool mapSegment(uint32_t number);
+  bool setError(const std::string& message);
+};
+
+// File of a segment and of the index of a recording.
+std::string recordingSegmentPath(const std::string& directory, uint32_t segment);
+std::string recordingIndexPath(const std::string& directory);
+}
+#endif
@@ -0,0 +1,34 @@
+#ifndef VRMAGIC_RECTIFIER_H
+#define VRMAGIC_RECTIFIER_H
+
+#include <sensor_msgs/CameraInfo.h>
+#include <sensor_msgs/Image.h>
+
+#include "remap.hpp"
+
+namespace vrmagic {
+
+// Undistorts and rectifies the images of one camera. The remap table is computed once from
+// the calibration, so a frame costs a single pass of bilinear interpolation.
+class Rectifier {
+ public:
+  Rectifier();
+
+  // The table is rebuilt for the new calibration on the next rectify(). A binning and roi in
+  // info describe the sensor window the images come from.
+  void setCameraInfo(const sensor_msgs::CameraInfo& info);
+
+  // Returns false if the calibration cannot rectify images like src.
+  bool rectify(const sensor_msgs::Image& src, sensor_msgs::Image& dst);
+
+ private:
+  sensor_msgs::CameraInfo cameraInfo;
+  RemapTable table;
+  bool tableValid;
+  // The calibration did not fit, rectify() fails until the next setCameraInfo()
+  bool failed;
+
+  bool buildTable(const sensor_msgs::Image& img);
+};
+}
+#endif
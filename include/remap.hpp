@@ -0,0 +1,56 @@
+#ifndef VRMAGIC_REMAP_H
+#define VRMAGIC_REMAP_H
+
+#include <cstddef>
+#include <stdint.h>
+#include <vector>
+
+namespace vrmagic {
+
+// Source positions are rounded to 1/REMAP_SCALE pixel.
+static const int REMAP_BITS = 5;
+static const int REMAP_SCALE = 1 << REMAP_BITS;
+
+// Where every pixel of a remapped image samples the source, in fixed point. A table holds
+// byte offsets, so it only fits images of the layout it was built for.
+struct RemapTable {
+  size_t width;
+  size_t height;
+  size_t step;
+  size_t channels;
+
+  // Byte offset of the top left of the 2x2 source pixels a pixel is interpolated from,
+  // -1 if it samples outside the source
+  std::vector<int32_t> offsets;
+  // Position within those pixels in 1/REMAP_SCALE pixel, x in the low and y in the high byte
+  std::vector<uint16_t> fractions;
+};
+
+enum RemapMethod {
+  // Widest vector unit supported by the CPU
+  REMAP_AUTO,
+  // Pixel by pixel, the reference implementation
+  REMAP_SCALAR,
+  REMAP_AVX2
+};
+
+const char* remapMethodName(RemapMethod method);
+
+// Returns false if the method cannot run on this CPU.
+bool remapMethodSupported(RemapMethod method);
+
+// Builds the table for images of width x height pixels of `channels` bytes, with rows of
+// `step` bytes. mapX and mapY hold the source position of every pixel, row by row.
+void buildRemapTable(const float* mapX,
+                     const float* mapY,
+                     size_t width,
+                     size_t height,
+                     size_t step,
+                     size_t channels,
+                     RemapTable& table);
+
+// Interpolates dst bilinearly from src, both in the layout of the table. Pixels sampling
+// outside src are black. All methods give bit-identical results.
+void remap(const uint8_t* src, uint8_t* dst, const RemapTable& table, RemapMethod method = REMAP_AUTO);
+}
+#endif
@@ -0,0 +1,102 @@
+#ifndef VRMAGIC_SHM_RING_H
+#define VRMAGIC_SHM_RING_H
+
+#include <atomic>
+#include <cstddef>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Frames of a port in a POSIX shared memory segment, for readers on the same host. The
+// segment holds a ring of slots; frame n goes to slot n % slots and overwrites the oldest.
+// Every slot is guarded by a seqlock, so the writer never waits for readers and a reader
+// detects a frame that was overwritten while it read it. This header does not depend on
+// ROS or the camera SDK, readers only link the vrmagic_shm library.
+
+namespace vrmagic {
+
+struct ShmFrameInfo {
+  // Frames written to the segment before this one
+  uint64_t sequence;
+  uint32_t stampSec;
+  uint32_t stampNsec;
+  uint32_t frameCounter;
+  uint32_t width;
+  uint32_t height;
+  uint32_t step;
+  uint32_t dataBytes;
+  // image_encodings name, zero terminated
+  char encoding[32];
+};
+
+// Name of the segment a port publishes to, from its namespace: /vrmagic.left for /vrmagic/left.
+std::string shmSegmentName(const std::string& ns);
+
+class ShmRingWriter {
+ public:
+  ShmRingWriter(const std::string& name_, size_t slots_);
+  // Marks the segment closed for its readers and removes it.
+  ~ShmRingWriter();
+
+  // Copies a frame into the next slot. The segment is created with the first frame, whose
+  // size fixes that of the slots; larger frames are rejected. Returns false on errors.
+  bool write(const ShmFrameInfo& info, const uint8_t* data);
+
+  const char* getLastError() const;
+
+ private:
+  std::string name;
+  size_t slots;
+  uint8_t* base;
+  size_t size;
+  std::string lastError;
+
+  bool create(size_t slotBytes);
+  bool setError(const std::string& message);
+};
+
+class ShmRingReader {
+ public:
+  ShmRingReader();
+  ~ShmRingReader();
+
+  // Maps an existing segment, reading starts with the frame written next. Returns false if
+  // there is none yet.
+  bool open(const std::string& name);
+  void close();
+  bool isOpen() const;
+
+  // The writer went away, e.g. because the driver restarted. Reopen to get new frames.
+  bool writerClosed() const;
+
+  // Waits up to timeout ms for a frame that was not read yet.
+  bool wait(int timeout) const;
+
+  // Skips to the newest frame, e.g. for consumers that only want the latest one.
+  void seekLatest();
+
+  // Copies the next unread frame into data. A frame that was overwritten before it could be
+  // read is skipped and counted as missed. Returns false if there is no new frame.
+  bool readNext(ShmFrameInfo& info, std::vector<uint8_t>& data);
+
+  // Like readNext(), but returns the pixels in place instead of copying them. They stay
+  // until the writer comes around the ring, so check isValid() after using them and
+  // discard the results if it returns false.
+  const uint8_t* peekNext(ShmFrameInfo& info);
+  bool isValid(const ShmFrameInfo& info) const;
+
+  uint64_t getFramesMissed() const;
+  const char* getLastError() const;
+
+ private:
+  uint8_t* base;
+  size_t size;
+  uint64_t next;
+  uint64_t missed;
+  std::string lastError;
+
+  const uint8_t* lockNext(ShmFrameInfo& info);
+  bool setError(const std::string& message);
+};
+}
+#endif
@@ -0,0 +1,155 @@
+#ifndef VRMAGIC_SIMULATED_BACKEND_H
+#define VRMAGIC_SIMULATED_BACKEND_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "device_backend.hpp"
+
+namespace vrmagic {
+
+struct SimulationConfig {
+  int width;
+  int height;
+  VRmColorFormat colorFormat;
+
+  // Bytes per row of the source images, 0 means tightly packed.
+  int pitch;
+
+  // Frames per second delivered on every port.
+  double frameRate;
+
+  // Probability in [0, 1] that a frame is lost before it can be locked.
+  double dropProbability;
+
+  // In ms. Added on top of the frame period when locking an image, models USB transfer time.
+  double lockLatency;
+
+  // In ppm. Rate difference between the simulated sensor clock and the host clock.
+  double clockDrift;
+
+  // Default values match the stereo head we ship with
+  SimulationConfig()
+      : width(754),
+        height(480),
+        colorFormat(VRM_BAYER_GBRG_8),
+        pitch(0),
+        frameRate(30.0),
+        dropProbability(0.0),
+        lockLatency(0.0),
+        clockDrift(0.0) {}
+};
+
+bool colorFormatFromString(const std::string& name, VRmColorFormat* format);
+
+// Synthetic device producing test pattern frames at a fixed rate on all four sensor ports.
+// Each port supports a region of interest, subsampling and a maximum acquisition rate, like
+// the real sensors. In software trigger mode all ports expose when triggered, in external
+// trigger mode a trigger generator running at the configured frame rate is simulated. Used
+// to benchmark the grab/convert/publish path on machines without a camera attached.
+class SimulatedBackend : public DeviceBackend {
+ public:
+  explicit SimulatedBackend(const SimulationConfig& conf);
+  ~SimulatedBackend();
+
+  bool enableLogging();
+  void cleanup();
+
+  bool openDevice();
+  void closeDevice();
+
+  bool getSourceFormat(VRmDWORD port, VRmImageFormat* format);
+  bool getTargetFormatListSize(VRmDWORD port, VRmDWORD* size);
+  bool getTargetFormatListEntry(VRmDWORD port, VRmDWORD index, VRmImageFormat* format);
+
+  bool getPropertySupported(VRmPropId id, bool* supported);
+  bool setPropertyValueB(VRmPropId id, bool value);
+  bool setPropertyValueE(VRmPropId id, VRmPropId value);
+  bool setPropertyValueF(VRmPropId id, float value);
+  bool setPropertyValueRectI(VRmPropId id, const VRmRectI& value);
+
+  bool resetFrameCounter();
+  bool start();
+  bool stop();
+
+  bool lockNextImage(VRmDWORD port, VRmImage** image, VRmDWORD* framesDropped, int timeout);
+  bool unlockNextImage(VRmImage** image);
+  bool getFrameCounter(const VRmImage* image, VRmDWORD* frameCounter);
+
+  bool newImage(VRmImage** image, const VRmImageFormat& format);
+  bool wrapImage(VRmImage** image, const VRmImageFormat& format, VRmBYTE* buffer, VRmDWORD pitch);
+  bool freeImage(VRmImage** image);
+  bool convertImage(const VRmImage* source, VRmImage* target);
+  bool getColorFormatString(VRmColorFormat format, const char** name);
+
+  const char* getLastError();
+
+ private:
+  typedef std::chrono::steady_clock Clock;
+
+  static const VRmDWORD NUM_PORTS = 4;
+  static const size_t BUFFERS_PER_PORT = 4;
+
+  struct Slot {
+    VRmImage image;
+    std::vector<VRmBYTE> buffer;
+    VRmDWORD port;
+    VRmDWORD frameCounter;
+    bool locked;
+  };
+
+  struct Port {
+    std::mutex mutex;
+    std::vector<Slot> slots;
+    VRmDWORD frameCounter;
+    Clock::time_point nextFrame;
+    // Frame period, longer than that of the sensor if the acquisition rate is limited
+    Clock::duration period;
+    std::mt19937 rng;
+
+    // Exposure times of software triggered frames not locked yet, and the frames lost
+    // because more triggers came in than the driver buffers hold
+    std::deque<Clock::time_point> triggers;
+    VRmDWORD lostTriggers;
+    std::condition_variable triggered;
+
+    // Sensor window, a zero sized roi is the whole sensor
+    VRmRectI roi;
+    int subsampling;
+    VRmImageFormat format;
+  };
+
+  SimulationConfig conf;
+  // Of the whole sensor, ports deliver their window of it
+  VRmImageFormat sourceFormat;
+  std::vector<VRmColorFormat> targetColorFormats;
+  // Port whose sensor properties are set, 0 if none was selected
+  VRmDWORD selectedPort;
+  // VRM_PROPID_GRAB_MODE_FREERUNNING, _TRIGGERED_SOFT or _TRIGGERED_EXT. Atomic like running,
+  // as the lock and trigger threads read them while start(), stop() and the setters run.
+  std::atomic<VRmPropId> grabMode;
+
+  bool opened;
+  std::atomic<bool> running;
+  Clock::time_point epoch;
+  Clock::duration period;
+  std::vector<Port*> ports;
+
+  bool setError(const std::string& message);
+  Port* getPort(VRmDWORD port);
+  bool resizePort(VRmDWORD port);
+  bool waitForTrigger(Port& p,
+                      std::unique_lock<std::mutex>& lock,
+                      Clock::time_point deadline,
+                      Clock::time_point* frameTime,
+                      VRmDWORD* dropped);
+  void renderPattern(VRmDWORD port, size_t slot, Slot& s);
+};
+}
+#endif
@@ -0,0 +1,67 @@
+#ifndef VRMAGIC_SPSC_RING_H
+#define VRMAGIC_SPSC_RING_H
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+namespace vrmagic {
+
+// Bounded lock-free queue for exactly one producer and one consumer thread.
+template <typename T>
+class SpscRing {
+ public:
+  explicit SpscRing(size_t capacity) : buffer(capacity + 1), head(0), tail(0) {}
+
+  // Returns false if the ring is full.
+  bool push(const T& value) {
+    const size_t t = tail.load(std::memory_order_relaxed);
+    const size_t next = increment(t);
+    if (next == head.load(std::memory_order_acquire)) return false;
+    buffer[t] = value;
+    tail.store(next, std::memory_order_release);
+    return true;
+  }
+
+  // Returns false if the ring is empty.
+  bool pop(T& value) {
+    const size_t h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire)) return false;
+    value = buffer[h];
+    head.store(increment(h), std::memory_order_release);
+    return true;
+  }
+
+  // Polls until a value is available, `stop` is set or the timeout in ms expired.
+  bool popWait(T& value, const std::atomic<bool>& stop, int timeout) {
+    const std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+    for (int spins = 0; !pop(value); ++spins) {
+      if (stop.load(std::memory_order_relaxed) || std::chrono::steady_clock::now() > deadline) return false;
+      // Frames arrive every few ms, so yield briefly and then back off to sleeping
+      if (spins < 64) {
+        std::this_thread::yield();
+      } else {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+      }
+    }
+    return true;
+  }
+
+  size_t capacity() const { return buffer.size() - 1; }
+
+ private:
+  std::vector<T> buffer;
+
+  // Producer and consumer indices live on separate cache lines
+  char pad0[64];
+  std::atomic<size_t> head;
+  char pad1[64];
+  std::atomic<size_t> tail;
+  char pad2[64];
+
+  size_t increment(size_t i) const { return i + 1 == buffer.size() ? 0 : i + 1; }
+};
+}
+#endif
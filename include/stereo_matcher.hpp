@@ -0,0 +1,69 @@
+#ifndef VRMAGIC_STEREO_MATCHER_H
+#define VRMAGIC_STEREO_MATCHER_H
+
+#include <deque>
+#include <vector>
+
+#include "camera_handle.hpp"
+
+namespace vrmagic {
+
+struct MatcherStats {
+  unsigned long pairs;
+  // Frames discarded because the other port had no frame close enough
+  unsigned long orphansLeft;
+  unsigned long orphansRight;
+
+  MatcherStats() : pairs(0), orphansLeft(0), orphansRight(0) {}
+};
+
+// Pairs left and right frames by sensor frame counter or timestamp. Frames are buffered
+// per port until a partner arrives; a frame that can no longer get one, because the other
+// port already delivered a newer frame beyond the tolerance or the buffer overflowed, is
+// handed back as an orphan. Ports deliver their frames in order, so this never stalls.
+class StereoMatcher {
+ public:
+  explicit StereoMatcher(const Config& conf);
+
+  // Negative if left is older than right beyond the tolerance, positive if right is older,
+  // zero if the two frames form a pair.
+  int compare(const FrameInfo& left, const FrameInfo& right) const;
+
+  void addLeft(Frame* frame);
+  void addRight(Frame* frame);
+
+  // True if the left port has fewer frames waiting, i.e. the next match needs a left frame.
+  bool needsLeft() const;
+
+  // Returns true and the oldest pair if there is one. Orphans found on the way are
+  // appended to the given vectors so the caller can recycle them.
+  bool popPair(Frame*& left,
+               Frame*& right,
+               std::vector<Frame*>& orphansLeft,
+               std::vector<Frame*>& orphansRight);
+
+  // Hands back all buffered frames without counting them as orphans.
+  void flush(std::vector<Frame*>& framesLeft, std::vector<Frame*>& framesRight);
+
+  // Counts a pair that was grabbed and matched outside of the buffers, or a frame that
+  // was discarded there.
+  void countPair();
+  void countOrphan(bool left);
+
+  MatcherStats getStats() const;
+
+ private:
+  PairMatching mode;
+  int maxFrameCounterSkew;
+  double maxTimeSkew;
+  size_t capacity;
+
+  std::deque<Frame*> left;
+  std::deque<Frame*> right;
+  std::vector<Frame*> overflowLeft;
+  std::vector<Frame*> overflowRight;
+
+  MatcherStats stats;
+};
+}
+#endif
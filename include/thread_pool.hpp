@@ -0,0 +1,64 @@
+#ifndef VRMAGIC_THREAD_POOL_H
+#define VRMAGIC_THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace vrmagic {
+
+// Work-stealing pool for splitting a job into many small tasks, like the stripes of a frame.
+// Every worker has its own task queue and steals from the others once it runs dry, so a
+// worker that got slow stripes does not hold up the frame. The thread calling run() works
+// along, and several threads may call run() at the same time.
+class ThreadPool {
+ public:
+  explicit ThreadPool(size_t workers);
+  ~ThreadPool();
+
+  // Workers plus the calling thread.
+  size_t getNumThreads() const;
+
+  // Runs task(0) ... task(count - 1) and returns when all of them are done.
+  void run(size_t count, const std::function<void(size_t)>& task);
+
+ private:
+  // Tasks of one run() call
+  struct Batch {
+    const std::function<void(size_t)>* task;
+    size_t remaining;
+    std::mutex mutex;
+    std::condition_variable done;
+  };
+
+  struct Task {
+    Batch* batch;
+    size_t index;
+  };
+
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  std::vector<Queue*> queues;
+  std::vector<std::thread> threads;
+
+  // Tasks waiting in any queue. Idle workers sleep until it becomes positive.
+  std::atomic<size_t> pending;
+  std::atomic<size_t> nextQueue;
+  std::mutex mutex;
+  std::condition_variable wake;
+  bool stopping;
+
+  // Takes a task from the back of queue `self`, or steals one from the front of another.
+  bool popTask(size_t self, Task& task);
+  void execute(const Task& task);
+  void workerLoop(size_t index);
+};
+}
+#endif
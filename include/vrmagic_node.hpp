@@ -2,6 +2,7 @@
 #define VRMAGIC_NODE_H
 
 #include <string>
+#include <vector>
 
 #include <ros/ros.h>
 
@@ -10,14 +11,60 @@
 #include <sensor_msgs/fill_image.h>
 
 #include <camera_info_manager/camera_info_manager.h>
+#include <diagnostic_msgs/DiagnosticArray.h>
 #include <image_transport/image_transport.h>
+#include <stereo_msgs/DisparityImage.h>
 
+#include "block_matcher.hpp"
 #include "camera_handle.hpp"
+#include "downscale.hpp"
+#include "frame_pipeline.hpp"
+#include "message_pool.hpp"
+#include "rectifier.hpp"
+#include "shm_ring.hpp"
+#include "stereo_matcher.hpp"
 
 namespace vrmagic {
 
 static std::string camera_calibration_path = "package://vrmagic_camera/calibrations/${NAME}.yaml";
 
+// Shrunk copies of the images of a port
+struct Preview {
+  int factor;
+  image_transport::CameraPublisher pub;
+};
+
+// Topics, calibration and acquisition state of a port
+struct PortOutput {
+  ros::NodeHandle nh;
+  image_transport::ImageTransport *it;
+  image_transport::CameraPublisher camPub;
+
+  // Rectified images, only with the rectify parameter. rectifier is 0 otherwise.
+  image_transport::Publisher rectPub;
+  Rectifier *rectifier;
+
+  // Only computed while they have subscribers
+  std::vector<Preview> previews;
+
+  camera_info_manager::CameraInfoManager *cinfo;
+  // Calibration as last read from the CameraInfoManager, copied into every published
+  // camera info. Refreshed by calibrationTimer.
+  sensor_msgs::CameraInfo camInfo;
+
+  // 0 unless the pipeline parameter is set
+  PortPipeline *pipeline;
+
+  // image_raw frames for readers on this host, 0 unless the shared_memory parameter is set
+  ShmRingWriter *shm;
+
+  // Has subscribers or shared memory, only active ports are grabbed with lazy acquisition
+  bool active;
+  PortStats lastStats;
+
+  PortOutput() : it(0), rectifier(0), cinfo(0), pipeline(0), shm(0), active(true) {}
+};
+
 class VrMagicNode {
  public:
   explicit VrMagicNode(const ros::NodeHandle &nh, vrmagic::CameraHandle *cam_);
@@ -31,30 +78,65 @@ class VrMagicNode {
  private:
   vrmagic::CameraHandle *cam;
 
-  ros::NodeHandle nh;
-  ros::NodeHandle leftNs;
-  ros::NodeHandle rightNs;
-
-  image_transport::ImageTransport *itLeft;
-  image_transport::ImageTransport *itRight;
+  // In the order of Config::ports. With stereo, the first two are the left and right port.
+  std::vector<PortOutput> ports;
+  bool stereo;
+  bool streaming;
 
-  image_transport::CameraPublisher camPubLeft;
-  image_transport::CameraPublisher camPubRight;
+  // Acquisition cycles so far, decides which topics publish the current frame
+  unsigned long frameIndex;
 
-  camera_info_manager::CameraInfoManager *cinfoLeft;
-  camera_info_manager::CameraInfoManager *cinfoRight;
+  StereoMatcher *matcher;
+  std::vector<Frame *> orphansLeft;
+  std::vector<Frame *> orphansRight;
 
-  sensor_msgs::Image leftImageMsg;
-  sensor_msgs::Image rightImageMsg;
+  ros::Publisher diagnosticsPub;
+  ros::WallTimer diagnosticsTimer;
+  ros::WallTime lastDiagnostics;
 
-  sensor_msgs::CameraInfo leftCamInfo;
-  sensor_msgs::CameraInfo rightCamInfo;
-
-  std::string camera_name_right;
-  std::string camera_name_left;
+  ros::NodeHandle nh;
 
-  std::string cameraConfUrlLeft;
-  std::string cameraConfUrlRight;
+  // Disparity of the rectified pairs, only with the disparity parameter. 0 otherwise.
+  ros::Publisher disparityPub;
+  BlockMatcher *blockMatcher;
+  MessagePool<stereo_msgs::DisparityImage> *disparityMessages;
+  std::vector<uint8_t> grayLeft;
+  std::vector<uint8_t> grayRight;
+
+  std::vector<uint16_t> downscaleSums;
+
+  // Of the frames grabbed last, one per port
+  std::vector<FrameInfo> frameInfos;
+
+  // Messages are published as shared pointers and return to these pools once every
+  // subscriber let go of them
+  MessagePool<sensor_msgs::Image> *imageMessages;
+  MessagePool<sensor_msgs::CameraInfo> *camInfoMessages;
+
+  ros::WallTimer calibrationTimer;
+
+  void broadcastPipelinedFrame();
+  bool updateActivity();
+  bool pairing() const;
+  bool publishes(int decimation) const;
+  bool frameWanted() const;
+  void recycleOrphans();
+  void releaseHeldFrames();
+  void refreshCameraInfo(const ros::WallTimerEvent &event);
+  void publishDiagnostics(const ros::WallTimerEvent &event);
+  void publishFrame(const sensor_msgs::ImagePtr &left, const sensor_msgs::ImagePtr &right, const ros::Time &stamp);
+  void publishSingleFrame(size_t index, const sensor_msgs::ImagePtr &img);
+  void publishShared(PortOutput &port, const sensor_msgs::Image &img, const ros::Time &stamp);
+  void publishRectified(const image_transport::Publisher &pub, Rectifier *rectifier, const sensor_msgs::ImagePtr &img);
+  sensor_msgs::ImagePtr rectifyImage(Rectifier *rectifier, const sensor_msgs::ImagePtr &img);
+  void publishPreviews(const std::vector<Preview> &previews,
+                       const sensor_msgs::CameraInfo &camInfo,
+                       const sensor_msgs::ImagePtr &img);
+  void publishDisparity(const sensor_msgs::Image &left, const sensor_msgs::Image &right);
+  void publishImage(const image_transport::CameraPublisher &pub,
+                    const sensor_msgs::CameraInfo &camInfo,
+                    const sensor_msgs::ImagePtr &img,
+                    const ros::Time &stamp);
 };
 }
 
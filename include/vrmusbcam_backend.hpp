@@ -0,0 +1,55 @@
+#ifndef VRMAGIC_VRMUSBCAM_BACKEND_H
+#define VRMAGIC_VRMUSBCAM_BACKEND_H
+
+#include <string>
+
+#include "device_backend.hpp"
+
+namespace vrmagic {
+
+// Backend talking to real hardware through the VRmUsbCam SDK.
+class VRmUsbCamBackend : public DeviceBackend {
+ public:
+  // openDevice() opens the device with this serial number or product name, or the first free
+  // one if it is empty.
+  explicit VRmUsbCamBackend(const std::string& selector_);
+  ~VRmUsbCamBackend();
+
+  bool enableLogging();
+  void cleanup();
+
+  bool openDevice();
+  void closeDevice();
+
+  bool getSourceFormat(VRmDWORD port, VRmImageFormat* format);
+  bool getTargetFormatListSize(VRmDWORD port, VRmDWORD* size);
+  bool getTargetFormatListEntry(VRmDWORD port, VRmDWORD index, VRmImageFormat* format);
+
+  bool getPropertySupported(VRmPropId id, bool* supported);
+  bool setPropertyValueB(VRmPropId id, bool value);
+  bool setPropertyValueE(VRmPropId id, VRmPropId value);
+  bool setPropertyValueF(VRmPropId id, float value);
+  bool setPropertyValueRectI(VRmPropId id, const VRmRectI& value);
+
+  bool resetFrameCounter();
+  bool start();
+  bool stop();
+
+  bool lockNextImage(VRmDWORD port, VRmImage** image, VRmDWORD* framesDropped, int timeout);
+  bool unlockNextImage(VRmImage** image);
+  bool getFrameCounter(const VRmImage* image, VRmDWORD* frameCounter);
+
+  bool newImage(VRmImage** image, const VRmImageFormat& format);
+  bool wrapImage(VRmImage** image, const VRmImageFormat& format, VRmBYTE* buffer, VRmDWORD pitch);
+  bool freeImage(VRmImage** image);
+  bool convertImage(const VRmImage* source, VRmImage* target);
+  bool getColorFormatString(VRmColorFormat format, const char** name);
+
+  const char* getLastError();
+
+ private:
+  std::string selector;
+  VRmUsbCamDevice device;
+};
+}
+#endif
@@ -0,0 +1,313 @@
+#include "block_matcher.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define VRMAGIC_X86 1
+#include <immintrin.h>
+#endif
+
+namespace vrmagic {
+
+// Column costs hold the costs of the disparities [minDisparity, minDisparity + numDisparities)
+// of a column, summed over the rows of the window. Columns left of the largest disparity
+// have no partner in the right image for every disparity and stay unused. Sums are kept
+// in 16 bits and may wrap while rows are added and removed, the final values fit.
+
+// Neighbours a census code compares the pixel with, as (x, y) offsets
+static const int CENSUS_OFFSETS[8][2] = {{-2, -2}, {0, -2}, {2, -2}, {-2, 0}, {2, 0}, {-2, 2}, {0, 2}, {2, 2}};
+
+// Helper functions
+
+static void censusTransform(const uint8_t* img, size_t pitch, size_t width, size_t height, uint8_t* codes) {
+  for (size_t y = 0; y < height; ++y) {
+    for (size_t x = 0; x < width; ++x) {
+      const uint8_t center = img[y * pitch + x];
+      uint8_t code = 0;
+      for (int i = 0; i < 8; ++i) {
+        // Pixels outside the image repeat the border
+        const long nx = std::min(std::max(static_cast<long>(x) + CENSUS_OFFSETS[i][0], 0L), static_cast<long>(width) - 1);
+        const long ny = std::min(std::max(static_cast<long>(y) + CENSUS_OFFSETS[i][1], 0L), static_cast<long>(height) - 1);
+        code |= (img[ny * pitch + nx] < center) << i;
+      }
+      codes[y * width + x] = code;
+    }
+  }
+}
+
+static inline int pixelCost(uint8_t left, uint8_t right, MatchCost cost) {
+  if (cost == MATCH_SAD) return left > right ? left - right : right - left;
+  return __builtin_popcount(left ^ right);
+}
+
+static inline uint16_t uniquenessThreshold(uint16_t best, int ratio) {
+  return std::min(best + best * ratio / 100, 0xffff);
+}
+
+// Disparity of the cheapest index with a parabola fitted through it and its neighbours,
+// rounded to 1/DISPARITY_SUBPIXELS.
+static inline float refine(const uint16_t* sums, int best, const BlockMatcherConfig& config) {
+  const float disparity = config.minDisparity + best;
+  if (best == 0 || best == config.numDisparities - 1) return disparity;
+
+  const int left = sums[best - 1];
+  const int right = sums[best + 1];
+  const int curvature = left + right - 2 * sums[best];
+  if (curvature <= 0) return disparity;
+  const float offset = (left - right) / (2.0f * curvature);
+  return disparity + std::round(offset * DISPARITY_SUBPIXELS) / DISPARITY_SUBPIXELS;
+}
+
+// Adds (or subtracts) the costs of a row to the column costs. `left` is the row of the left
+// image, `reversed` the row of the right image from right to left, so the pixels a left
+// pixel is compared with for increasing disparities lie next to each other.
+static void accumulateRowScalar(const uint8_t* left,
+                                const uint8_t* reversed,
+                                size_t width,
+                                const BlockMatcherConfig& config,
+                                bool add,
+                                uint16_t* columns) {
+  const int numDisparities = config.numDisparities;
+  const size_t maxDisparity = config.minDisparity + numDisparities - 1;
+  for (size_t x = maxDisparity; x < width; ++x) {
+    const uint8_t* candidates = reversed + width - 1 - x + config.minDisparity;
+    uint16_t* column = columns + x * numDisparities;
+    for (int d = 0; d < numDisparities; ++d) {
+      const int cost = pixelCost(left[x], candidates[d], config.cost);
+      column[d] = add ? column[d] + cost : column[d] - cost;
+    }
+  }
+}
+
+// Window sums of the first pixel of a row.
+static void initWindow(const uint16_t* columns, size_t x0, const BlockMatcherConfig& config, uint16_t* sums) {
+  const int numDisparities = config.numDisparities;
+  const int radius = config.blockSize / 2;
+  std::fill(sums, sums + numDisparities, 0);
+  for (size_t x = x0 - radius; x <= x0 + radius; ++x) {
+    for (int d = 0; d < numDisparities; ++d) sums[d] += columns[x * numDisparities + d];
+  }
+}
+
+// Matches the pixels [x0, x1) of a row.
+static void matchRowScalar(const uint16_t* columns,
+                           size_t x0,
+                           size_t x1,
+                           const BlockMatcherConfig& config,
+                           uint16_t* sums,
+                           float* disparity) {
+  const int numDisparities = config.numDisparities;
+  const int radius = config.blockSize / 2;
+  initWindow(columns, x0, config, sums);
+
+  for (size_t x = x0; x < x1; ++x) {
+    if (x > x0) {
+      const uint16_t* entering = columns + (x + radius) * numDisparities;
+      const uint16_t* leaving = columns + (x - radius - 1) * numDisparities;
+      for (int d = 0; d < numDisparities; ++d) sums[d] += entering[d] - leaving[d];
+    }
+
+    int best = 0;
+    for (int d = 1; d < numDisparities; ++d) {
+      if (sums[d] < sums[best]) best = d;
+    }
+
+    const uint16_t threshold = uniquenessThreshold(sums[best], config.uniquenessRatio);
+    bool unique = true;
+    for (int d = 0; d < numDisparities && unique; ++d) {
+      if ((d < best - 1 || d > best + 1) && sums[d] <= threshold) unique = false;
+    }
+    disparity[x] = unique ? refine(sums, best, config) : INVALID_DISPARITY;
+  }
+}
+
+#ifdef VRMAGIC_X86
+
+// Costs of a left pixel against 16 right pixels.
+__attribute__((target("avx2"))) static inline __m128i pixelCosts128(__m128i left, __m128i right, MatchCost cost) {
+  if (cost == MATCH_SAD) return _mm_or_si128(_mm_subs_epu8(left, right), _mm_subs_epu8(right, left));
+
+  // Population count of the differing bits, nibble by nibble
+  const __m128i bits = _mm_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m128i nibble = _mm_set1_epi8(0x0f);
+  const __m128i diff = _mm_xor_si128(left, right);
+  return _mm_add_epi8(_mm_shuffle_epi8(bits, _mm_and_si128(diff, nibble)),
+                      _mm_shuffle_epi8(bits, _mm_and_si128(_mm_srli_epi16(diff, 4), nibble)));
+}
+
+__attribute__((target("avx2"))) static void accumulateRowAvx2(const uint8_t* left,
+                                                               const uint8_t* reversed,
+                                                               size_t width,
+                                                               const BlockMatcherConfig& config,
+                                                               bool add,
+                                                               uint16_t* columns) {
+  const int numDisparities = config.numDisparities;
+  const size_t maxDisparity = config.minDisparity + numDisparities - 1;
+  for (size_t x = maxDisparity; x < width; ++x) {
+    const __m128i pixel = _mm_set1_epi8(left[x]);
+    const uint8_t* candidates = reversed + width - 1 - x + config.minDisparity;
+    uint16_t* column = columns + x * numDisparities;
+    for (int d = 0; d < numDisparities; d += 16) {
+      const __m128i right = _mm_loadu_si128(reinterpret_cast<const __m128i*>(candidates + d));
+      const __m256i cost = _mm256_cvtepu8_epi16(pixelCosts128(pixel, right, config.cost));
+      __m256i* sum = reinterpret_cast<__m256i*>(column + d);
+      _mm256_storeu_si256(sum, add ? _mm256_add_epi16(_mm256_loadu_si256(sum), cost)
+                                   : _mm256_sub_epi16(_mm256_loadu_si256(sum), cost));
+    }
+  }
+}
+
+__attribute__((target("avx2"))) static void matchRowAvx2(const uint16_t* columns,
+                                                          size_t x0,
+                                                          size_t x1,
+                                                          const BlockMatcherConfig& config,
+                                                          uint16_t* sums,
+                                                          float* disparity) {
+  const int numDisparities = config.numDisparities;
+  const int radius = config.blockSize / 2;
+  initWindow(columns, x0, config, sums);
+
+  for (size_t x = x0; x < x1; ++x) {
+    __m256i minimum = _mm256_set1_epi16(-1);
+    const uint16_t* entering = columns + (x + radius) * numDisparities;
+    const uint16_t* leaving = columns + (x - radius - 1) * numDisparities;
+    for (int d = 0; d < numDisparities; d += 16) {
+      __m256i* sum = reinterpret_cast<__m256i*>(sums + d);
+      __m256i s = _mm256_loadu_si256(sum);
+      if (x > x0) {
+        s = _mm256_add_epi16(s, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(entering + d)));
+        s = _mm256_sub_epi16(s, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(leaving + d)));
+        _mm256_storeu_si256(sum, s);
+      }
+      minimum = _mm256_min_epu16(minimum, s);
+    }
+
+    const __m128i lanes = _mm_min_epu16(_mm256_castsi256_si128(minimum), _mm256_extracti128_si256(minimum, 1));
+    const uint16_t bestCost = _mm_extract_epi16(_mm_minpos_epu16(lanes), 0);
+
+    // The first disparity with that cost, as the scalar code picks it
+    const __m256i bestCosts = _mm256_set1_epi16(bestCost);
+    int best = 0;
+    for (int d = 0; d < numDisparities; d += 16) {
+      const __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(sums + d));
+      const unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi16(s, bestCosts));
+      if (mask) {
+        best = d + __builtin_ctz(mask) / 2;
+        break;
+      }
+    }
+
+    const __m256i threshold = _mm256_set1_epi16(uniquenessThreshold(bestCost, config.uniquenessRatio));
+    bool unique = true;
+    for (int d = 0; d < numDisparities && unique; d += 16) {
+      const __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(sums + d));
+      unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi16(_mm256_min_epu16(s, threshold), s));
+      // The best disparity and its neighbours do not count
+      for (int n = best - 1; n <= best + 1; ++n) {
+        if (n >= d && n < d + 16) mask &= ~(3u << 2 * (n - d));
+      }
+      unique = mask == 0;
+    }
+    disparity[x] = unique ? refine(sums, best, config) : INVALID_DISPARITY;
+  }
+}
+
+#endif
+
+typedef void (*AccumulateKernel)(const uint8_t*, const uint8_t*, size_t, const BlockMatcherConfig&, bool, uint16_t*);
+typedef void (*MatchKernel)(const uint16_t*, size_t, size_t, const BlockMatcherConfig&, uint16_t*, float*);
+
+// Member functions
+
+const char* blockMatchMethodName(BlockMatchMethod method) {
+  switch (method) {
+    case BLOCK_MATCH_AUTO:
+      return "auto";
+    case BLOCK_MATCH_SCALAR:
+      return "scalar";
+    case BLOCK_MATCH_AVX2:
+      return "avx2";
+  }
+  return "unknown";
+}
+
+bool blockMatchMethodSupported(BlockMatchMethod method) {
+  switch (method) {
+#ifdef VRMAGIC_X86
+    case BLOCK_MATCH_AVX2:
+      return __builtin_cpu_supports("avx2");
+#else
+    case BLOCK_MATCH_AVX2:
+      return false;
+#endif
+    default:
+      return true;
+  }
+}
+
+BlockMatcher::BlockMatcher(const BlockMatcherConfig& config_) : config(config_) {}
+
+const BlockMatcherConfig& BlockMatcher::getConfig() const { return config; }
+
+void BlockMatcher::getValidWindow(size_t width, size_t height, size_t* x0, size_t* y0, size_t* x1, size_t* y1) const {
+  const size_t radius = config.blockSize / 2;
+  *x0 = config.minDisparity + config.numDisparities - 1 + radius;
+  *y0 = radius;
+  *x1 = width > radius ? width - radius : 0;
+  *y1 = height > radius ? height - radius : 0;
+}
+
+void BlockMatcher::compute(const uint8_t* left,
+                           const uint8_t* right,
+                           size_t pitch,
+                           size_t width,
+                           size_t height,
+                           float* disparity,
+                           BlockMatchMethod method) {
+  if (method == BLOCK_MATCH_AUTO) {
+    method = blockMatchMethodSupported(BLOCK_MATCH_AVX2) ? BLOCK_MATCH_AVX2 : BLOCK_MATCH_SCALAR;
+  }
+  AccumulateKernel accumulate = accumulateRowScalar;
+  MatchKernel match = matchRowScalar;
+#ifdef VRMAGIC_X86
+  if (method == BLOCK_MATCH_AVX2) {
+    accumulate = accumulateRowAvx2;
+    match = matchRowAvx2;
+  }
+#endif
+
+  std::fill(disparity, disparity + width * height, INVALID_DISPARITY);
+  size_t x0, y0, x1, y1;
+  getValidWindow(width, height, &x0, &y0, &x1, &y1);
+  if (x0 >= x1 || y0 >= y1) return;
+
+  if (config.cost == MATCH_CENSUS) {
+    codesLeft.resize(width * height);
+    codesRight.resize(width * height);
+    censusTransform(left, pitch, width, height, &codesLeft[0]);
+    censusTransform(right, pitch, width, height, &codesRight[0]);
+    left = &codesLeft[0];
+    right = &codesRight[0];
+    pitch = width;
+  }
+
+  columnCosts.assign(width * config.numDisparities, 0);
+  windowCosts.resize(config.numDisparities);
+  reversed.resize(width);
+
+  const size_t radius = config.blockSize / 2;
+  for (size_t y = 0; y < height && y < y1 + radius; ++y) {
+    // Rows enter the window radius rows before the first pixel they count for
+    if (y > 2 * radius) {
+      const size_t leaving = y - 2 * radius - 1;
+      std::reverse_copy(right + leaving * pitch, right + leaving * pitch + width, reversed.begin());
+      accumulate(left + leaving * pitch, &reversed[0], width, config, false, &columnCosts[0]);
+    }
+    std::reverse_copy(right + y * pitch, right + y * pitch + width, reversed.begin());
+    accumulate(left + y * pitch, &reversed[0], width, config, true, &columnCosts[0]);
+
+    if (y >= 2 * radius) match(&columnCosts[0], x0, x1, config, &windowCosts[0], disparity + (y - radius) * width);
+  }
+}
+}
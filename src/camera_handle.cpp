@@ -1,26 +1,55 @@
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <cstdlib>
+#include <ctime>
+#include <functional>
 #include <string>
+#include <typeinfo>
 
 #include <ros/ros.h>
 #include <ros/console.h>
 
 #include "camera_handle.hpp"
+#include "image_copy.hpp"
+#include "image_pool.hpp"
+#include "vrmusbcam_backend.hpp"
 
 namespace vrmagic {
 
-static const VRmColorFormat TARGET_COLOR_FORMAT = VRM_BGR_3X8;
+// Stripes per conversion thread, more of them let work stealing even out the load
+static const VRmDWORD STRIPES_PER_THREAD = 4;
+static const VRmDWORD MIN_STRIPE_ROWS = 32;
+// Rows of context the SDK gets above and below a stripe, so its edges convert as in a full frame
+static const VRmDWORD STRIPE_OVERLAP = 4;
+
+// Software trigger times kept to stamp the frames they caused
+static const size_t TRIGGER_HISTORY = 16;
+
+// Backends of the handles alive. The library of a backend is cleaned up when the last handle
+// using it closes, or at exit for the handles still open.
+static std::mutex backendsMutex;
+static std::vector<DeviceBackend*> openBackends;
+
+typedef std::chrono::steady_clock Clock;
 
 // Macros
 
 #define VRM_CHECK(C)                                              \
   if (!(C)) {                                                     \
-    ROS_ERROR("%s : Line %d", VRmUsbCamGetLastError(), __LINE__); \
+    ROS_ERROR("%s : Line %d", backend->getLastError(), __LINE__); \
     exit(EXIT_FAILURE);                                           \
   }
 
 // Helper functions
 
+static PoolStats addPoolStats(const PoolStats& a, const PoolStats& b) {
+  PoolStats sum;
+  sum.hits = a.hits + b.hits;
+  sum.misses = a.misses + b.misses;
+  return sum;
+}
+
 static VRmPropId portnumToPropId(VRmDWORD port) {
   switch (port) {
     case 1:
@@ -33,26 +62,169 @@ static VRmPropId portnumToPropId(VRmDWORD port) {
       return VRM_PROPID_GRAB_SENSOR_PROPS_SELECT_4;
     default:
       ROS_FATAL("Cannot convert port to prop id: %d", port);
+      exit(-1);
+  }
+}
+
+static VRmColorFormat targetColorFormat(OutputFormat output) {
+  return output == OUTPUT_MONO8 ? VRM_GRAY_8 : VRM_BGR_3X8;
+}
+
+// Returns false for formats without an image_encodings equivalent.
+static bool encodingFromColorFormat(VRmColorFormat format, std::string* encoding) {
+  switch (format) {
+    case VRM_BGR_3X8:
+      *encoding = sensor_msgs::image_encodings::BGR8;
+      return true;
+    case VRM_ARGB_4X8:
+      // Little endian, so the bytes in memory are B, G, R, A
+      *encoding = sensor_msgs::image_encodings::BGRA8;
+      return true;
+    case VRM_GRAY_8:
+      *encoding = sensor_msgs::image_encodings::MONO8;
+      return true;
+    case VRM_BAYER_GBRG_8:
+      *encoding = sensor_msgs::image_encodings::BAYER_GBRG8;
+      return true;
+    case VRM_BAYER_BGGR_8:
+      *encoding = sensor_msgs::image_encodings::BAYER_BGGR8;
+      return true;
+    case VRM_BAYER_RGGB_8:
+      *encoding = sensor_msgs::image_encodings::BAYER_RGGB8;
+      return true;
+    case VRM_BAYER_GRBG_8:
+      *encoding = sensor_msgs::image_encodings::BAYER_GRBG8;
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool bayerPatternFromColorFormat(VRmColorFormat format, BayerPattern* pattern) {
+  switch (format) {
+    case VRM_BAYER_GBRG_8:
+      *pattern = BAYER_GBRG;
+      return true;
+    case VRM_BAYER_BGGR_8:
+      *pattern = BAYER_BGGR;
+      return true;
+    case VRM_BAYER_RGGB_8:
+      *pattern = BAYER_RGGB;
+      return true;
+    case VRM_BAYER_GRBG_8:
+      *pattern = BAYER_GRBG;
+      return true;
+    default:
+      return false;
+  }
+}
+
+static DeviceBackend* createBackend(const Config& conf) {
+  if (conf.backend == "simulated") {
+    ROS_INFO("Using simulated device backend");
+    return new SimulatedBackend(conf.simulation);
+  }
+  if (conf.backend != "vrmusbcam") {
+    ROS_FATAL("Unknown device backend: %s", conf.backend.c_str());
+    exit(-1);
   }
+  return new VRmUsbCamBackend(conf.device);
 }
 
-void cameraShutdown() { VRmUsbCamCleanup(); }
+static bool sameLibrary(const DeviceBackend* a, const DeviceBackend* b) { return typeid(*a) == typeid(*b); }
+
+// First tick after now on a grid of the given period. The grid is common to all devices of
+// the process, so devices with the same trigger rate expose together.
+static Clock::time_point nextTick(Clock::duration period) {
+  return Clock::time_point((Clock::now().time_since_epoch() / period + 1) * period);
+}
+
+void cameraShutdown() {
+  std::lock_guard<std::mutex> lock(backendsMutex);
+  for (size_t i = 0; i < openBackends.size(); ++i) {
+    bool first = true;
+    for (size_t j = 0; j < i; ++j) first = first && !sameLibrary(openBackends[i], openBackends[j]);
+    if (first) openBackends[i]->cleanup();
+  }
+}
 
 // Member functions
 
 CameraHandle::CameraHandle(Config conf) {
-  if (conf.enableLogging) VRmUsbCamEnableLogging();
-
   this->conf = conf;
+  backend = createBackend(conf);
+  {
+    std::lock_guard<std::mutex> lock(backendsMutex);
+    openBackends.push_back(backend);
+  }
+  if (conf.enableLogging) VRM_CHECK(backend->enableLogging());
+  conversionPool = 0;
+  recorder = 0;
+  skipPeriod = 0;
+  stopTrigger = false;
+  streaming = false;
+  for (size_t i = 0; i < conf.ports.size(); ++i) {
+    Port* port = new Port();
+    port->pool = new ImagePool(backend);
+    port->stripePool = 0;
+    port->stripeRows = 0;
+    port->numStripes = 0;
+    port->worker = 0;
+    port->lastPeriod = -1;
+    ports.push_back(port);
+  }
 
   initCamera();
+  if (!conf.recording.path.empty()) startRecording();
   startCamera();
+
+  // The pipeline grabs every port on threads of its own
+  if (conf.parallelAcquisition && !conf.pipeline) {
+    for (size_t i = 0; i < ports.size(); ++i) ports[i]->worker = new PortWorker();
+  }
 }
 
 CameraHandle::~CameraHandle() {
-  VRmUsbCamStop(device);
-  VRmUsbCamCloseDevice(device);
-  VRmUsbCamCleanup();
+  if (triggerThread.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(triggerMutex);
+      stopTrigger = true;
+    }
+    triggerWake.notify_all();
+    triggerThread.join();
+  }
+
+  for (size_t i = 0; i < ports.size(); ++i) delete ports[i]->worker;
+  delete conversionPool;
+
+  if (recorder) {
+    recorder->stop();
+    RecorderStats stats = recorder->getStats();
+    delete recorder;
+    ROS_INFO("Recorded %lu frames, %lu MB. %lu frames not recorded.",
+             static_cast<unsigned long>(stats.framesRecorded),
+             static_cast<unsigned long>(stats.bytesRecorded >> 20),
+             static_cast<unsigned long>(stats.framesNotRecorded));
+  }
+
+  PoolStats imageStats = getImagePoolStats();
+  ROS_INFO("Image pool: %lu hits, %lu misses.", imageStats.hits, imageStats.misses);
+
+  backend->stop();
+  for (size_t i = 0; i < ports.size(); ++i) {
+    delete ports[i]->pool;
+    delete ports[i]->stripePool;
+    delete ports[i];
+  }
+  backend->closeDevice();
+  bool last = true;
+  {
+    std::lock_guard<std::mutex> lock(backendsMutex);
+    openBackends.erase(std::find(openBackends.begin(), openBackends.end(), backend));
+    for (size_t i = 0; i < openBackends.size(); ++i) last = last && !sameLibrary(openBackends[i], backend);
+  }
+  if (last) backend->cleanup();
+  delete backend;
 }
 
 void CameraHandle::initCamera() {
@@ -60,131 +232,561 @@ void CameraHandle::initCamera() {
   // If a device is found, it is opened.
   openDevice();
 
-  // Get source format of the camera
-  getSourceFormat();
+  for (size_t i = 0; i < ports.size(); ++i) {
+    // Restrict the sensor to its window, which changes the source format
+    setSensorWindow(conf.ports[i].port, conf.ports[i].window);
 
-  // Select a target format from the list of formats. The source image grabbed from the camera
-  // will be converted to this format if possible.
-  setTargetFormat();
-}
+    // Get source format of the port
+    getSourceFormat(i);
 
-void CameraHandle::openDevice() {
-  VRmDWORD libversion;
-  VRM_CHECK(VRmUsbCamGetVersion(&libversion));
-  ROS_INFO("VR Magic lib has version %d", libversion);
-
-  VRmDWORD size = 0;
-
-  ROS_INFO("Scanning for devices");
-  VRM_CHECK(VRmUsbCamGetDeviceKeyListSize(&size));
-  ROS_INFO("Found %d devices", size);
-
-  device = 0;
-  VRmDeviceKey* devKey = 0;
-  for (VRmDWORD i = 0; i < size && !device; ++i) {
-    VRM_CHECK(VRmUsbCamGetDeviceKeyListEntry(i, &devKey));
-    if (!devKey->m_busy) {
-      VRM_CHECK(VRmUsbCamOpenDevice(devKey, &device));
-      ROS_INFO("Found device: %s [%s]", devKey->mp_product_str, devKey->mp_manufacturer_str);
-    }
-    VRM_CHECK(VRmUsbCamFreeDeviceKey(&devKey));
+    // Select a target format from the list of formats. The source image grabbed from the
+    // port will be converted to this format if possible.
+    setTargetFormat(i);
   }
 
+  if (conf.frameRate > 0) setFrameRate();
+  setTriggerMode();
+}
+
+void CameraHandle::openDevice() {
   ROS_INFO("Trying to open device");
 
-  if (!device) {
-    ROS_FATAL("No suitable VRmagic device found!");
+  if (!backend->openDevice()) {
+    if (conf.device.empty()) {
+      ROS_FATAL("No suitable VRmagic device found! %s", backend->getLastError());
+    } else {
+      ROS_FATAL("VRmagic device %s not found or busy! %s", conf.device.c_str(), backend->getLastError());
+    }
     exit(-1);
   }
 
   ROS_INFO("Device opened");
 }
 
-void CameraHandle::getSourceFormat() {
-  VRmImageFormat sourceFormat;
+void CameraHandle::setSensorWindow(VRmDWORD port, const SensorWindow& window) {
+  if (window.isFullSensor()) return;
+
+  const VRmPropId sensor = portnumToPropId(port);
+  VRM_CHECK(backend->setPropertyValueE(VRM_PROPID_GRAB_SENSOR_PROPS_SELECT_E, sensor));
 
-  VRM_CHECK(VRmUsbCamGetSourceFormatEx(device, conf.portLeft, &sourceFormat));
+  bool supported = false;
+  if (window.subsampling != 1) {
+    VRM_CHECK(backend->getPropertySupported(VRM_PROPID_GRAB_SUBSAMPLING_E, &supported));
+    if (!supported) {
+      ROS_FATAL("The sensor on port %d does not support subsampling", port);
+      exit(-1);
+    }
+    const VRmPropId mode = window.subsampling == 4 ? VRM_PROPID_GRAB_SUBSAMPLING_4X4 : VRM_PROPID_GRAB_SUBSAMPLING_2X2;
+    VRM_CHECK(backend->setPropertyValueE(VRM_PROPID_GRAB_SUBSAMPLING_E, mode));
+    ROS_INFO("Port %d subsamples by %d", port, window.subsampling);
+  }
+
+  if (window.width > 0 && window.height > 0) {
+    VRM_CHECK(backend->getPropertySupported(VRM_PROPID_GRAB_ROI_RECTI, &supported));
+    if (!supported) {
+      ROS_FATAL("The sensor on port %d does not support a region of interest", port);
+      exit(-1);
+    }
+    VRmRectI roi;
+    roi.m_left = window.xOffset;
+    roi.m_top = window.yOffset;
+    roi.m_width = window.width;
+    roi.m_height = window.height;
+    VRM_CHECK(backend->setPropertyValueRectI(VRM_PROPID_GRAB_ROI_RECTI, roi));
+    ROS_INFO("Port %d reads %d x %d pixels at (%d, %d)", port, window.width, window.height, window.xOffset, window.yOffset);
+  }
+}
+
+void CameraHandle::getSourceFormat(size_t index) {
+  const PortConfig& pc = conf.ports[index];
+  Port& port = *ports[index];
+  VRM_CHECK(backend->getSourceFormat(pc.port, &port.sourceFormat));
 
   const char* source_color_format_str;
-  VRM_CHECK(VRmUsbCamGetStringFromColorFormat(sourceFormat.m_color_format, &source_color_format_str));
+  VRM_CHECK(backend->getColorFormatString(port.sourceFormat.m_color_format, &source_color_format_str));
 
-  ROS_INFO("Selected source format: %d x %d (%s)",
-           sourceFormat.m_width,
-           sourceFormat.m_height,
+  ROS_INFO("%s: selected source format: %d x %d (%s)",
+           pc.name.c_str(),
+           port.sourceFormat.m_width,
+           port.sourceFormat.m_height,
            source_color_format_str);
 }
 
-void CameraHandle::setTargetFormat() {
-  VRmDWORD numberOfTargetFormats, i;
-  VRM_CHECK(VRmUsbCamGetTargetFormatListSizeEx2(device, conf.portLeft, &numberOfTargetFormats));
-  for (i = 0; i < numberOfTargetFormats; ++i) {
-    VRM_CHECK(VRmUsbCamGetTargetFormatListEntryEx2(device, conf.portLeft, i, &targetFormat));
-    if (targetFormat.m_color_format == TARGET_COLOR_FORMAT) break;
+void CameraHandle::setTargetFormat(size_t index) {
+  PortConfig& pc = conf.ports[index];
+  Port& port = *ports[index];
+  if (pc.outputFormat == OUTPUT_RAW) {
+    // Published as grabbed, the SDK converter is never called
+    port.targetFormat = port.sourceFormat;
+  } else {
+    const VRmColorFormat wanted = targetColorFormat(pc.outputFormat);
+    VRmDWORD numberOfTargetFormats, i;
+    VRM_CHECK(backend->getTargetFormatListSize(pc.port, &numberOfTargetFormats));
+    for (i = 0; i < numberOfTargetFormats; ++i) {
+      VRM_CHECK(backend->getTargetFormatListEntry(pc.port, i, &port.targetFormat));
+      if (port.targetFormat.m_color_format == wanted) break;
+    }
+
+    // Check for right target format
+    if (port.targetFormat.m_color_format != wanted) {
+      const char* screen_color_format_str;
+      VRM_CHECK(backend->getColorFormatString(wanted, &screen_color_format_str));
+      ROS_FATAL("%s not found in the target format list of %s.", screen_color_format_str, pc.name.c_str());
+      exit(-1);
+    }
   }
 
-  // Check for right target format
-  if (targetFormat.m_color_format != TARGET_COLOR_FORMAT) {
-    const char* screen_color_format_str;
-    VRM_CHECK(VRmUsbCamGetStringFromColorFormat(TARGET_COLOR_FORMAT, &screen_color_format_str));
-    ROS_FATAL("%s not found in target format list.", screen_color_format_str);
+  const char* targetColorFormatStr;
+  VRM_CHECK(backend->getColorFormatString(port.targetFormat.m_color_format, &targetColorFormatStr));
+  if (!encodingFromColorFormat(port.targetFormat.m_color_format, &port.encoding)) {
+    ROS_FATAL("%s cannot be published, there is no matching image encoding.", targetColorFormatStr);
     exit(-1);
   }
 
-  const char* targetColorFormatStr;
-  VRM_CHECK(VRmUsbCamGetStringFromColorFormat(targetFormat.m_color_format, &targetColorFormatStr));
-  ROS_INFO("Selected target format: %d x %d (%s)",
-           targetFormat.m_width,
-           targetFormat.m_height,
+  ROS_INFO("%s: selected target format: %d x %d (%s)",
+           pc.name.c_str(),
+           port.targetFormat.m_width,
+           port.targetFormat.m_height,
            targetColorFormatStr);
+
+  // The built-in converters only demosaic, at the full sensor resolution
+  if (pc.outputFormat != OUTPUT_RAW && pc.converter != CONVERTER_SDK) {
+    if (!bayerPatternFromColorFormat(port.sourceFormat.m_color_format, &port.bayerPattern) ||
+        port.sourceFormat.m_width != port.targetFormat.m_width ||
+        port.sourceFormat.m_height != port.targetFormat.m_height) {
+      ROS_WARN("The built-in converters need a Bayer source of the target size, %s uses the SDK converter instead",
+               pc.name.c_str());
+      pc.converter = CONVERTER_SDK;
+    } else {
+      ROS_INFO("Built-in demosaicing uses %s", demosaicMethodName(resolveDemosaicMethod(DEMOSAIC_AUTO)));
+    }
+  }
+
+  port.pool->reset(port.targetFormat, conf.poolSize);
+
+  if (conf.conversionThreads > 0 && pc.outputFormat != OUTPUT_RAW) setupStripes(index);
+}
+
+void CameraHandle::setupStripes(size_t index) {
+  const PortConfig& pc = conf.ports[index];
+  Port& port = *ports[index];
+  if (port.sourceFormat.m_width != port.targetFormat.m_width ||
+      port.sourceFormat.m_height != port.targetFormat.m_height) {
+    ROS_WARN("Parallel conversion needs a target of the source size, converting %s on one thread", pc.name.c_str());
+    return;
+  }
+
+  if (!conversionPool) conversionPool = new ThreadPool(conf.conversionThreads);
+
+  // Even stripe heights keep the Bayer phase of every stripe
+  const VRmDWORD height = port.targetFormat.m_height;
+  const VRmDWORD stripes = conversionPool->getNumThreads() * STRIPES_PER_THREAD;
+  port.stripeRows = std::max(MIN_STRIPE_ROWS, (height + stripes - 1) / stripes);
+  port.stripeRows += port.stripeRows % 2;
+  port.numStripes = (height + port.stripeRows - 1) / port.stripeRows;
+
+  if (pc.converter == CONVERTER_SDK) {
+    VRmImageFormat scratchFormat = port.targetFormat;
+    scratchFormat.m_height = std::min(height, port.stripeRows + 2 * STRIPE_OVERLAP);
+    port.stripePool = new ImagePool(backend);
+    port.stripePool->reset(scratchFormat, 2 * conversionPool->getNumThreads());
+  }
+
+  ROS_INFO("Converting %s frames in %u stripes of %u rows on %lu threads",
+           pc.name.c_str(),
+           port.numStripes,
+           port.stripeRows,
+           conversionPool->getNumThreads());
+}
+
+void CameraHandle::setFrameRate() {
+  // One mode for all ports: a port limited by its sensor would also skip frames otherwise
+  bool supported = true;
+  for (size_t i = 0; i < conf.ports.size() && supported; ++i) {
+    VRM_CHECK(backend->setPropertyValueE(VRM_PROPID_GRAB_SENSOR_PROPS_SELECT_E, portnumToPropId(conf.ports[i].port)));
+    VRM_CHECK(backend->getPropertySupported(VRM_PROPID_CAM_ACQUISITION_RATE_MAX_F, &supported));
+  }
+
+  if (supported) {
+    for (size_t i = 0; i < conf.ports.size(); ++i) {
+      VRM_CHECK(
+          backend->setPropertyValueE(VRM_PROPID_GRAB_SENSOR_PROPS_SELECT_E, portnumToPropId(conf.ports[i].port)));
+      VRM_CHECK(backend->setPropertyValueF(VRM_PROPID_CAM_ACQUISITION_RATE_MAX_F, conf.frameRate));
+    }
+    ROS_INFO("Sensors limited to %.1f fps", conf.frameRate);
+  } else {
+    // Frames are still transferred, but skipped before the expensive conversion
+    skipPeriod = 1.0 / conf.frameRate;
+    ROS_INFO("The sensors cannot limit their rate, skipping frames to get %.1f fps", conf.frameRate);
+  }
+}
+
+void CameraHandle::setTriggerMode() {
+  bool supported = false;
+  VRM_CHECK(backend->getPropertySupported(VRM_PROPID_GRAB_MODE_E, &supported));
+  if (!supported) {
+    if (conf.triggerMode == TRIGGER_FREE_RUNNING) return;
+    ROS_FATAL("The device cannot be triggered");
+    exit(-1);
+  }
+
+  switch (conf.triggerMode) {
+    case TRIGGER_SOFTWARE:
+      VRM_CHECK(backend->setPropertyValueE(VRM_PROPID_GRAB_MODE_E, VRM_PROPID_GRAB_MODE_TRIGGERED_SOFT));
+      ROS_INFO("Triggering the sensors at %.1f Hz", conf.triggerRate);
+      break;
+    case TRIGGER_EXTERNAL:
+      VRM_CHECK(backend->setPropertyValueE(VRM_PROPID_GRAB_MODE_E, VRM_PROPID_GRAB_MODE_TRIGGERED_EXT));
+      ROS_INFO("Sensors wait for the external trigger");
+      break;
+    default:
+      VRM_CHECK(backend->setPropertyValueE(VRM_PROPID_GRAB_MODE_E, VRM_PROPID_GRAB_MODE_FREERUNNING));
+      break;
+  }
+}
+
+void CameraHandle::triggerLoop() {
+  const Clock::duration period =
+      std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / conf.triggerRate));
+  Clock::time_point next = nextTick(period);
+
+  std::unique_lock<std::mutex> lock(triggerMutex);
+  while (!stopTrigger) {
+    if (triggerWake.wait_until(lock, next, [this] { return stopTrigger; })) break;
+
+    // Fixed schedule, but do not fire a burst to catch up after a stall
+    next += period;
+    if (next < Clock::now()) next = nextTick(period);
+    if (!streaming) continue;
+
+    // Recorded first, a frame can arrive before the trigger call returns. The call is a USB
+    // round trip, acquisition threads looking up trigger times must not wait for it.
+    const ros::Time triggerTime = ros::Time::now();
+    triggerTimes.push_back(triggerTime);
+    if (triggerTimes.size() > TRIGGER_HISTORY) triggerTimes.pop_front();
+    lock.unlock();
+    const bool triggered = backend->setPropertyValueB(VRM_PROPID_CAM_SOFT_TRIGGER_B, true);
+    lock.lock();
+    if (!triggered) {
+      // Only this thread adds trigger times, so ours is still the newest
+      triggerTimes.pop_back();
+      ROS_WARN_THROTTLE(5, "Software trigger failed: %s", backend->getLastError());
+    }
+  }
+}
+
+ros::Time CameraHandle::triggerTimeBefore(const ros::Time& arrival) {
+  // Frames arrive before the next trigger, so the latest trigger before the arrival caused it
+  std::lock_guard<std::mutex> lock(triggerMutex);
+  for (std::deque<ros::Time>::reverse_iterator it = triggerTimes.rbegin(); it != triggerTimes.rend(); ++it) {
+    if (*it <= arrival) return *it;
+  }
+  return arrival;
 }
 
 void CameraHandle::startCamera() {
   ROS_INFO("Starting the camera.");
 
-  VRM_CHECK(VRmUsbCamResetFrameCounter(device));
-  VRM_CHECK(VRmUsbCamStart(device));
+  VRM_CHECK(backend->resetFrameCounter());
+  VRM_CHECK(backend->start());
+  streaming = true;
+
+  if (conf.triggerMode == TRIGGER_SOFTWARE) triggerThread = std::thread(&CameraHandle::triggerLoop, this);
 
   ROS_INFO("Beginning to grab.");
 }
 
-void CameraHandle::grabFrameLeft(sensor_msgs::Image& img, const ros::Time& triggerTime) {
-  grabFrame(conf.portLeft, img, triggerTime);
+const Config& CameraHandle::getConfig() const { return conf; }
+
+PortStats CameraHandle::takePortStats(size_t index) { return ports[index]->stats.take(); }
+
+PoolStats CameraHandle::getImagePoolStats() const {
+  PoolStats stats;
+  for (size_t i = 0; i < ports.size(); ++i) stats = addPoolStats(stats, ports[i]->pool->getImageStats());
+  return stats;
+}
+
+const Recorder* CameraHandle::getRecorder() const { return recorder; }
+
+void CameraHandle::startRecording() {
+  // A new directory per run, so that restarts never overwrite a recording
+  char started[32];
+  const time_t now = time(0);
+  strftime(started, sizeof(started), "%Y%m%d-%H%M%S", localtime(&now));
+  const std::string directory = conf.recording.path + "/" + conf.cameraName + "_" + started;
+
+  recorder = new Recorder(conf.recording);
+  if (!recorder->start(directory)) {
+    ROS_FATAL("Cannot record: %s", recorder->getLastError().c_str());
+    exit(EXIT_FAILURE);
+  }
+  ROS_INFO("Recording to %s", directory.c_str());
+}
+
+void CameraHandle::setStreaming(bool enable) {
+  if (enable) {
+    VRM_CHECK(backend->start());
+  } else {
+    VRM_CHECK(backend->stop());
+  }
+  streaming = enable;
 }
 
-void CameraHandle::grabFrameRight(sensor_msgs::Image& img, const ros::Time& triggerTime) {
-  grabFrame(conf.portRight, img, triggerTime);
+void CameraHandle::grabFrames(std::vector<sensor_msgs::ImagePtr>& imgs,
+                              const ros::Time& triggerTime,
+                              std::vector<FrameInfo>& infos) {
+  infos.resize(ports.size());
+  // Not vector<bool>, the workers write their entries concurrently
+  std::vector<char> grabbed(ports.size(), 0);
+  for (size_t i = 0; i < ports.size(); ++i) {
+    if (!imgs[i]) continue;
+    sensor_msgs::Image& img = *imgs[i];
+    if (ports[i]->worker) {
+      ports[i]->worker->post([this, i, &img, &triggerTime, &infos, &grabbed] {
+        grabbed[i] = grabFrame(i, img, triggerTime, &infos[i]);
+      });
+    } else {
+      grabbed[i] = grabFrame(i, img, triggerTime, &infos[i]);
+    }
+  }
+  for (size_t i = 0; i < ports.size(); ++i) {
+    if (imgs[i] && ports[i]->worker) ports[i]->worker->wait();
+  }
+  for (size_t i = 0; i < ports.size(); ++i) {
+    if (!grabbed[i]) imgs[i].reset();
+  }
 }
 
-void CameraHandle::grabFrame(VRmDWORD port, sensor_msgs::Image& img, const ros::Time& triggerTime) {
+bool CameraHandle::grabFrame(size_t index, sensor_msgs::Image& img, const ros::Time& triggerTime, FrameInfo* info) {
   VRmImage* sourceImg = 0;
-  VRmDWORD framesDropped = 0;
+  FrameInfo frame;
+  frame.port = conf.ports[index].port;
+  frame.triggerTime = triggerTime;
 
-  if (VRmUsbCamLockNextImageEx2(device, port, &sourceImg, &framesDropped, conf.timeout)) {
-    VRmImage* targetImage = 0;
-    VRM_CHECK(VRmUsbCamNewImage(&targetImage, targetFormat));
-    VRM_CHECK(VRmUsbCamConvertImage(sourceImg, targetImage));
-
-    // Fill in the image message with the converted frame from the camera
-    img.width = targetImage->m_image_format.m_width;
-    img.height = targetImage->m_image_format.m_height;
-    img.step = img.width * 3;  // width * byte per pixel
-    img.encoding = sensor_msgs::image_encodings::BGR8;
-    img.data.resize(img.height * img.step);
-    img.header.stamp = triggerTime;
-    img.header.frame_id = conf.frameId;
+  if (!lockFrame(index, &sourceImg, frame)) {
+    ROS_ERROR("Could not lock image: %s", backend->getLastError());
+    return false;
+  }
+  convertFrame(index, sourceImg, img, frame);
+  VRM_CHECK(backend->unlockNextImage(&sourceImg));
+  if (info) *info = frame;
+  return true;
+}
 
-    // Convert from strided image to rectangular
-    for (unsigned int y = 0; y < img.height; y++) {
-      for (unsigned int x = 0; x < img.width * 3; x++) {
-        img.data[y * img.width * 3 + x] = targetImage->mp_buffer[y * targetImage->m_pitch + x];
-      }
+bool CameraHandle::grabRawFrame(size_t index, RawFrame& frame) {
+  VRmImage* sourceImg = 0;
+
+  frame.info.port = conf.ports[index].port;
+  frame.info.triggerTime = ros::Time::now();
+  if (!lockFrame(index, &sourceImg, frame.info)) {
+    ROS_ERROR("Could not lock image: %s", backend->getLastError());
+    return false;
+  }
+
+  // Copy the source out so the driver gets its buffer back before the expensive conversion
+  frame.format = sourceImg->m_image_format;
+  frame.pitch = frame.format.m_width * bytesPerPixel(frame.format.m_color_format);
+  frame.data.resize(frame.pitch * frame.format.m_height);
+  copyImage(sourceImg->mp_buffer, sourceImg->m_pitch, &frame.data[0], frame.pitch, frame.pitch, frame.format.m_height);
+
+  VRM_CHECK(backend->unlockNextImage(&sourceImg));
+  return true;
+}
+
+bool CameraHandle::lockFrame(size_t index, VRmImage** sourceImg, FrameInfo& info) {
+  Port& port = *ports[index];
+  VRmDWORD dropped = 0;
+
+  for (;;) {
+    Clock::time_point start = Clock::now();
+    bool locked = backend->lockNextImage(conf.ports[index].port, sourceImg, &info.framesDropped, conf.timeout);
+    double wait = std::chrono::duration<double>(Clock::now() - start).count();
+
+    if (!locked) {
+      port.stats.addLockTimeout(wait);
+      return false;
     }
 
-    VRM_CHECK(VRmUsbCamFreeImage(&targetImage));
+    port.stats.addFrame(info.framesDropped, wait);
+    dropped += info.framesDropped;
+    if (!skipPeriod) break;
+
+    // Periods are counted on the sensor clock, so all ports pass the same frames
+    const long period = static_cast<long>((*sourceImg)->m_time_stamp / 1000.0 / skipPeriod);
+    if (period != port.lastPeriod) {
+      port.lastPeriod = period;
+      break;
+    }
+    port.stats.addSkipped();
+    VRM_CHECK(backend->unlockNextImage(sourceImg));
+  }
+
+  info.framesDropped = dropped;
+  fillFrameInfo(index, *sourceImg, info);
+  if (recorder) recordFrame(*sourceImg, info);
+  return true;
+}
+
+bool CameraHandle::skipFrame(size_t index) {
+  VRmImage* sourceImg = 0;
+  FrameInfo info;
+  info.port = conf.ports[index].port;
+  if (!lockFrame(index, &sourceImg, info)) {
+    ROS_ERROR("Could not lock image: %s", backend->getLastError());
+    return false;
+  }
+  ports[index]->stats.addSkipped();
+  VRM_CHECK(backend->unlockNextImage(&sourceImg));
+  return true;
+}
 
-    VRM_CHECK(VRmUsbCamUnlockNextImage(device, &sourceImg));
+void CameraHandle::convertRawFrame(size_t index, RawFrame& frame, sensor_msgs::Image& img) {
+  VRmImage* sourceImg = 0;
+  VRM_CHECK(backend->wrapImage(&sourceImg, frame.format, &frame.data[0], frame.pitch));
+  convertFrame(index, sourceImg, img, frame.info);
+  VRM_CHECK(backend->freeImage(&sourceImg));
+}
+
+void CameraHandle::fillFrameInfo(size_t index, const VRmImage* sourceImg, FrameInfo& info) {
+  info.arrivalTime = ros::Time::now();
+  info.sensorTime = sourceImg->m_time_stamp / 1000.0;
+  VRM_CHECK(backend->getFrameCounter(sourceImg, &info.frameCounter));
+
+  if (conf.timestampMode == TIMESTAMP_SENSOR) {
+    double host = ports[index]->clock.update(info.sensorTime, info.arrivalTime.toSec());
+    info.stamp = ros::Time(host - conf.sensorLatency);
+  } else if (conf.triggerMode == TRIGGER_SOFTWARE) {
+    info.triggerTime = triggerTimeBefore(info.arrivalTime);
+    info.stamp = info.triggerTime;
+  } else {
+    info.stamp = info.triggerTime;
+  }
+}
+
+void CameraHandle::recordFrame(const VRmImage* sourceImg, const FrameInfo& info) {
+  const VRmImageFormat& format = sourceImg->m_image_format;
+  RecordedFrame frame = RecordedFrame();
+  frame.port = info.port;
+  frame.frameCounter = info.frameCounter;
+  frame.framesDropped = info.framesDropped;
+  frame.colorFormat = format.m_color_format;
+  frame.width = format.m_width;
+  frame.height = format.m_height;
+  frame.pitch = format.m_width * bytesPerPixel(format.m_color_format);
+  frame.sensorTime = info.sensorTime;
+  frame.stampSec = info.stamp.sec;
+  frame.stampNsec = info.stamp.nsec;
+  frame.arrivalSec = info.arrivalTime.sec;
+  frame.arrivalNsec = info.arrivalTime.nsec;
+
+  // A full queue only loses the frame for the recording, which notes it in the next entry
+  if (!recorder->record(frame, sourceImg->mp_buffer, sourceImg->m_pitch) && recorder->failed()) {
+    ROS_ERROR_THROTTLE(10.0, "Recording failed: %s", recorder->getLastError().c_str());
+  }
+}
+
+void CameraHandle::convertFrame(size_t index,
+                                const VRmImage* sourceImg,
+                                sensor_msgs::Image& img,
+                                const FrameInfo& info) {
+  Clock::time_point start = Clock::now();
+  const PortConfig& pc = conf.ports[index];
+  Port& port = *ports[index];
+
+  // Fill in the image message with the converted frame from the camera
+  img.width = port.targetFormat.m_width;
+  img.height = port.targetFormat.m_height;
+  img.step = img.width * bytesPerPixel(port.targetFormat.m_color_format);
+  img.encoding = port.encoding;
+  // A recycled message keeps its payload, so this only allocates for new messages
+  img.data.resize(img.step * img.height);
+  img.header.seq = info.frameCounter;
+  img.header.stamp = info.stamp;
+  img.header.frame_id = pc.frameId;
+
+  if (pc.outputFormat == OUTPUT_RAW) {
+    copyImage(sourceImg->mp_buffer, sourceImg->m_pitch, &img.data[0], img.step, img.step, img.height);
+  } else if (port.numStripes > 0) {
+    conversionPool->run(
+        port.numStripes,
+        std::bind(&CameraHandle::convertStripe, this, index, sourceImg, std::ref(img), std::placeholders::_1));
+  } else if (pc.converter != CONVERTER_SDK) {
+    demosaic(sourceImg->mp_buffer,
+             sourceImg->m_pitch,
+             &img.data[0],
+             img.step,
+             img.width,
+             img.height,
+             port.bayerPattern,
+             pc.converter == CONVERTER_EDGE_AWARE ? DEMOSAIC_EDGE_AWARE : DEMOSAIC_BILINEAR,
+             pc.outputFormat == OUTPUT_MONO8 ? DEMOSAIC_MONO8 : DEMOSAIC_BGR8);
+  } else if (conf.zeroCopy) {
+    // Convert straight into the message payload
+    VRmImage* targetImage = 0;
+    VRM_CHECK(backend->wrapImage(&targetImage, port.targetFormat, &img.data[0], img.step));
+    VRM_CHECK(backend->convertImage(sourceImg, targetImage));
+    VRM_CHECK(backend->freeImage(&targetImage));
   } else {
-    ROS_FATAL("Could not lock image: %s", VRmUsbCamGetLastError());
+    VRmImage* targetImage = port.pool->acquireImage();
+    VRM_CHECK(targetImage);
+    VRM_CHECK(backend->convertImage(sourceImg, targetImage));
+
+    // Convert from strided image to rectangular
+    copyImage(targetImage->mp_buffer, targetImage->m_pitch, &img.data[0], img.step, img.step, img.height);
+    port.pool->releaseImage(targetImage);
   }
+
+  port.stats.addConversion(std::chrono::duration<double>(Clock::now() - start).count());
+}
+
+void CameraHandle::convertStripe(size_t index, const VRmImage* sourceImg, sensor_msgs::Image& img, size_t stripe) {
+  const PortConfig& pc = conf.ports[index];
+  Port& port = *ports[index];
+  const VRmDWORD begin = stripe * port.stripeRows;
+  const VRmDWORD end = std::min(begin + port.stripeRows, img.height);
+
+  if (pc.converter != CONVERTER_SDK) {
+    demosaicRows(sourceImg->mp_buffer,
+                 sourceImg->m_pitch,
+                 &img.data[0],
+                 img.step,
+                 img.width,
+                 img.height,
+                 port.bayerPattern,
+                 pc.converter == CONVERTER_EDGE_AWARE ? DEMOSAIC_EDGE_AWARE : DEMOSAIC_BILINEAR,
+                 pc.outputFormat == OUTPUT_MONO8 ? DEMOSAIC_MONO8 : DEMOSAIC_BGR8,
+                 begin,
+                 end);
+    return;
+  }
+
+  // The SDK takes the edges of what it converts for image borders. Convert the stripe with
+  // a few rows of context into a scratch image and copy out only the stripe itself.
+  const VRmDWORD first = begin > STRIPE_OVERLAP ? begin - STRIPE_OVERLAP : 0;
+  const VRmDWORD last = std::min(end + STRIPE_OVERLAP, img.height);
+
+  VRmImageFormat format = sourceImg->m_image_format;
+  format.m_height = last - first;
+  VRmImage* source = 0;
+  VRM_CHECK(backend->wrapImage(&source, format, sourceImg->mp_buffer + first * sourceImg->m_pitch, sourceImg->m_pitch));
+
+  VRmImage* scratch = port.stripePool->acquireImage();
+  VRM_CHECK(scratch);
+  format = port.targetFormat;
+  format.m_height = last - first;
+  VRmImage* target = 0;
+  VRM_CHECK(backend->wrapImage(&target, format, scratch->mp_buffer, scratch->m_pitch));
+
+  VRM_CHECK(backend->convertImage(source, target));
+  copyImage(scratch->mp_buffer + (begin - first) * scratch->m_pitch,
+            scratch->m_pitch,
+            &img.data[begin * img.step],
+            img.step,
+            img.step,
+            end - begin);
+
+  VRM_CHECK(backend->freeImage(&target));
+  VRM_CHECK(backend->freeImage(&source));
+  port.stripePool->releaseImage(scratch);
 }
 }
@@ -0,0 +1,82 @@
+#include "clock_estimator.hpp"
+
+#include <algorithm>
+#include <limits>
+
+namespace vrmagic {
+
+static const double MAX_CAMERA_GAP = 1.0;
+
+ClockEstimator::ClockEstimator(size_t window_, double maxSkew_) : window(window_), maxSkew(maxSkew_) { reset(); }
+
+void ClockEstimator::reset() {
+  baseCamera = baseHost = 0;
+  observations.clear();
+  skew = 1;
+  offset = 0;
+}
+
+double ClockEstimator::update(double cameraTime, double hostTime) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  if (!observations.empty()) {
+    const double last = observations.back().camera + baseCamera;
+    if (cameraTime < last || cameraTime - last > MAX_CAMERA_GAP) reset();
+  }
+  if (observations.empty()) {
+    baseCamera = cameraTime;
+    baseHost = hostTime;
+  }
+
+  Observation o = {cameraTime - baseCamera, hostTime - baseHost};
+  observations.push_back(o);
+  if (observations.size() > window) observations.pop_front();
+
+  fit();
+  return baseHost + offset + skew * (cameraTime - baseCamera);
+}
+
+void ClockEstimator::fit() {
+  typedef std::deque<Observation>::const_iterator Iterator;
+  const double n = observations.size();
+
+  double meanX = 0, meanY = 0;
+  for (Iterator it = observations.begin(); it != observations.end(); ++it) {
+    meanX += it->camera;
+    meanY += it->host;
+  }
+  meanX /= n;
+  meanY /= n;
+
+  double sxx = 0, sxy = 0;
+  for (Iterator it = observations.begin(); it != observations.end(); ++it) {
+    sxx += (it->camera - meanX) * (it->camera - meanX);
+    sxy += (it->camera - meanX) * (it->host - meanY);
+  }
+
+  skew = 1;
+  if (sxx > std::numeric_limits<double>::epsilon()) {
+    skew = std::max(1 - maxSkew, std::min(1 + maxSkew, sxy / sxx));
+  }
+
+  offset = std::numeric_limits<double>::max();
+  for (Iterator it = observations.begin(); it != observations.end(); ++it) {
+    offset = std::min(offset, it->host - skew * it->camera);
+  }
+}
+
+double ClockEstimator::toHost(double cameraTime) const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return baseHost + offset + skew * (cameraTime - baseCamera);
+}
+
+double ClockEstimator::getSkew() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return skew;
+}
+
+size_t ClockEstimator::getNumObservations() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return observations.size();
+}
+}
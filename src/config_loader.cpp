@@ -0,0 +1,384 @@
+#include "config_loader.hpp"
+
+#include <string>
+
+#include <ros/console.h>
+
+using std::string;
+
+namespace vrmagic {
+
+static const string ENABLE_LOGGING = "enable_logging";
+static const string OUTPUT_FORMAT = "output_format";
+static const string ZERO_COPY = "zero_copy";
+static const string FRAME_RATE = "frame_rate";
+static const string POOL_SIZE = "pool_size";
+static const string PARALLEL_ACQUISITION = "parallel_acquisition";
+static const string CONVERSION_THREADS = "conversion_threads";
+static const string PIPELINE = "pipeline";
+static const string PIPELINE_DEPTH = "pipeline_depth";
+static const string TIMESTAMP_MODE = "timestamp_mode";
+static const string SENSOR_LATENCY = "sensor_latency";
+static const string TRIGGER_MODE = "trigger_mode";
+static const string TRIGGER_RATE = "trigger_rate";
+static const string PAIR_MATCHING = "pair_matching";
+static const string MAX_FRAME_COUNTER_SKEW = "max_frame_counter_skew";
+static const string MAX_TIME_SKEW = "max_time_skew";
+static const string PAIR_BUFFER = "pair_buffer";
+static const string LAZY_ACQUISITION = "lazy_acquisition";
+static const string STOP_IDLE_SENSOR = "stop_idle_sensor";
+static const string DIAGNOSTICS_RATE = "diagnostics_rate";
+static const string RECTIFY = "rectify";
+static const string DISPARITY = "disparity";
+static const string PREVIEW_FACTORS = "preview_factors";
+static const string SHARED_MEMORY = "shared_memory";
+static const string SHARED_MEMORY_SLOTS = "shared_memory_slots";
+
+static const string RECORDING = "recording/";
+static const string REC_PATH = RECORDING + "path";
+static const string REC_SEGMENT_SIZE = RECORDING + "segment_size";
+static const string REC_BUFFER_FRAMES = RECORDING + "buffer_frames";
+static const string BACKEND = "backend";
+static const string DEVICE = "device";
+static const string DEVICES = "devices";
+static const string CAMERA_NAME = "camera_name";
+static const string PORTS = "ports";
+static const string STEREO = "stereo";
+
+static const string SIMULATION = "simulation/";
+static const string SIM_WIDTH = SIMULATION + "width";
+static const string SIM_HEIGHT = SIMULATION + "height";
+static const string SIM_COLOR_FORMAT = SIMULATION + "color_format";
+static const string SIM_PITCH = SIMULATION + "pitch";
+static const string SIM_FRAME_RATE = SIMULATION + "frame_rate";
+static const string SIM_DROP_PROBABILITY = SIMULATION + "drop_probability";
+static const string SIM_LOCK_LATENCY = SIMULATION + "lock_latency";
+static const string SIM_CLOCK_DRIFT = SIMULATION + "clock_drift";
+
+static const string DECIMATION = "decimation/";
+static const string DEC_IMAGE_RAW = DECIMATION + "image_raw";
+static const string DEC_IMAGE_RECT = DECIMATION + "image_rect";
+static const string DEC_DISPARITY = DECIMATION + "disparity";
+static const string DEC_PREVIEWS = DECIMATION + "previews";
+
+static const string BLOCK_MATCHING = "block_matching/";
+static const string BM_COST = BLOCK_MATCHING + "cost";
+static const string BM_MIN_DISPARITY = BLOCK_MATCHING + "min_disparity";
+static const string BM_DISPARITY_RANGE = BLOCK_MATCHING + "disparity_range";
+static const string BM_WINDOW_SIZE = BLOCK_MATCHING + "window_size";
+static const string BM_UNIQUENESS_RATIO = BLOCK_MATCHING + "uniqueness_ratio";
+
+// Below the name of a port
+static const string PORT = "port";
+static const string FRAME_ID = "frame_id";
+static const string CONVERTER = "converter";
+static const string ROI_X_OFFSET = "roi/x_offset";
+static const string ROI_Y_OFFSET = "roi/y_offset";
+static const string ROI_WIDTH = "roi/width";
+static const string ROI_HEIGHT = "roi/height";
+static const string SUBSAMPLING = "subsampling";
+
+static bool outputFormatFromString(const string& name, OutputFormat* format) {
+  if (name == "bgr8") {
+    *format = OUTPUT_BGR8;
+  } else if (name == "mono8") {
+    *format = OUTPUT_MONO8;
+  } else if (name == "raw") {
+    *format = OUTPUT_RAW;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static bool converterFromString(const string& name, Converter* converter) {
+  if (name == "sdk") {
+    *converter = CONVERTER_SDK;
+  } else if (name == "bilinear") {
+    *converter = CONVERTER_BILINEAR;
+  } else if (name == "edge_aware") {
+    *converter = CONVERTER_EDGE_AWARE;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static bool loadSensorWindow(const ros::NodeHandle& nh, const string& prefix, SensorWindow& window) {
+  nh.param<int>(prefix + ROI_X_OFFSET, window.xOffset, window.xOffset);
+  nh.param<int>(prefix + ROI_Y_OFFSET, window.yOffset, window.yOffset);
+  nh.param<int>(prefix + ROI_WIDTH, window.width, window.width);
+  nh.param<int>(prefix + ROI_HEIGHT, window.height, window.height);
+  nh.param<int>(prefix + SUBSAMPLING, window.subsampling, window.subsampling);
+  if (window.xOffset < 0 || window.yOffset < 0 || window.width < 0 || window.height < 0) {
+    ROS_FATAL("The %sroi values cannot be negative", prefix.c_str());
+    return false;
+  }
+  if (window.subsampling != 1 && window.subsampling != 2 && window.subsampling != 4) {
+    ROS_FATAL("Sensors can only subsample by 1, 2 or 4, not %d", window.subsampling);
+    return false;
+  }
+  return true;
+}
+
+// Settings below nh/<name>/. Unset ones keep the values in port, except for the output
+// format, which defaults to the one of the device, and the frame, which defaults to one named
+// after the device and the port.
+static bool loadPort(const ros::NodeHandle& nh, const string& cameraName, const string& outputFormat,
+                     PortConfig& port) {
+  const string prefix = port.name + "/";
+  nh.param<int>(prefix + PORT, port.port, port.port);
+  if (port.port < 1 || port.port > static_cast<int>(NUM_SENSOR_PORTS)) {
+    ROS_FATAL("%s: there is no sensor port %d", port.name.c_str(), port.port);
+    return false;
+  }
+
+  const string frameId = port.frameId.empty() ? cameraName + "_" + port.name + "_optical_frame" : port.frameId;
+  nh.param<string>(prefix + FRAME_ID, port.frameId, frameId);
+
+  string format;
+  nh.param<string>(prefix + OUTPUT_FORMAT, format, outputFormat);
+  if (!outputFormatFromString(format, &port.outputFormat)) {
+    ROS_FATAL("Unknown output format: %s", format.c_str());
+    return false;
+  }
+
+  string converter;
+  nh.param<string>(prefix + CONVERTER, converter, "sdk");
+  if (!converterFromString(converter, &port.converter)) {
+    ROS_FATAL("Unknown converter: %s", converter.c_str());
+    return false;
+  }
+
+  return loadSensorWindow(nh, prefix, port.window);
+}
+
+bool loadConfig(const ros::NodeHandle& nh, Config& config) {
+  nh.param<bool>(ENABLE_LOGGING, config.enableLogging, false);
+  nh.param<bool>(ZERO_COPY, config.zeroCopy, config.zeroCopy);
+  nh.param<double>(FRAME_RATE, config.frameRate, config.frameRate);
+  nh.param<int>(POOL_SIZE, config.poolSize, config.poolSize);
+  nh.param<bool>(PARALLEL_ACQUISITION, config.parallelAcquisition, config.parallelAcquisition);
+  nh.param<int>(CONVERSION_THREADS, config.conversionThreads, config.conversionThreads);
+  nh.param<bool>(PIPELINE, config.pipeline, config.pipeline);
+  nh.param<int>(PIPELINE_DEPTH, config.pipelineDepth, config.pipelineDepth);
+  nh.param<double>(SENSOR_LATENCY, config.sensorLatency, config.sensorLatency);
+  nh.param<double>(TRIGGER_RATE, config.triggerRate, config.triggerRate);
+  nh.param<int>(MAX_FRAME_COUNTER_SKEW, config.maxFrameCounterSkew, config.maxFrameCounterSkew);
+  nh.param<double>(MAX_TIME_SKEW, config.maxTimeSkew, config.maxTimeSkew);
+  nh.param<int>(PAIR_BUFFER, config.pairBuffer, config.pairBuffer);
+  nh.param<bool>(LAZY_ACQUISITION, config.lazyAcquisition, config.lazyAcquisition);
+  nh.param<bool>(STOP_IDLE_SENSOR, config.stopIdleSensor, config.stopIdleSensor);
+  nh.param<double>(DIAGNOSTICS_RATE, config.diagnosticsRate, config.diagnosticsRate);
+  nh.param<bool>(RECTIFY, config.rectify, config.rectify);
+  nh.param<bool>(DISPARITY, config.disparity, config.disparity);
+  nh.param<std::vector<int> >(PREVIEW_FACTORS, config.previewFactors, config.previewFactors);
+  nh.param<bool>(SHARED_MEMORY, config.sharedMemory, config.sharedMemory);
+  nh.param<int>(SHARED_MEMORY_SLOTS, config.sharedMemorySlots, config.sharedMemorySlots);
+  nh.param<string>(BACKEND, config.backend, config.backend);
+  nh.param<string>(DEVICE, config.device, config.device);
+  nh.param<string>(CAMERA_NAME, config.cameraName, config.cameraName);
+  nh.param<bool>(STEREO, config.stereo, config.stereo);
+
+  // Validated with the ports, which can override it
+  string outputFormat;
+  nh.param<string>(OUTPUT_FORMAT, outputFormat, "bgr8");
+
+  string pairMatching;
+  nh.param<string>(PAIR_MATCHING, pairMatching, "frame_counter");
+  if (pairMatching == "frame_counter") {
+    config.pairMatching = PAIR_BY_FRAME_COUNTER;
+  } else if (pairMatching == "timestamp") {
+    config.pairMatching = PAIR_BY_TIMESTAMP;
+  } else {
+    ROS_FATAL("Unknown pair matching: %s", pairMatching.c_str());
+    return false;
+  }
+
+  string timestampMode;
+  nh.param<string>(TIMESTAMP_MODE, timestampMode, "host");
+  if (timestampMode == "host") {
+    config.timestampMode = TIMESTAMP_HOST;
+  } else if (timestampMode == "sensor") {
+    config.timestampMode = TIMESTAMP_SENSOR;
+  } else {
+    ROS_FATAL("Unknown timestamp mode: %s", timestampMode.c_str());
+    return false;
+  }
+
+  string triggerMode;
+  nh.param<string>(TRIGGER_MODE, triggerMode, "free_running");
+  if (triggerMode == "free_running") {
+    config.triggerMode = TRIGGER_FREE_RUNNING;
+  } else if (triggerMode == "software") {
+    config.triggerMode = TRIGGER_SOFTWARE;
+  } else if (triggerMode == "external") {
+    config.triggerMode = TRIGGER_EXTERNAL;
+  } else {
+    ROS_FATAL("Unknown trigger mode: %s", triggerMode.c_str());
+    return false;
+  }
+  if (config.triggerMode == TRIGGER_SOFTWARE && config.triggerRate <= 0) {
+    ROS_FATAL("The trigger rate must be positive");
+    return false;
+  }
+
+  // Simulated device
+  SimulationConfig& sim = config.simulation;
+  string simColorFormat;
+  nh.param<int>(SIM_WIDTH, sim.width, sim.width);
+  nh.param<int>(SIM_HEIGHT, sim.height, sim.height);
+  nh.param<string>(SIM_COLOR_FORMAT, simColorFormat, "bayer_gbrg_8");
+  nh.param<int>(SIM_PITCH, sim.pitch, sim.pitch);
+  nh.param<double>(SIM_FRAME_RATE, sim.frameRate, sim.frameRate);
+  nh.param<double>(SIM_DROP_PROBABILITY, sim.dropProbability, sim.dropProbability);
+  nh.param<double>(SIM_LOCK_LATENCY, sim.lockLatency, sim.lockLatency);
+  nh.param<double>(SIM_CLOCK_DRIFT, sim.clockDrift, sim.clockDrift);
+  if (!colorFormatFromString(simColorFormat, &sim.colorFormat)) {
+    ROS_FATAL("Unknown simulated color format: %s", simColorFormat.c_str());
+    return false;
+  }
+
+  for (size_t i = 0; i < config.previewFactors.size(); ++i) {
+    if (config.previewFactors[i] != 2 && config.previewFactors[i] != 4) {
+      ROS_FATAL("Previews can only be shrunk by 2 or 4, not %d", config.previewFactors[i]);
+      return false;
+    }
+  }
+
+  // Recording
+  RecorderConfig& rec = config.recording;
+  nh.param<string>(REC_PATH, rec.path, rec.path);
+  nh.param<int>(REC_SEGMENT_SIZE, rec.segmentSize, rec.segmentSize);
+  nh.param<int>(REC_BUFFER_FRAMES, rec.bufferFrames, rec.bufferFrames);
+  if (rec.segmentSize < 1 || rec.bufferFrames < 1) {
+    ROS_FATAL("The recording needs a segment size and buffer frames of at least 1");
+    return false;
+  }
+
+  if (config.sharedMemorySlots < 2) {
+    ROS_FATAL("The shared memory ring needs at least 2 slots");
+    return false;
+  }
+
+  if (config.poolSize < 1) {
+    ROS_FATAL("The pool size must be at least 1");
+    return false;
+  }
+
+  if (config.pipelineDepth < 1) {
+    ROS_FATAL("The pipeline depth must be at least 1");
+    return false;
+  }
+
+  // 0 converts on the grabbing thread only
+  if (config.conversionThreads < 0) {
+    ROS_FATAL("The number of conversion threads cannot be negative");
+    return false;
+  }
+
+  // A negative skew would reject every pair
+  if (config.maxFrameCounterSkew < 0 || config.maxTimeSkew < 0) {
+    ROS_FATAL("The frame counter and time skews of a pair cannot be negative");
+    return false;
+  }
+
+  if (config.pairBuffer < 1) {
+    ROS_FATAL("The pair buffer must hold at least 1 frame");
+    return false;
+  }
+
+  if (config.frameRate < 0) {
+    ROS_FATAL("The frame rate cannot be negative");
+    return false;
+  }
+
+  // Decimation
+  Decimation& dec = config.decimation;
+  nh.param<int>(DEC_IMAGE_RAW, dec.imageRaw, dec.imageRaw);
+  nh.param<int>(DEC_IMAGE_RECT, dec.imageRect, dec.imageRect);
+  nh.param<int>(DEC_DISPARITY, dec.disparity, dec.disparity);
+  nh.param<int>(DEC_PREVIEWS, dec.previews, dec.previews);
+  if (dec.imageRaw < 1 || dec.imageRect < 1 || dec.disparity < 1 || dec.previews < 1) {
+    ROS_FATAL("Decimation factors must be at least 1");
+    return false;
+  }
+
+  // Block matching
+  BlockMatcherConfig& bm = config.blockMatching;
+  string cost;
+  nh.param<string>(BM_COST, cost, "sad");
+  nh.param<int>(BM_MIN_DISPARITY, bm.minDisparity, bm.minDisparity);
+  nh.param<int>(BM_DISPARITY_RANGE, bm.numDisparities, bm.numDisparities);
+  nh.param<int>(BM_WINDOW_SIZE, bm.blockSize, bm.blockSize);
+  nh.param<int>(BM_UNIQUENESS_RATIO, bm.uniquenessRatio, bm.uniquenessRatio);
+  if (cost == "sad") {
+    bm.cost = MATCH_SAD;
+  } else if (cost == "census") {
+    bm.cost = MATCH_CENSUS;
+  } else {
+    ROS_FATAL("Unknown block matching cost: %s", cost.c_str());
+    return false;
+  }
+  if (bm.minDisparity < 0 || bm.numDisparities <= 0 || bm.numDisparities % 16 != 0) {
+    ROS_FATAL("The disparity range must be a positive multiple of 16 starting at 0 or above");
+    return false;
+  }
+  if (bm.blockSize < 1 || bm.blockSize > MAX_BLOCK_SIZE || bm.blockSize % 2 == 0) {
+    ROS_FATAL("The block matching window size must be odd and at most %d", MAX_BLOCK_SIZE);
+    return false;
+  }
+
+  // Ports, a name that was configured before keeps its values
+  std::vector<string> names;
+  for (size_t i = 0; i < config.ports.size(); ++i) names.push_back(config.ports[i].name);
+  nh.param<std::vector<string> >(PORTS, names, names);
+  if (names.empty()) {
+    ROS_FATAL("At least one port must be configured");
+    return false;
+  }
+
+  std::vector<PortConfig> ports;
+  for (size_t i = 0; i < names.size(); ++i) {
+    PortConfig port(names[i], i + 1);
+    for (size_t j = 0; j < config.ports.size(); ++j) {
+      if (config.ports[j].name == names[i]) port = config.ports[j];
+    }
+    if (!loadPort(nh, config.cameraName, outputFormat, port)) return false;
+
+    for (size_t j = 0; j < ports.size(); ++j) {
+      if (ports[j].name == port.name || ports[j].port == port.port) {
+        ROS_FATAL("Ports %s and %s are the same", ports[j].name.c_str(), port.name.c_str());
+        return false;
+      }
+    }
+    ports.push_back(port);
+  }
+  config.ports = ports;
+
+  if (config.stereo && config.ports.size() < 2) {
+    ROS_WARN("A stereo pair needs two ports, publishing %s on its own", config.ports[0].name.c_str());
+    config.stereo = false;
+  }
+  if (config.stereo) {
+    const PortConfig& left = config.ports[0];
+    const PortConfig& right = config.ports[1];
+    const SensorWindow& wl = left.window;
+    const SensorWindow& wr = right.window;
+    if (wl.width != wr.width || wl.height != wr.height || wl.subsampling != wr.subsampling) {
+      ROS_FATAL("The %s and %s sensor windows must have the same size and subsampling",
+                left.name.c_str(),
+                right.name.c_str());
+      return false;
+    }
+  }
+
+  return true;
+}
+
+std::vector<string> loadDeviceNames(const ros::NodeHandle& nh) {
+  std::vector<string> names;
+  nh.param<std::vector<string> >(DEVICES, names, names);
+  return names;
+}
+}
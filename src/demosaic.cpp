@@ -0,0 +1,479 @@
+#include "demosaic.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define VRMAGIC_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define VRMAGIC_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace vrmagic {
+
+// All kernels compute the same integer formulas, so they agree bit by bit:
+//   avg(a, b)  = (a + b + 1) >> 1
+//   cross      = avg(avg(left, right), avg(up, down))
+//   diagonal   = avg(avg(upLeft, upRight), avg(downLeft, downRight))
+//   luma       = (29 * b + 150 * g + 77 * r + 128) >> 8
+// At a red or blue site, green is the cross mean (or, edge-aware, the mean along the
+// direction with the smaller difference) and the other chroma the diagonal mean. At a
+// green site, the chroma of the row is the horizontal mean and the other the vertical one.
+
+// Neighbouring rows of the row being converted.
+struct Rows {
+  const uint8_t* up;
+  const uint8_t* cur;
+  const uint8_t* down;
+};
+
+struct RowLayout {
+  // Even columns hold the chroma of the row, otherwise they hold green
+  bool chromaFirst;
+  // The chroma of the row is red, otherwise blue
+  bool chromaRed;
+};
+
+// Helper functions
+
+static RowLayout rowLayout(BayerPattern pattern, size_t y) {
+  const bool odd = y & 1;
+  RowLayout layout;
+  switch (pattern) {
+    case BAYER_RGGB:
+      layout.chromaFirst = !odd;
+      layout.chromaRed = !odd;
+      break;
+    case BAYER_BGGR:
+      layout.chromaFirst = !odd;
+      layout.chromaRed = odd;
+      break;
+    case BAYER_GRBG:
+      layout.chromaFirst = odd;
+      layout.chromaRed = !odd;
+      break;
+    default:  // BAYER_GBRG
+      layout.chromaFirst = odd;
+      layout.chromaRed = odd;
+      break;
+  }
+  return layout;
+}
+
+static inline uint8_t avg(uint8_t a, uint8_t b) { return (a + b + 1) >> 1; }
+
+static inline uint8_t absDiff(uint8_t a, uint8_t b) { return a > b ? a - b : b - a; }
+
+static inline uint8_t luma(uint8_t b, uint8_t g, uint8_t r) { return (29 * b + 150 * g + 77 * r + 128) >> 8; }
+
+// Converts columns [x0, x1) of a row, mirroring columns outside the image.
+static void demosaicRowScalar(const Rows& rows,
+                              size_t x0,
+                              size_t x1,
+                              size_t width,
+                              RowLayout layout,
+                              bool edgeAware,
+                              DemosaicOutput output,
+                              uint8_t* dst) {
+  for (size_t x = x0; x < x1; ++x) {
+    const size_t xl = x == 0 ? 1 : x - 1;
+    const size_t xr = x + 1 == width ? width - 2 : x + 1;
+
+    const uint8_t c = rows.cur[x];
+    const uint8_t l = rows.cur[xl];
+    const uint8_t r = rows.cur[xr];
+    const uint8_t u = rows.up[x];
+    const uint8_t d = rows.down[x];
+    const uint8_t h = avg(l, r);
+    const uint8_t v = avg(u, d);
+
+    uint8_t chroma, green, other;
+    if (((x & 1) == 0) == layout.chromaFirst) {
+      green = avg(h, v);
+      if (edgeAware) {
+        const uint8_t dh = absDiff(l, r);
+        const uint8_t dv = absDiff(u, d);
+        if (dh < dv) green = h;
+        if (dv < dh) green = v;
+      }
+      chroma = c;
+      other = avg(avg(rows.up[xl], rows.up[xr]), avg(rows.down[xl], rows.down[xr]));
+    } else {
+      chroma = h;
+      green = c;
+      other = v;
+    }
+
+    const uint8_t red = layout.chromaRed ? chroma : other;
+    const uint8_t blue = layout.chromaRed ? other : chroma;
+    if (output == DEMOSAIC_BGR8) {
+      dst[3 * x] = blue;
+      dst[3 * x + 1] = green;
+      dst[3 * x + 2] = red;
+    } else {
+      dst[x] = luma(blue, green, red);
+    }
+  }
+}
+
+#ifdef VRMAGIC_X86
+
+__attribute__((target("ssse3"))) static inline __m128i select128(__m128i mask, __m128i a, __m128i b) {
+  return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// Interleaves 16 pixels of three planes into 48 bytes of BGR.
+__attribute__((target("ssse3"))) static inline void storeBgr128(uint8_t* dst, __m128i b, __m128i g, __m128i r) {
+  const __m128i b0 = _mm_setr_epi8(0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5);
+  const __m128i g0 = _mm_setr_epi8(-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1);
+  const __m128i r0 = _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1);
+  const __m128i b1 = _mm_setr_epi8(-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1);
+  const __m128i g1 = _mm_setr_epi8(5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10);
+  const __m128i r1 = _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1);
+  const __m128i b2 = _mm_setr_epi8(-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1);
+  const __m128i g2 = _mm_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1);
+  const __m128i r2 = _mm_setr_epi8(10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15);
+
+  __m128i* out = reinterpret_cast<__m128i*>(dst);
+  _mm_storeu_si128(
+      out,
+      _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(b, b0), _mm_shuffle_epi8(g, g0)), _mm_shuffle_epi8(r, r0)));
+  _mm_storeu_si128(
+      out + 1,
+      _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(b, b1), _mm_shuffle_epi8(g, g1)), _mm_shuffle_epi8(r, r1)));
+  _mm_storeu_si128(
+      out + 2,
+      _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(b, b2), _mm_shuffle_epi8(g, g2)), _mm_shuffle_epi8(r, r2)));
+}
+
+// Luma of 8 pixels, widened to 16 bits.
+__attribute__((target("ssse3"))) static inline __m128i luma128(__m128i b, __m128i g, __m128i r) {
+  __m128i sum = _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(29)), _mm_mullo_epi16(g, _mm_set1_epi16(150)));
+  sum = _mm_add_epi16(sum, _mm_mullo_epi16(r, _mm_set1_epi16(77)));
+  return _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(128)), 8);
+}
+
+// Converts columns [x0, x1) of a row, x0 even, x0 >= 1 and x1 - x0 a multiple of 16, with
+// column x1 still inside the image.
+__attribute__((target("ssse3"))) static void demosaicRowSsse3(const Rows& rows,
+                                                             size_t x0,
+                                                             size_t x1,
+                                                             RowLayout layout,
+                                                             bool edgeAware,
+                                                             DemosaicOutput output,
+                                                             uint8_t* dst) {
+  // Chroma sites are the even lanes if the row starts with chroma, the odd ones otherwise
+  const __m128i chromaSites = _mm_set1_epi16(layout.chromaFirst ? 0x00FF : static_cast<short>(0xFF00));
+  const __m128i zero = _mm_setzero_si128();
+
+  for (size_t x = x0; x < x1; x += 16) {
+    const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows.cur + x));
+    const __m128i l = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows.cur + x - 1));
+    const __m128i r = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows.cur + x + 1));
+    const __m128i u = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows.up + x));
+    const __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows.down + x));
+    const __m128i ul = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows.up + x - 1));
+    const __m128i ur = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows.up + x + 1));
+    const __m128i dl = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows.down + x - 1));
+    const __m128i dr = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows.down + x + 1));
+
+    const __m128i h = _mm_avg_epu8(l, r);
+    const __m128i v = _mm_avg_epu8(u, d);
+    const __m128i diagonal = _mm_avg_epu8(_mm_avg_epu8(ul, ur), _mm_avg_epu8(dl, dr));
+    __m128i green = _mm_avg_epu8(h, v);
+    if (edgeAware) {
+      const __m128i dh = _mm_or_si128(_mm_subs_epu8(l, r), _mm_subs_epu8(r, l));
+      const __m128i dv = _mm_or_si128(_mm_subs_epu8(u, d), _mm_subs_epu8(d, u));
+      const __m128i minimum = _mm_min_epu8(dh, dv);
+      const __m128i horizontal = _mm_cmpeq_epi8(minimum, dh);
+      const __m128i vertical = _mm_cmpeq_epi8(minimum, dv);
+      const __m128i tie = _mm_and_si128(horizontal, vertical);
+      green = select128(tie, green, select128(horizontal, h, v));
+    }
+
+    const __m128i chroma = select128(chromaSites, c, h);
+    green = select128(chromaSites, green, c);
+    const __m128i other = select128(chromaSites, diagonal, v);
+    const __m128i red = layout.chromaRed ? chroma : other;
+    const __m128i blue = layout.chromaRed ? other : chroma;
+
+    if (output == DEMOSAIC_BGR8) {
+      storeBgr128(dst + 3 * x, blue, green, red);
+    } else {
+      const __m128i lo = luma128(_mm_unpacklo_epi8(blue, zero), _mm_unpacklo_epi8(green, zero),
+                                 _mm_unpacklo_epi8(red, zero));
+      const __m128i hi = luma128(_mm_unpackhi_epi8(blue, zero), _mm_unpackhi_epi8(green, zero),
+                                 _mm_unpackhi_epi8(red, zero));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), _mm_packus_epi16(lo, hi));
+    }
+  }
+}
+
+__attribute__((target("avx2"))) static inline __m256i select256(__m256i mask, __m256i a, __m256i b) {
+  return _mm256_or_si256(_mm256_and_si256(mask, a), _mm256_andnot_si256(mask, b));
+}
+
+__attribute__((target("avx2"))) static inline __m256i luma256(__m256i b, __m256i g, __m256i r) {
+  __m256i sum =
+      _mm256_add_epi16(_mm256_mullo_epi16(b, _mm256_set1_epi16(29)), _mm256_mullo_epi16(g, _mm256_set1_epi16(150)));
+  sum = _mm256_add_epi16(sum, _mm256_mullo_epi16(r, _mm256_set1_epi16(77)));
+  return _mm256_srli_epi16(_mm256_add_epi16(sum, _mm256_set1_epi16(128)), 8);
+}
+
+// As demosaicRowSsse3, 32 pixels at a time.
+__attribute__((target("avx2"))) static void demosaicRowAvx2(const Rows& rows,
+                                                           size_t x0,
+                                                           size_t x1,
+                                                           RowLayout layout,
+                                                           bool edgeAware,
+                                                           DemosaicOutput output,
+                                                           uint8_t* dst) {
+  const __m256i chromaSites = _mm256_set1_epi16(layout.chromaFirst ? 0x00FF : static_cast<short>(0xFF00));
+  const __m256i zero = _mm256_setzero_si256();
+
+  for (size_t x = x0; x < x1; x += 32) {
+    const __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows.cur + x));
+    const __m256i l = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows.cur + x - 1));
+    const __m256i r = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows.cur + x + 1));
+    const __m256i u = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows.up + x));
+    const __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows.down + x));
+    const __m256i ul = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows.up + x - 1));
+    const __m256i ur = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows.up + x + 1));
+    const __m256i dl = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows.down + x - 1));
+    const __m256i dr = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows.down + x + 1));
+
+    const __m256i h = _mm256_avg_epu8(l, r);
+    const __m256i v = _mm256_avg_epu8(u, d);
+    const __m256i diagonal = _mm256_avg_epu8(_mm256_avg_epu8(ul, ur), _mm256_avg_epu8(dl, dr));
+    __m256i green = _mm256_avg_epu8(h, v);
+    if (edgeAware) {
+      const __m256i dh = _mm256_or_si256(_mm256_subs_epu8(l, r), _mm256_subs_epu8(r, l));
+      const __m256i dv = _mm256_or_si256(_mm256_subs_epu8(u, d), _mm256_subs_epu8(d, u));
+      const __m256i minimum = _mm256_min_epu8(dh, dv);
+      const __m256i horizontal = _mm256_cmpeq_epi8(minimum, dh);
+      const __m256i vertical = _mm256_cmpeq_epi8(minimum, dv);
+      const __m256i tie = _mm256_and_si256(horizontal, vertical);
+      green = select256(tie, green, select256(horizontal, h, v));
+    }
+
+    const __m256i chroma = select256(chromaSites, c, h);
+    green = select256(chromaSites, green, c);
+    const __m256i other = select256(chromaSites, diagonal, v);
+    const __m256i red = layout.chromaRed ? chroma : other;
+    const __m256i blue = layout.chromaRed ? other : chroma;
+
+    if (output == DEMOSAIC_BGR8) {
+      // The byte shuffle works within 128-bit lanes, interleave each half on its own
+      storeBgr128(dst + 3 * x,
+                  _mm256_castsi256_si128(blue),
+                  _mm256_castsi256_si128(green),
+                  _mm256_castsi256_si128(red));
+      storeBgr128(dst + 3 * (x + 16),
+                  _mm256_extracti128_si256(blue, 1),
+                  _mm256_extracti128_si256(green, 1),
+                  _mm256_extracti128_si256(red, 1));
+    } else {
+      // Unpacking and packing both stay within lanes, so the pixel order is preserved
+      const __m256i lo = luma256(_mm256_unpacklo_epi8(blue, zero), _mm256_unpacklo_epi8(green, zero),
+                                 _mm256_unpacklo_epi8(red, zero));
+      const __m256i hi = luma256(_mm256_unpackhi_epi8(blue, zero), _mm256_unpackhi_epi8(green, zero),
+                                 _mm256_unpackhi_epi8(red, zero));
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + x), _mm256_packus_epi16(lo, hi));
+    }
+  }
+}
+
+#endif
+
+#ifdef VRMAGIC_NEON
+
+static inline uint8x8_t lumaNeon(uint8x8_t b, uint8x8_t g, uint8x8_t r) {
+  uint16x8_t sum = vmull_u8(b, vdup_n_u8(29));
+  sum = vmlal_u8(sum, g, vdup_n_u8(150));
+  sum = vmlal_u8(sum, r, vdup_n_u8(77));
+  return vrshrn_n_u16(sum, 8);
+}
+
+// As demosaicRowSsse3.
+static void demosaicRowNeon(const Rows& rows,
+                            size_t x0,
+                            size_t x1,
+                            RowLayout layout,
+                            bool edgeAware,
+                            DemosaicOutput output,
+                            uint8_t* dst) {
+  const uint8x16_t chromaSites = vreinterpretq_u8_u16(vdupq_n_u16(layout.chromaFirst ? 0x00FF : 0xFF00));
+
+  for (size_t x = x0; x < x1; x += 16) {
+    const uint8x16_t c = vld1q_u8(rows.cur + x);
+    const uint8x16_t l = vld1q_u8(rows.cur + x - 1);
+    const uint8x16_t r = vld1q_u8(rows.cur + x + 1);
+    const uint8x16_t u = vld1q_u8(rows.up + x);
+    const uint8x16_t d = vld1q_u8(rows.down + x);
+    const uint8x16_t ul = vld1q_u8(rows.up + x - 1);
+    const uint8x16_t ur = vld1q_u8(rows.up + x + 1);
+    const uint8x16_t dl = vld1q_u8(rows.down + x - 1);
+    const uint8x16_t dr = vld1q_u8(rows.down + x + 1);
+
+    const uint8x16_t h = vrhaddq_u8(l, r);
+    const uint8x16_t v = vrhaddq_u8(u, d);
+    const uint8x16_t diagonal = vrhaddq_u8(vrhaddq_u8(ul, ur), vrhaddq_u8(dl, dr));
+    uint8x16_t green = vrhaddq_u8(h, v);
+    if (edgeAware) {
+      const uint8x16_t dh = vabdq_u8(l, r);
+      const uint8x16_t dv = vabdq_u8(u, d);
+      const uint8x16_t horizontal = vcleq_u8(dh, dv);
+      const uint8x16_t tie = vceqq_u8(dh, dv);
+      green = vbslq_u8(tie, green, vbslq_u8(horizontal, h, v));
+    }
+
+    const uint8x16_t chroma = vbslq_u8(chromaSites, c, h);
+    green = vbslq_u8(chromaSites, green, c);
+    const uint8x16_t other = vbslq_u8(chromaSites, diagonal, v);
+    const uint8x16_t red = layout.chromaRed ? chroma : other;
+    const uint8x16_t blue = layout.chromaRed ? other : chroma;
+
+    if (output == DEMOSAIC_BGR8) {
+      uint8x16x3_t bgr;
+      bgr.val[0] = blue;
+      bgr.val[1] = green;
+      bgr.val[2] = red;
+      vst3q_u8(dst + 3 * x, bgr);
+    } else {
+      const uint8x8_t lo = lumaNeon(vget_low_u8(blue), vget_low_u8(green), vget_low_u8(red));
+      const uint8x8_t hi = lumaNeon(vget_high_u8(blue), vget_high_u8(green), vget_high_u8(red));
+      vst1q_u8(dst + x, vcombine_u8(lo, hi));
+    }
+  }
+}
+
+#endif
+
+typedef void (*RowKernel)(const Rows&, size_t, size_t, RowLayout, bool, DemosaicOutput, uint8_t*);
+
+// Vector kernel of a method and the number of pixels it converts per step.
+static RowKernel rowKernel(DemosaicMethod method, size_t* step) {
+  switch (method) {
+#ifdef VRMAGIC_X86
+    case DEMOSAIC_SSSE3:
+      *step = 16;
+      return demosaicRowSsse3;
+    case DEMOSAIC_AVX2:
+      *step = 32;
+      return demosaicRowAvx2;
+#endif
+#ifdef VRMAGIC_NEON
+    case DEMOSAIC_NEON:
+      *step = 16;
+      return demosaicRowNeon;
+#endif
+    default:
+      *step = 0;
+      return 0;
+  }
+}
+
+// Member functions
+
+const char* demosaicMethodName(DemosaicMethod method) {
+  switch (method) {
+    case DEMOSAIC_AUTO:
+      return "auto";
+    case DEMOSAIC_SCALAR:
+      return "scalar";
+    case DEMOSAIC_SSSE3:
+      return "ssse3";
+    case DEMOSAIC_AVX2:
+      return "avx2";
+    case DEMOSAIC_NEON:
+      return "neon";
+  }
+  return "unknown";
+}
+
+bool demosaicMethodSupported(DemosaicMethod method) {
+  switch (method) {
+#ifdef VRMAGIC_X86
+    case DEMOSAIC_SSSE3:
+      return __builtin_cpu_supports("ssse3");
+    case DEMOSAIC_AVX2:
+      return __builtin_cpu_supports("avx2");
+#else
+    case DEMOSAIC_SSSE3:
+    case DEMOSAIC_AVX2:
+      return false;
+#endif
+#ifdef VRMAGIC_NEON
+    case DEMOSAIC_NEON:
+      return true;
+#else
+    case DEMOSAIC_NEON:
+      return false;
+#endif
+    default:
+      return true;
+  }
+}
+
+DemosaicMethod resolveDemosaicMethod(DemosaicMethod method) {
+  if (method != DEMOSAIC_AUTO && demosaicMethodSupported(method)) return method;
+  if (demosaicMethodSupported(DEMOSAIC_AVX2)) return DEMOSAIC_AVX2;
+  if (demosaicMethodSupported(DEMOSAIC_SSSE3)) return DEMOSAIC_SSSE3;
+  if (demosaicMethodSupported(DEMOSAIC_NEON)) return DEMOSAIC_NEON;
+  return DEMOSAIC_SCALAR;
+}
+
+void demosaic(const uint8_t* src,
+              size_t srcPitch,
+              uint8_t* dst,
+              size_t dstPitch,
+              size_t width,
+              size_t height,
+              BayerPattern pattern,
+              DemosaicAlgorithm algorithm,
+              DemosaicOutput output,
+              DemosaicMethod method) {
+  demosaicRows(src, srcPitch, dst, dstPitch, width, height, pattern, algorithm, output, 0, height, method);
+}
+
+void demosaicRows(const uint8_t* src,
+                  size_t srcPitch,
+                  uint8_t* dst,
+                  size_t dstPitch,
+                  size_t width,
+                  size_t height,
+                  BayerPattern pattern,
+                  DemosaicAlgorithm algorithm,
+                  DemosaicOutput output,
+                  size_t rowBegin,
+                  size_t rowEnd,
+                  DemosaicMethod method) {
+  size_t step = 0;
+  RowKernel kernel = rowKernel(resolveDemosaicMethod(method), &step);
+
+  // Vector kernels read one column to either side, so they cover columns [2, vectorEnd)
+  // and the scalar code does the borders. Starting at 2 keeps the Bayer phase of the lanes.
+  size_t vectorEnd = 2;
+  if (kernel && width > 3) vectorEnd += (width - 3) / step * step;
+
+  const bool edgeAware = algorithm == DEMOSAIC_EDGE_AWARE;
+  for (size_t y = rowBegin; y < rowEnd; ++y) {
+    // Mirroring by one row keeps the Bayer phase
+    Rows rows;
+    rows.cur = src + y * srcPitch;
+    rows.up = src + (y == 0 ? 1 : y - 1) * srcPitch;
+    rows.down = src + (y + 1 == height ? height - 2 : y + 1) * srcPitch;
+
+    const RowLayout layout = rowLayout(pattern, y);
+    uint8_t* out = dst + y * dstPitch;
+    if (vectorEnd > 2) {
+      demosaicRowScalar(rows, 0, 2, width, layout, edgeAware, output, out);
+      kernel(rows, 2, vectorEnd, layout, edgeAware, output, out);
+      demosaicRowScalar(rows, vectorEnd, width, width, layout, edgeAware, output, out);
+    } else {
+      demosaicRowScalar(rows, 0, width, width, layout, edgeAware, output, out);
+    }
+  }
+}
+}
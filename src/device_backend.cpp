@@ -0,0 +1,18 @@
+#include "device_backend.hpp"
+
+namespace vrmagic {
+
+VRmDWORD bytesPerPixel(VRmColorFormat format) {
+  switch (format) {
+    case VRM_ARGB_4X8:
+      return 4;
+    case VRM_BGR_3X8:
+      return 3;
+    case VRM_RGB_565:
+    case VRM_YUYV_4X8:
+      return 2;
+    default:
+      return 1;
+  }
+}
+}
@@ -0,0 +1,26 @@
+#include "device_runner.hpp"
+
+namespace vrmagic {
+
+DeviceRunner::DeviceRunner(const ros::NodeHandle& nh_, const Config& config) : nh(nh_), running(true) {
+  nh.setCallbackQueue(&queue);
+  cam = new CameraHandle(config);
+  node = new VrMagicNode(nh, cam);
+  thread = std::thread(&DeviceRunner::run, this);
+}
+
+DeviceRunner::~DeviceRunner() {
+  running = false;
+  thread.join();
+
+  delete node;
+  delete cam;
+}
+
+void DeviceRunner::run() {
+  while (running && ros::ok()) {
+    node->spin();
+    queue.callAvailable();
+  }
+}
+}
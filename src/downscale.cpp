@@ -0,0 +1,206 @@
+#include "downscale.hpp"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define VRMAGIC_X86 1
+#include <immintrin.h>
+#endif
+
+namespace vrmagic {
+
+// Blocks are summed in 16 bits, first the rows of a block row into rowSums, then the
+// columns of each block. The mean is (sum + factor^2 / 2) >> log2(factor^2), the same in
+// the vector and the scalar code.
+
+// Helper functions
+
+// SSE2 is part of every x86-64 CPU, so it needs no dispatch, only `vector` to turn it off.
+static void verticalSums(const uint8_t* src, size_t pitch, size_t rows, size_t bytes, bool vector, uint16_t* sums) {
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  for (; vector && i + 16 <= bytes; i += 16) {
+    __m128i lo = zero;
+    __m128i hi = zero;
+    for (size_t r = 0; r < rows; ++r) {
+      const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + r * pitch + i));
+      lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(v, zero));
+      hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(v, zero));
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(sums + i), lo);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(sums + i + 8), hi);
+  }
+#endif
+  for (; i < bytes; ++i) {
+    uint16_t sum = 0;
+    for (size_t r = 0; r < rows; ++r) sum += src[r * pitch + i];
+    sums[i] = sum;
+  }
+}
+
+// Means of the blocks [x0, x1) of a row. Fixed channels and factor let the compiler unroll
+// the inner loops, which makes this several times faster for bgr8.
+template <size_t channels, size_t factor>
+static void horizontalMeansScalar(const uint16_t* sums, size_t x0, size_t x1, uint8_t* dst) {
+  const int shift = factor == 4 ? 4 : 2;
+  for (size_t x = x0; x < x1; ++x) {
+    // All loads before the stores, which could alias the sums as far as the compiler knows
+    unsigned sum[channels] = {};
+    for (size_t k = 0; k < factor; ++k) {
+      for (size_t c = 0; c < channels; ++c) sum[c] += sums[(x * factor + k) * channels + c];
+    }
+    for (size_t c = 0; c < channels; ++c) dst[x * channels + c] = (sum[c] + (1 << (shift - 1))) >> shift;
+  }
+}
+
+template <size_t channels>
+static void horizontalMeansScalar(const uint16_t* sums, size_t x0, size_t x1, size_t factor, uint8_t* dst) {
+  if (factor == 4) {
+    horizontalMeansScalar<channels, 4>(sums, x0, x1, dst);
+  } else {
+    horizontalMeansScalar<channels, 2>(sums, x0, x1, dst);
+  }
+}
+
+#ifdef VRMAGIC_X86
+
+// Shuffles that pack the block sums of 48 bytes, see horizontalMeansSsse3(). Output byte o
+// comes from the start of its block in its channel.
+static void packShuffles(size_t channels, size_t factor, __m128i shuffles[2][3]) {
+  int8_t masks[2][3][16];
+  for (int i = 0; i < 2 * 3 * 16; ++i) (&masks[0][0][0])[i] = -1;
+  for (size_t o = 0; o < 48 / factor; ++o) {
+    const size_t i = o / channels * factor * channels + o % channels;
+    masks[o / 16][i / 16][o % 16] = i % 16;
+  }
+  for (int o = 0; o < 2; ++o) {
+    for (int i = 0; i < 3; ++i) shuffles[o][i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(masks[o][i]));
+  }
+}
+
+// Means of the blocks of a row, 48 sums at a time. Every sum is added to those of the same
+// channel in the next factor - 1 pixels, so the block sums sit at the block starts, from
+// where the shuffles pack them together. Returns the blocks done.
+__attribute__((target("ssse3"))) static size_t horizontalMeansSsse3(const uint16_t* sums,
+                                                                    size_t blocks,
+                                                                    size_t channels,
+                                                                    size_t factor,
+                                                                    int shift,
+                                                                    const __m128i shuffles[2][3],
+                                                                    uint8_t* dst) {
+  const size_t rowBytes = blocks * factor * channels;
+  const size_t outBytes = 48 / factor;
+
+  const __m128i round = _mm_set1_epi16(1 << (shift - 1));
+  size_t x = 0;
+  for (size_t i0 = 0; i0 + 48 + (factor - 1) * channels <= rowBytes; i0 += 48, x += 48 / (factor * channels)) {
+    __m128i packed[3];
+    for (size_t r = 0; r < 3; ++r) {
+      const uint16_t* in = sums + i0 + 16 * r;
+      __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+      __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 8));
+      for (size_t k = 1; k < factor; ++k) {
+        lo = _mm_add_epi16(lo, _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + k * channels)));
+        hi = _mm_add_epi16(hi, _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 8 + k * channels)));
+      }
+      lo = _mm_srli_epi16(_mm_add_epi16(lo, round), shift);
+      hi = _mm_srli_epi16(_mm_add_epi16(hi, round), shift);
+      packed[r] = _mm_packus_epi16(lo, hi);
+    }
+
+    __m128i out[2];
+    for (int o = 0; o < 2; ++o) {
+      out[o] = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(packed[0], shuffles[o][0]),
+                                         _mm_shuffle_epi8(packed[1], shuffles[o][1])),
+                            _mm_shuffle_epi8(packed[2], shuffles[o][2]));
+    }
+
+    uint8_t* means = dst + x * channels;
+    if (outBytes == 24) {
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(means), out[0]);
+      _mm_storel_epi64(reinterpret_cast<__m128i*>(means + 16), out[1]);
+    } else {
+      _mm_storel_epi64(reinterpret_cast<__m128i*>(means), out[0]);
+      const uint32_t last = _mm_cvtsi128_si32(_mm_srli_si128(out[0], 8));
+      memcpy(means + 8, &last, 4);
+    }
+  }
+  return x;
+}
+
+#endif
+
+// Member functions
+
+const char* downscaleMethodName(DownscaleMethod method) {
+  switch (method) {
+    case DOWNSCALE_AUTO:
+      return "auto";
+    case DOWNSCALE_SCALAR:
+      return "scalar";
+    case DOWNSCALE_SSSE3:
+      return "ssse3";
+  }
+  return "unknown";
+}
+
+bool downscaleMethodSupported(DownscaleMethod method) {
+  switch (method) {
+#ifdef VRMAGIC_X86
+    case DOWNSCALE_SSSE3:
+      return __builtin_cpu_supports("ssse3");
+#else
+    case DOWNSCALE_SSSE3:
+      return false;
+#endif
+    default:
+      return true;
+  }
+}
+
+void downscale(const uint8_t* src,
+               size_t srcPitch,
+               uint8_t* dst,
+               size_t dstPitch,
+               size_t width,
+               size_t height,
+               size_t channels,
+               size_t factor,
+               std::vector<uint16_t>& rowSums,
+               DownscaleMethod method) {
+  const size_t blocks = width / factor;
+  if (blocks == 0 || height / factor == 0) return;
+  const size_t rowBytes = blocks * factor * channels;
+  const int shift = factor == 4 ? 4 : 2;
+  rowSums.resize(rowBytes);
+  if (method == DOWNSCALE_AUTO) method = downscaleMethodSupported(DOWNSCALE_SSSE3) ? DOWNSCALE_SSSE3 : DOWNSCALE_SCALAR;
+  const bool vector = method != DOWNSCALE_SCALAR;
+#ifdef VRMAGIC_X86
+  const bool ssse3 = method == DOWNSCALE_SSSE3;
+  __m128i shuffles[2][3];
+  packShuffles(channels, factor, shuffles);
+#endif
+
+  for (size_t y = 0; y < height / factor; ++y) {
+    verticalSums(src + y * factor * srcPitch, srcPitch, factor, rowBytes, vector, &rowSums[0]);
+
+    uint8_t* out = dst + y * dstPitch;
+    size_t done = 0;
+#ifdef VRMAGIC_X86
+    if (ssse3) done = horizontalMeansSsse3(&rowSums[0], blocks, channels, factor, shift, shuffles, out);
+#endif
+    switch (channels) {
+      case 1:
+        horizontalMeansScalar<1>(&rowSums[0], done, blocks, factor, out);
+        break;
+      case 3:
+        horizontalMeansScalar<3>(&rowSums[0], done, blocks, factor, out);
+        break;
+      default:
+        horizontalMeansScalar<4>(&rowSums[0], done, blocks, factor, out);
+        break;
+    }
+  }
+}
+}
@@ -0,0 +1,95 @@
+#include "frame_pipeline.hpp"
+
+#include <chrono>
+
+#include <ros/ros.h>
+#include <ros/console.h>
+
+namespace vrmagic {
+
+// In ms. Poll interval of an inactive lock stage.
+static const int IDLE_SLEEP = 20;
+
+PortPipeline::PortPipeline(CameraHandle* cam_, size_t index_, size_t depth)
+    : cam(cam_),
+      index(index_),
+      timeout(cam_->getConfig().timeout),
+      rawFrames(depth),
+      frames(depth),
+      messages(2 * depth),
+      freeRaw(depth),
+      lockedRaw(depth),
+      freeFrames(depth),
+      convertedFrames(depth),
+      active(true),
+      stopping(false) {
+  for (size_t i = 0; i < depth; ++i) {
+    freeRaw.push(&rawFrames[i]);
+    freeFrames.push(&frames[i]);
+  }
+
+  lockThread = std::thread(&PortPipeline::lockLoop, this);
+  convertThread = std::thread(&PortPipeline::convertLoop, this);
+}
+
+PortPipeline::~PortPipeline() {
+  stopping = true;
+  lockThread.join();
+  convertThread.join();
+}
+
+Frame* PortPipeline::pop(int timeout) {
+  Frame* frame = 0;
+  if (!convertedFrames.popWait(frame, stopping, timeout)) return 0;
+  return frame;
+}
+
+void PortPipeline::release(Frame* frame) {
+  frame->image.reset();
+  freeFrames.push(frame);
+}
+
+void PortPipeline::setActive(bool active_) { active = active_; }
+
+PoolStats PortPipeline::getMessageStats() const { return messages.getStats(); }
+
+void PortPipeline::lockLoop() {
+  while (!stopping) {
+    if (!active) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(IDLE_SLEEP));
+      continue;
+    }
+
+    // Blocks while the convert stage is behind, the driver then drops frames for us
+    RawFrame* raw = 0;
+    if (!freeRaw.popWait(raw, stopping, timeout)) continue;
+
+    // Retry with the same frame, only the convert stage may push to freeRaw
+    while (!cam->grabRawFrame(index, *raw)) {
+      if (stopping) return;
+      // Stopped sensors time out, do not spam the log while waiting for them
+      if (!active) std::this_thread::sleep_for(std::chrono::milliseconds(IDLE_SLEEP));
+    }
+    lockedRaw.push(raw);
+  }
+}
+
+void PortPipeline::convertLoop() {
+  while (!stopping) {
+    RawFrame* raw = 0;
+    if (!lockedRaw.popWait(raw, stopping, timeout)) continue;
+
+    Frame* frame = 0;
+    while (!freeFrames.popWait(frame, stopping, timeout)) {
+      if (stopping) return;
+      ROS_WARN_THROTTLE(5, "%s: publisher is not keeping up", cam->getConfig().ports[index].name.c_str());
+    }
+
+    frame->image = messages.acquire();
+    cam->convertRawFrame(index, *raw, *frame->image);
+    frame->info = raw->info;
+    freeRaw.push(raw);
+    convertedFrames.push(frame);
+  }
+}
+}
@@ -0,0 +1,155 @@
+#include "image_copy.hpp"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define VRMAGIC_X86 1
+#include <immintrin.h>
+#endif
+
+namespace vrmagic {
+
+// Helper functions
+
+static void copyNaive(const uint8_t* src, size_t srcPitch, uint8_t* dst, size_t dstPitch, size_t rowBytes, size_t rows) {
+  for (size_t y = 0; y < rows; y++) {
+    for (size_t x = 0; x < rowBytes; x++) {
+      dst[y * dstPitch + x] = src[y * srcPitch + x];
+    }
+  }
+}
+
+static void copyMemcpy(const uint8_t* src, size_t srcPitch, uint8_t* dst, size_t dstPitch, size_t rowBytes, size_t rows) {
+  if (srcPitch == rowBytes && dstPitch == rowBytes) {
+    memcpy(dst, src, rowBytes * rows);
+    return;
+  }
+  for (size_t y = 0; y < rows; y++) {
+    memcpy(dst + y * dstPitch, src + y * srcPitch, rowBytes);
+  }
+}
+
+#ifdef VRMAGIC_X86
+
+__attribute__((target("sse2"))) static void copyRowSse2(const uint8_t* src, uint8_t* dst, size_t n) {
+  size_t x = 0;
+  for (; x + 64 <= n; x += 64) {
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x));
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x + 16));
+    __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x + 32));
+    __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x + 48));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), a);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x + 16), b);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x + 32), c);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x + 48), d);
+  }
+  for (; x + 16 <= n; x += 16) {
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x)));
+  }
+  if (x < n) memcpy(dst + x, src + x, n - x);
+}
+
+__attribute__((target("avx2"))) static void copyRowAvx2(const uint8_t* src, uint8_t* dst, size_t n) {
+  size_t x = 0;
+  for (; x + 128 <= n; x += 128) {
+    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + x));
+    __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + x + 32));
+    __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + x + 64));
+    __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + x + 96));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + x), a);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + x + 32), b);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + x + 64), c);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + x + 96), d);
+  }
+  for (; x + 32 <= n; x += 32) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + x),
+                        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + x)));
+  }
+  if (x < n) memcpy(dst + x, src + x, n - x);
+}
+
+#endif
+
+typedef void (*RowCopy)(const uint8_t*, uint8_t*, size_t);
+
+static void copyRows(RowCopy copyRow,
+                     const uint8_t* src,
+                     size_t srcPitch,
+                     uint8_t* dst,
+                     size_t dstPitch,
+                     size_t rowBytes,
+                     size_t rows) {
+  if (srcPitch == rowBytes && dstPitch == rowBytes) {
+    copyRow(src, dst, rowBytes * rows);
+    return;
+  }
+  for (size_t y = 0; y < rows; y++) {
+    copyRow(src + y * srcPitch, dst + y * dstPitch, rowBytes);
+  }
+}
+
+static CopyMethod resolve(CopyMethod method) {
+  if (method != COPY_AUTO && copyMethodSupported(method)) return method;
+  // glibc's memcpy already dispatches to the widest vector unit the CPU has, and in
+  // copy_benchmark it is as fast or faster than the hand-written loops.
+  return COPY_MEMCPY;
+}
+
+const char* copyMethodName(CopyMethod method) {
+  switch (method) {
+    case COPY_AUTO:
+      return "auto";
+    case COPY_NAIVE:
+      return "naive";
+    case COPY_MEMCPY:
+      return "memcpy";
+    case COPY_SSE2:
+      return "sse2";
+    case COPY_AVX2:
+      return "avx2";
+  }
+  return "unknown";
+}
+
+bool copyMethodSupported(CopyMethod method) {
+  switch (method) {
+#ifdef VRMAGIC_X86
+    case COPY_SSE2:
+      return __builtin_cpu_supports("sse2");
+    case COPY_AVX2:
+      return __builtin_cpu_supports("avx2");
+#else
+    case COPY_SSE2:
+    case COPY_AVX2:
+      return false;
+#endif
+    default:
+      return true;
+  }
+}
+
+void copyImage(const uint8_t* src,
+               size_t srcPitch,
+               uint8_t* dst,
+               size_t dstPitch,
+               size_t rowBytes,
+               size_t rows,
+               CopyMethod method) {
+  switch (resolve(method)) {
+    case COPY_NAIVE:
+      copyNaive(src, srcPitch, dst, dstPitch, rowBytes, rows);
+      break;
+#ifdef VRMAGIC_X86
+    case COPY_SSE2:
+      copyRows(copyRowSse2, src, srcPitch, dst, dstPitch, rowBytes, rows);
+      break;
+    case COPY_AVX2:
+      copyRows(copyRowAvx2, src, srcPitch, dst, dstPitch, rowBytes, rows);
+      break;
+#endif
+    default:
+      copyMemcpy(src, srcPitch, dst, dstPitch, rowBytes, rows);
+      break;
+  }
+}
+}
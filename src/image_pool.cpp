@@ -0,0 +1,62 @@
+#include "image_pool.hpp"
+
+namespace vrmagic {
+
+ImagePool::ImagePool(DeviceBackend* backend_) : backend(backend_), capacity(0) {}
+
+ImagePool::~ImagePool() { clear(); }
+
+void ImagePool::clear() {
+  for (size_t i = 0; i < images.size(); ++i) backend->freeImage(&images[i]);
+  images.clear();
+}
+
+void ImagePool::reset(const VRmImageFormat& format_, size_t capacity_) {
+  std::lock_guard<std::mutex> lock(mutex);
+  clear();
+
+  format = format_;
+  capacity = capacity_;
+
+  images.reserve(capacity);
+  for (size_t i = 0; i < capacity; ++i) {
+    VRmImage* image = 0;
+    if (backend->newImage(&image, format)) images.push_back(image);
+  }
+
+  imageStats = PoolStats();
+}
+
+VRmImage* ImagePool::acquireImage() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!images.empty()) {
+      VRmImage* image = images.back();
+      images.pop_back();
+      ++imageStats.hits;
+      return image;
+    }
+    ++imageStats.misses;
+  }
+
+  VRmImage* image = 0;
+  if (!backend->newImage(&image, format)) return 0;
+  return image;
+}
+
+void ImagePool::releaseImage(VRmImage* image) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (images.size() < capacity) {
+      images.push_back(image);
+      return;
+    }
+  }
+  backend->freeImage(&image);
+}
+
+PoolStats ImagePool::getImageStats() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return imageStats;
+}
+}
@@ -2,27 +2,20 @@
 
 #include <signal.h>
 
+#include <cstdlib>
 #include <string>
+#include <vector>
 
 #include <ros/ros.h>
 
-#include "vrmagic_node.hpp"
 #include "camera_handle.hpp"
-
-using std::string;
+#include "config_loader.hpp"
+#include "device_runner.hpp"
 
 using namespace vrmagic;
 
-static const string ENABLE_LOGGING = "enable_logging";
-
-static const string LEFT = "left/";
-static const string RIGHT = "right/";
-
-static const string LEFT_PORT = LEFT + "port";
-static const string RIGHT_PORT = RIGHT + "port";
-
-static const int LEFT_PORT_DEFAULT = 1;
-static const int RIGHT_PORT_DEFAULT = 3;
+// In s
+static const double SHUTDOWN_POLL = 0.1;
 
 static sig_atomic_t volatile g_request_shutdown = 0;
 
@@ -38,28 +31,33 @@ int main(int argc, char* argv[]) {
 
   ros::NodeHandle nh("vrmagic");
 
-  vrmagic::Config config;
-
-  nh.param<bool>(ENABLE_LOGGING, config.enableLogging, false);
-
-  // Set ports
-  nh.param<int>(LEFT_PORT, config.portLeft, LEFT_PORT_DEFAULT);
-  nh.param<int>(RIGHT_PORT, config.portRight, RIGHT_PORT_DEFAULT);
-
-  CameraHandle* cam = new CameraHandle(config);
+  // Several devices are configured and published below their names, a single one directly
+  // below vrmagic
+  std::vector<std::string> names = loadDeviceNames(nh);
+  std::vector<ros::NodeHandle> handles;
+  if (names.empty()) handles.push_back(nh);
+  for (size_t i = 0; i < names.size(); ++i) handles.push_back(ros::NodeHandle(nh, names[i]));
+
+  std::vector<vrmagic::Config> configs(handles.size());
+  for (size_t i = 0; i < names.size(); ++i) configs[i].cameraName = "vrmagic_" + names[i];
+  for (size_t i = 0; i < handles.size(); ++i) {
+    if (!loadConfig(handles[i], configs[i])) return EXIT_FAILURE;
+  }
 
-  VrMagicNode node(nh, cam);
+  // Every device grabs on its own thread, this one only waits for the shutdown
+  std::vector<DeviceRunner*> runners;
+  for (size_t i = 0; i < handles.size(); ++i) runners.push_back(new DeviceRunner(handles[i], configs[i]));
 
   while (!g_request_shutdown) {
-    node.spin();
     ros::spinOnce();
+    ros::WallDuration(SHUTDOWN_POLL).sleep();
   }
 
   ROS_INFO("After shutdown");
 
-  vrmagic::cameraShutdown();
+  for (size_t i = 0; i < runners.size(); ++i) delete runners[i];
 
-  delete cam;
+  vrmagic::cameraShutdown();
 
   ros::shutdown();
 }
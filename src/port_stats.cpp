@@ -0,0 +1,40 @@
+#include "port_stats.hpp"
+
+#include <algorithm>
+
+namespace vrmagic {
+
+void PortStatsCollector::addFrame(unsigned long framesDropped, double lockWait) {
+  std::lock_guard<std::mutex> lock(mutex);
+  ++stats.frames;
+  stats.framesDropped += framesDropped;
+  stats.lockWaitTotal += lockWait;
+  stats.lockWaitMax = std::max(stats.lockWaitMax, lockWait);
+}
+
+void PortStatsCollector::addLockTimeout(double lockWait) {
+  std::lock_guard<std::mutex> lock(mutex);
+  ++stats.lockTimeouts;
+  stats.lockWaitMax = std::max(stats.lockWaitMax, lockWait);
+}
+
+void PortStatsCollector::addSkipped() {
+  std::lock_guard<std::mutex> lock(mutex);
+  ++stats.framesSkipped;
+}
+
+void PortStatsCollector::addConversion(double duration) {
+  std::lock_guard<std::mutex> lock(mutex);
+  ++stats.conversions;
+  stats.conversionTotal += duration;
+  stats.conversionMax = std::max(stats.conversionMax, duration);
+}
+
+PortStats PortStatsCollector::take() {
+  std::lock_guard<std::mutex> lock(mutex);
+  PortStats result = stats;
+  stats.lockWaitMax = 0;
+  stats.conversionMax = 0;
+  return result;
+}
+}
@@ -0,0 +1,46 @@
+#include "port_worker.hpp"
+
+namespace vrmagic {
+
+PortWorker::PortWorker() : busy(false), stopping(false) { thread = std::thread(&PortWorker::run, this); }
+
+PortWorker::~PortWorker() {
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [this] { return !busy; });
+    stopping = true;
+  }
+  cond.notify_all();
+  thread.join();
+}
+
+void PortWorker::post(const std::function<void()>& job_) {
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [this] { return !busy; });
+    job = job_;
+    busy = true;
+  }
+  cond.notify_all();
+}
+
+void PortWorker::wait() {
+  std::unique_lock<std::mutex> lock(mutex);
+  cond.wait(lock, [this] { return !busy; });
+}
+
+void PortWorker::run() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    cond.wait(lock, [this] { return busy || stopping; });
+    if (stopping) return;
+
+    lock.unlock();
+    job();
+    lock.lock();
+
+    busy = false;
+    cond.notify_all();
+  }
+}
+}
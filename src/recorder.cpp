@@ -0,0 +1,374 @@
+#include "recorder.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <new>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image_copy.hpp"
+
+namespace vrmagic {
+
+static const char RECORDING_MAGIC[8] = "VRMREC";
+// Bump whenever the layout of the index or the segments changes
+static const uint32_t RECORDING_VERSION = 1;
+// Frames start on cache lines in the segments
+static const size_t FRAME_ALIGNMENT = 64;
+static const size_t INDEX_HEADER_BYTES = 64;
+// Entries the index grows by at a time, about 20 min of a stereo pair at 60 Hz
+static const size_t INDEX_CHUNK = 1 << 17;
+
+// Start of the index file, followed by the entries
+struct IndexHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t entryBytes;
+  // Frames whose entries are complete, set after writing them
+  std::atomic<uint64_t> frames;
+};
+
+// Helper functions
+
+static size_t alignFrame(size_t offset) { return (offset + FRAME_ALIGNMENT - 1) / FRAME_ALIGNMENT * FRAME_ALIGNMENT; }
+
+static IndexHeader* indexHeader(uint8_t* index) { return reinterpret_cast<IndexHeader*>(index); }
+
+static std::string systemError(const std::string& what, const std::string& path, int err = errno) {
+  return what + " " + path + ": " + strerror(err);
+}
+
+// Like mkdir -p
+static bool makeDirectories(const std::string& path) {
+  for (size_t end = 1; end <= path.size(); ++end) {
+    if (end < path.size() && path[end] != '/') continue;
+    if (mkdir(path.substr(0, end).c_str(), 0755) != 0 && errno != EEXIST) return false;
+  }
+  return true;
+}
+
+// Maps a whole file for reading, returns 0 on errors.
+static uint8_t* mapFile(const std::string& path, size_t* size) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return 0;
+
+  struct stat st;
+  void* mem = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) mem = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) return 0;
+
+  *size = st.st_size;
+  return static_cast<uint8_t*>(mem);
+}
+
+std::string recordingSegmentPath(const std::string& directory, uint32_t segment) {
+  char name[32];
+  snprintf(name, sizeof(name), "/segment_%04u", segment);
+  return directory + name;
+}
+
+std::string recordingIndexPath(const std::string& directory) { return directory + "/index"; }
+
+// Member functions
+
+Recorder::Recorder(const RecorderConfig& conf_)
+    : conf(conf_),
+      stopping(false),
+      error(false),
+      segmentFd(-1),
+      segment(0),
+      segmentNumber(0),
+      segmentUsed(0),
+      indexFd(-1),
+      index(0),
+      indexCapacity(0),
+      frames(0) {}
+
+Recorder::~Recorder() {
+  stop();
+  for (size_t i = 0; i < buffers.size(); ++i) delete buffers[i];
+}
+
+bool Recorder::start(const std::string& directory_) {
+  directory = directory_;
+  if (!makeDirectories(directory)) return fail(systemError("Cannot create", directory));
+
+  const std::string indexPath = recordingIndexPath(directory);
+  indexFd = open(indexPath.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+  if (indexFd < 0) return fail(systemError("Cannot create", indexPath));
+  if (!growIndex()) return false;
+
+  IndexHeader* header = new (index) IndexHeader();
+  memcpy(header->magic, RECORDING_MAGIC, sizeof(header->magic));
+  header->version = RECORDING_VERSION;
+  header->entryBytes = sizeof(RecordedFrame);
+
+  // Opened here rather than with the first frame, so that a full disk shows right away
+  if (!openSegment()) return false;
+
+  for (int i = 0; i < conf.bufferFrames; ++i) buffers.push_back(new Buffer());
+  freeBuffers = buffers;
+  thread = std::thread(&Recorder::run, this);
+  return true;
+}
+
+void Recorder::stop() {
+  if (thread.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    cond.notify_all();
+    thread.join();
+  }
+
+  closeSegment();
+  closeIndex();
+}
+
+bool Recorder::record(const RecordedFrame& info, const uint8_t* pixels, size_t pitch) {
+  Buffer* buffer = 0;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (error || stopping) return false;
+    if (freeBuffers.empty()) {
+      ++notRecorded[info.port];
+      ++stats.framesNotRecorded;
+      return false;
+    }
+    buffer = freeBuffers.back();
+    freeBuffers.pop_back();
+    buffer->info = info;
+    buffer->info.framesNotRecorded = notRecorded[info.port];
+    notRecorded[info.port] = 0;
+  }
+
+  // The only copy on the acquisition thread, buffers keep their capacity between frames
+  RecordedFrame& entry = buffer->info;
+  entry.bytes = entry.pitch * entry.height;
+  buffer->data.resize(entry.bytes);
+  copyImage(pixels, pitch, &buffer->data[0], entry.pitch, entry.pitch, entry.height);
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    queue.push_back(buffer);
+  }
+  cond.notify_all();
+  return true;
+}
+
+RecorderStats Recorder::getStats() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return stats;
+}
+
+bool Recorder::failed() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return error;
+}
+
+std::string Recorder::getLastError() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return lastError;
+}
+
+void Recorder::run() {
+  std::unique_lock<std::mutex> lock(mutex);
+  for (;;) {
+    cond.wait(lock, [this] { return stopping || !queue.empty(); });
+    // Frames still queued are written before stopping
+    if (queue.empty()) return;
+
+    Buffer* buffer = queue.front();
+    queue.pop_front();
+    const bool skip = error;
+    lock.unlock();
+
+    const bool written = !skip && write(*buffer);
+
+    lock.lock();
+    if (written) {
+      ++stats.framesRecorded;
+      stats.bytesRecorded += buffer->info.bytes;
+    }
+    freeBuffers.push_back(buffer);
+  }
+}
+
+bool Recorder::write(Buffer& buffer) {
+  RecordedFrame& info = buffer.info;
+  const size_t segmentBytes = static_cast<size_t>(conf.segmentSize) << 20;
+  size_t offset = alignFrame(segmentUsed);
+  if (offset + info.bytes > segmentBytes) {
+    if (segmentUsed == 0) return fail("A frame does not fit into a segment, increase the segment size");
+    closeSegment();
+    ++segmentNumber;
+    if (!openSegment()) return false;
+    offset = 0;
+  }
+  if (frames == indexCapacity && !growIndex()) return false;
+
+  memcpy(segment + offset, &buffer.data[0], info.bytes);
+  segmentUsed = offset + info.bytes;
+
+  info.segment = segmentNumber;
+  info.offset = offset;
+  memcpy(index + INDEX_HEADER_BYTES + frames * sizeof(RecordedFrame), &info, sizeof(RecordedFrame));
+  ++frames;
+  indexHeader(index)->frames.store(frames, std::memory_order_release);
+  return true;
+}
+
+bool Recorder::openSegment() {
+  const std::string path = recordingSegmentPath(directory, segmentNumber);
+  const size_t segmentBytes = static_cast<size_t>(conf.segmentSize) << 20;
+  segmentFd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+  if (segmentFd < 0) return fail(systemError("Cannot create", path));
+
+  // Allocate the blocks up front. Writing to a mapping of a sparse file on a full disk
+  // would kill the process with SIGBUS instead of failing.
+  const int err = posix_fallocate(segmentFd, 0, segmentBytes);
+  if (err != 0) return fail(systemError("Cannot allocate", path, err));
+
+  void* mem = mmap(0, segmentBytes, PROT_READ | PROT_WRITE, MAP_SHARED, segmentFd, 0);
+  if (mem == MAP_FAILED) return fail(systemError("Cannot map", path));
+  segment = static_cast<uint8_t*>(mem);
+  segmentUsed = 0;
+  return true;
+}
+
+void Recorder::closeSegment() {
+  if (segment) munmap(segment, static_cast<size_t>(conf.segmentSize) << 20);
+  segment = 0;
+  if (segmentFd < 0) return;
+
+  // Give back what the segment did not use
+  if (ftruncate(segmentFd, segmentUsed) != 0) {
+    fail(systemError("Cannot truncate", recordingSegmentPath(directory, segmentNumber)));
+  }
+  close(segmentFd);
+  segmentFd = -1;
+}
+
+bool Recorder::growIndex() {
+  const std::string path = recordingIndexPath(directory);
+  const size_t capacity = indexCapacity + INDEX_CHUNK;
+  const size_t bytes = INDEX_HEADER_BYTES + capacity * sizeof(RecordedFrame);
+  const int err = posix_fallocate(indexFd, 0, bytes);
+  if (err != 0) return fail(systemError("Cannot allocate", path, err));
+
+  void* mem = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, indexFd, 0);
+  if (mem == MAP_FAILED) return fail(systemError("Cannot map", path));
+  if (index) munmap(index, INDEX_HEADER_BYTES + indexCapacity * sizeof(RecordedFrame));
+  index = static_cast<uint8_t*>(mem);
+  indexCapacity = capacity;
+  return true;
+}
+
+void Recorder::closeIndex() {
+  if (index) munmap(index, INDEX_HEADER_BYTES + indexCapacity * sizeof(RecordedFrame));
+  index = 0;
+  if (indexFd < 0) return;
+
+  if (ftruncate(indexFd, INDEX_HEADER_BYTES + frames * sizeof(RecordedFrame)) != 0) {
+    fail(systemError("Cannot truncate", recordingIndexPath(directory)));
+  }
+  close(indexFd);
+  indexFd = -1;
+}
+
+bool Recorder::fail(const std::string& message) {
+  std::lock_guard<std::mutex> lock(mutex);
+  // The first error is the interesting one
+  if (!error) lastError = message;
+  error = true;
+  return false;
+}
+
+RecordingReader::RecordingReader() : frames(0) {
+  index.data = 0;
+  index.size = 0;
+}
+
+RecordingReader::~RecordingReader() { close(); }
+
+bool RecordingReader::open(const std::string& directory_) {
+  close();
+  directory = directory_;
+  return refresh();
+}
+
+void RecordingReader::close() {
+  if (index.data) munmap(index.data, index.size);
+  index.data = 0;
+  index.size = 0;
+  for (size_t i = 0; i < segments.size(); ++i) {
+    if (segments[i].data) munmap(segments[i].data, segments[i].size);
+  }
+  segments.clear();
+  frames = 0;
+}
+
+bool RecordingReader::refresh() {
+  // The writer grows the index, map it again as it is now
+  if (index.data) munmap(index.data, index.size);
+  const std::string path = recordingIndexPath(directory);
+  index.data = mapFile(path, &index.size);
+  frames = 0;
+  if (!index.data) return setError(systemError("Cannot map", path));
+
+  const IndexHeader* header = indexHeader(index.data);
+  if (index.size < INDEX_HEADER_BYTES || memcmp(header->magic, RECORDING_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != RECORDING_VERSION || header->entryBytes != sizeof(RecordedFrame)) {
+    return setError(path + " is not a recording of this version");
+  }
+
+  frames = std::min<uint64_t>(header->frames.load(std::memory_order_acquire),
+                              (index.size - INDEX_HEADER_BYTES) / sizeof(RecordedFrame));
+  return true;
+}
+
+uint64_t RecordingReader::getFrameCount() const { return frames; }
+
+bool RecordingReader::getFrame(uint64_t n, RecordedFrame& info, const uint8_t** pixels) {
+  if (n >= frames) return setError("No such frame");
+
+  memcpy(&info, index.data + INDEX_HEADER_BYTES + n * sizeof(RecordedFrame), sizeof(RecordedFrame));
+  if (!mapSegment(info.segment)) return false;
+
+  const Mapping& mapping = segments[info.segment];
+  if (info.offset + info.bytes > mapping.size) return setError("The frame ends after its segment");
+  *pixels = mapping.data + info.offset;
+  return true;
+}
+
+const char* RecordingReader::getLastError() const { return lastError.c_str(); }
+
+bool RecordingReader::mapSegment(uint32_t number) {
+  if (number < segments.size() && segments[number].data) return true;
+
+  // Segments are allocated in full before any frame in them is indexed, so the first
+  // mapping of a segment covers all of its frames
+  if (number >= segments.size()) {
+    Mapping none = {0, 0};
+    segments.resize(number + 1, none);
+  }
+  const std::string path = recordingSegmentPath(directory, number);
+  Mapping& mapping = segments[number];
+  mapping.data = mapFile(path, &mapping.size);
+  if (!mapping.data) return setError(systemError("Cannot map", path));
+  return true;
+}
+
+bool RecordingReader::setError(const std::string& message) {
+  lastError = message;
+  return false;
+}
+}
@@ -0,0 +1,188 @@
+#include "rectifier.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include <ros/ros.h>
+#include <sensor_msgs/image_encodings.h>
+
+namespace enc = sensor_msgs::image_encodings;
+
+namespace vrmagic {
+
+// Helper functions
+
+static bool invert3x3(const double m[9], double inv[9]) {
+  const double det = m[0] * (m[4] * m[8] - m[5] * m[7]) - m[1] * (m[3] * m[8] - m[5] * m[6]) +
+                     m[2] * (m[3] * m[7] - m[4] * m[6]);
+  if (std::fabs(det) < 1e-12) return false;
+
+  inv[0] = (m[4] * m[8] - m[5] * m[7]) / det;
+  inv[1] = (m[2] * m[7] - m[1] * m[8]) / det;
+  inv[2] = (m[1] * m[5] - m[2] * m[4]) / det;
+  inv[3] = (m[5] * m[6] - m[3] * m[8]) / det;
+  inv[4] = (m[0] * m[8] - m[2] * m[6]) / det;
+  inv[5] = (m[2] * m[3] - m[0] * m[5]) / det;
+  inv[6] = (m[3] * m[7] - m[4] * m[6]) / det;
+  inv[7] = (m[1] * m[6] - m[0] * m[7]) / det;
+  inv[8] = (m[0] * m[4] - m[1] * m[3]) / det;
+  return true;
+}
+
+// Calibration of the images a sensor window delivers, from that of the whole sensor, as
+// image_geometry adjusts it for binning and region of interest.
+static sensor_msgs::CameraInfo windowCalibration(const sensor_msgs::CameraInfo& info) {
+  const unsigned bx = std::max(1u, info.binning_x);
+  const unsigned by = std::max(1u, info.binning_y);
+  const bool roi = info.roi.width > 0 && info.roi.height > 0;
+  if (bx == 1 && by == 1 && !roi) return info;
+
+  const double x0 = roi ? info.roi.x_offset : 0;
+  const double y0 = roi ? info.roi.y_offset : 0;
+  sensor_msgs::CameraInfo window = info;
+  window.width = (roi ? info.roi.width : info.width) / bx;
+  window.height = (roi ? info.roi.height : info.height) / by;
+  window.K[0] = info.K[0] / bx;
+  window.K[1] = info.K[1] / bx;
+  window.K[2] = (info.K[2] - x0) / bx;
+  window.K[4] = info.K[4] / by;
+  window.K[5] = (info.K[5] - y0) / by;
+  window.P[0] = info.P[0] / bx;
+  window.P[1] = info.P[1] / bx;
+  window.P[2] = (info.P[2] - x0) / bx;
+  window.P[3] = info.P[3] / bx;
+  window.P[5] = info.P[5] / by;
+  window.P[6] = (info.P[6] - y0) / by;
+  window.P[7] = info.P[7] / by;
+  window.binning_x = window.binning_y = 0;
+  window.roi = sensor_msgs::RegionOfInterest();
+  return window;
+}
+
+// Source position of every pixel of the rectified image, as cv::initUndistortRectifyMap
+// computes it: back through the projection and rectification into a ray, then forward
+// through the distortion and the camera matrix.
+static bool rectificationMap(const sensor_msgs::CameraInfo& info, std::vector<float>& mapX, std::vector<float>& mapY) {
+  const bool rational = info.distortion_model == "rational_polynomial";
+  if (!rational && info.distortion_model != "plumb_bob") {
+    ROS_ERROR("Cannot rectify, unsupported distortion model %s", info.distortion_model.c_str());
+    return false;
+  }
+
+  double d[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+  for (size_t i = 0; i < info.D.size() && i < (rational ? 8u : 5u); ++i) d[i] = info.D[i];
+  const double k1 = d[0], k2 = d[1], p1 = d[2], p2 = d[3], k3 = d[4], k4 = d[5], k5 = d[6], k6 = d[7];
+
+  // An unset R is the identity, an unset P the camera matrix
+  double r[9] = {1, 0, 0, 0, 1, 0, 0, 0, 1};
+  if (info.R[0] != 0 || info.R[4] != 0 || info.R[8] != 0) {
+    for (int i = 0; i < 9; ++i) r[i] = info.R[i];
+  }
+  double p[9];
+  for (int row = 0; row < 3; ++row) {
+    for (int col = 0; col < 3; ++col) p[row * 3 + col] = info.P[0] != 0 ? info.P[row * 4 + col] : info.K[row * 3 + col];
+  }
+
+  double pr[9];
+  for (int row = 0; row < 3; ++row) {
+    for (int col = 0; col < 3; ++col) {
+      pr[row * 3 + col] = p[row * 3] * r[col] + p[row * 3 + 1] * r[3 + col] + p[row * 3 + 2] * r[6 + col];
+    }
+  }
+  double ipr[9];
+  if (!invert3x3(pr, ipr)) {
+    ROS_ERROR("Cannot rectify, the projection and rectification matrices are singular");
+    return false;
+  }
+
+  const double* k = info.K.data();
+  const size_t width = info.width;
+  const size_t height = info.height;
+  mapX.resize(width * height);
+  mapY.resize(width * height);
+  for (size_t v = 0; v < height; ++v) {
+    for (size_t u = 0; u < width; ++u) {
+      const double rx = ipr[0] * u + ipr[1] * v + ipr[2];
+      const double ry = ipr[3] * u + ipr[4] * v + ipr[5];
+      const double rw = ipr[6] * u + ipr[7] * v + ipr[8];
+      const double x = rx / rw;
+      const double y = ry / rw;
+
+      const double x2 = x * x;
+      const double y2 = y * y;
+      const double r2 = x2 + y2;
+      const double xy = 2 * x * y;
+      const double radial =
+          (1 + ((k3 * r2 + k2) * r2 + k1) * r2) / (1 + ((k6 * r2 + k5) * r2 + k4) * r2);
+      const double xd = x * radial + p1 * xy + p2 * (r2 + 2 * x2);
+      const double yd = y * radial + p1 * (r2 + 2 * y2) + p2 * xy;
+
+      mapX[v * width + u] = k[0] * xd + k[1] * yd + k[2];
+      mapY[v * width + u] = k[4] * yd + k[5];
+    }
+  }
+  return true;
+}
+
+// Member functions
+
+Rectifier::Rectifier() : tableValid(false), failed(false) {}
+
+void Rectifier::setCameraInfo(const sensor_msgs::CameraInfo& info) {
+  cameraInfo = windowCalibration(info);
+  tableValid = false;
+  failed = false;
+}
+
+bool Rectifier::rectify(const sensor_msgs::Image& src, sensor_msgs::Image& dst) {
+  if (failed) return false;
+
+  const bool fits = tableValid && table.width == src.width && table.height == src.height && table.step == src.step &&
+                    table.channels == static_cast<size_t>(enc::numChannels(src.encoding));
+  if (!fits && !buildTable(src)) {
+    failed = true;
+    return false;
+  }
+
+  dst.header = src.header;
+  dst.encoding = src.encoding;
+  dst.width = src.width;
+  dst.height = src.height;
+  dst.step = src.step;
+  dst.is_bigendian = src.is_bigendian;
+  dst.data.resize(src.data.size());
+  remap(&src.data[0], &dst.data[0], table);
+  return true;
+}
+
+bool Rectifier::buildTable(const sensor_msgs::Image& img) {
+  tableValid = false;
+
+  if (cameraInfo.K[0] == 0) {
+    ROS_ERROR("Cannot rectify, the camera is not calibrated");
+    return false;
+  }
+  if (cameraInfo.width != img.width || cameraInfo.height != img.height) {
+    ROS_ERROR("Cannot rectify, the calibration is for %ux%u images but the camera delivers %ux%u",
+              cameraInfo.width,
+              cameraInfo.height,
+              img.width,
+              img.height);
+    return false;
+  }
+  if (enc::isBayer(img.encoding) || enc::bitDepth(img.encoding) != 8 || enc::numChannels(img.encoding) > 4 ||
+      img.width < 2 || img.height < 2) {
+    ROS_ERROR("Cannot rectify %s images", img.encoding.c_str());
+    return false;
+  }
+
+  std::vector<float> mapX, mapY;
+  if (!rectificationMap(cameraInfo, mapX, mapY)) return false;
+
+  buildRemapTable(&mapX[0], &mapY[0], img.width, img.height, img.step, enc::numChannels(img.encoding), table);
+  tableValid = true;
+  ROS_INFO("Built the rectification table for %ux%u %s images", img.width, img.height, img.encoding.c_str());
+  return true;
+}
+}
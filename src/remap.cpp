@@ -0,0 +1,275 @@
+#include "remap.hpp"
+
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define VRMAGIC_X86 1
+#include <immintrin.h>
+#endif
+
+namespace vrmagic {
+
+// Every channel is interpolated with integer weights that add up to REMAP_SCALE^2:
+//   out = (p00 * w00 + p01 * w01 + p10 * w10 + p11 * w11 + REMAP_SCALE^2 / 2) >> 2 * REMAP_BITS
+// with w00 = (REMAP_SCALE - fx) * (REMAP_SCALE - fy), w01 = fx * (REMAP_SCALE - fy), ...
+// and fx, fy in [0, REMAP_SCALE]. The weights fit into 16 bits and the sums into 32.
+
+// Helper functions
+
+// Fixed point position of a coordinate in [0, size - 1]. The last pixel is reached as the
+// right (or lower) neighbour with full weight, so all 2x2 pixels are inside the image.
+static void fixedPoint(float coord, size_t size, int32_t* pixel, uint16_t* fraction) {
+  const long scaled = std::lround(coord * REMAP_SCALE);
+  *pixel = scaled >> REMAP_BITS;
+  *fraction = scaled & (REMAP_SCALE - 1);
+  if (*pixel == static_cast<int32_t>(size) - 1) {
+    --*pixel;
+    *fraction = REMAP_SCALE;
+  }
+}
+
+static inline uint8_t interpolate(const uint8_t* top, const uint8_t* bottom, size_t channels, int fx, int fy) {
+  const int w00 = (REMAP_SCALE - fx) * (REMAP_SCALE - fy);
+  const int w01 = fx * (REMAP_SCALE - fy);
+  const int w10 = (REMAP_SCALE - fx) * fy;
+  const int w11 = fx * fy;
+  return (top[0] * w00 + top[channels] * w01 + bottom[0] * w10 + bottom[channels] * w11 +
+          (1 << (2 * REMAP_BITS - 1))) >>
+         2 * REMAP_BITS;
+}
+
+// Remaps pixels [x0, x1) of row y.
+static void remapRowScalar(const uint8_t* src, uint8_t* dst, const RemapTable& table, size_t y, size_t x0, size_t x1) {
+  const size_t channels = table.channels;
+  for (size_t x = x0; x < x1; ++x) {
+    const size_t i = y * table.width + x;
+    uint8_t* out = dst + y * table.step + x * channels;
+    const int32_t offset = table.offsets[i];
+    if (offset < 0) {
+      for (size_t c = 0; c < channels; ++c) out[c] = 0;
+      continue;
+    }
+
+    const uint8_t* top = src + offset;
+    const int fx = table.fractions[i] & 0xff;
+    const int fy = table.fractions[i] >> 8;
+    for (size_t c = 0; c < channels; ++c) out[c] = interpolate(top + c, top + table.step + c, channels, fx, fy);
+  }
+}
+
+#ifdef VRMAGIC_X86
+
+// The AVX2 kernel gathers the channels of each of the 2x2 pixels as one 32 bit word per
+// pixel and interpolates 8 pixels at a time.
+
+// Weights of the two pixels of a row, the left one in the low 16 bits.
+__attribute__((target("avx2"))) static inline __m256i weightPairs(__m256i left, __m256i right) {
+  return _mm256_or_si256(left, _mm256_slli_epi32(right, 16));
+}
+
+// Channels of the left and right pixel of the row at byte offsets `offsets`.
+__attribute__((target("avx2"))) static inline void gatherRow(const uint8_t* row,
+                                                              __m256i offsets,
+                                                              size_t channels,
+                                                              __m256i channelMask,
+                                                              __m256i* left,
+                                                              __m256i* right) {
+  const int* base = reinterpret_cast<const int*>(row);
+  const __m256i words = _mm256_i32gather_epi32(base, offsets, 1);
+  *left = _mm256_and_si256(words, channelMask);
+  if (channels == 1) {
+    *right = _mm256_and_si256(_mm256_srli_epi32(words, 8), channelMask);
+  } else {
+    // Ends the word at the last byte of the right pixel, so no gather reads past it
+    const __m256i shifted = _mm256_add_epi32(offsets, _mm256_set1_epi32(2 * channels - 4));
+    *right = _mm256_srl_epi32(_mm256_i32gather_epi32(base, shifted, 1), _mm_cvtsi32_si128(8 * (4 - channels)));
+  }
+}
+
+// Interpolates the channels of one pixel per 128 bit lane, selected by `select`.
+#define REMAP_PIXEL_AVX2(lo, hi, select)                                                          \
+  _mm256_srli_epi32(                                                                             \
+      _mm256_add_epi32(                                                                          \
+          _mm256_add_epi32(                                                                      \
+              _mm256_madd_epi16(_mm256_unpack##lo##_epi16(top##hi, topRight##hi),                \
+                                _mm256_shuffle_epi32(weightsTop, select)),                       \
+              _mm256_madd_epi16(_mm256_unpack##lo##_epi16(bottom##hi, bottomRight##hi),          \
+                                _mm256_shuffle_epi32(weightsBottom, select))),                   \
+          round),                                                                                \
+      2 * REMAP_BITS)
+
+__attribute__((target("avx2"))) static void remapRowAvx2(const uint8_t* src,
+                                                          uint8_t* dst,
+                                                          const RemapTable& table,
+                                                          size_t y,
+                                                          size_t x0,
+                                                          size_t x1) {
+  const size_t channels = table.channels;
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i scale = _mm256_set1_epi32(REMAP_SCALE);
+  const __m256i round = _mm256_set1_epi32(1 << (2 * REMAP_BITS - 1));
+  const __m256i channelMask = _mm256_set1_epi32(channels == 4 ? -1 : (1 << (8 * channels)) - 1);
+  const __m256i rowStep = _mm256_set1_epi32(table.step);
+
+  // The last byte any gather of a pixel touches is at its offset + step + max(4, 2 * channels).
+  // Pixels of the last source cells would read past the image, those go to the scalar code.
+  const int32_t lastSafe = table.step * table.height - table.step - (channels == 1 ? 4 : 2 * channels);
+  const __m256i safeOffsets = _mm256_set1_epi32(lastSafe);
+
+  // Packs the channels of each pixel to the front of its 128 bit lane, then the lanes together
+  int8_t compact[16];
+  for (int i = 0; i < 16; ++i) compact[i] = -1;
+  for (size_t p = 0; p < 4; ++p) {
+    for (size_t c = 0; c < channels; ++c) compact[p * channels + c] = p * 4 + c;
+  }
+  const __m128i compact128 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(compact));
+  const __m256i compactLanes = _mm256_broadcastsi128_si256(compact128);
+  int32_t lanes[8] = {0, 1, 2, 3, 4, 5, 6, 7};
+  for (size_t l = 0; l < channels; ++l) lanes[channels + l] = 4 + l;
+  const __m256i joinLanes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(lanes));
+
+  for (size_t x = x0; x + 8 <= x1; x += 8) {
+    const size_t i = y * table.width + x;
+    uint8_t* out = dst + y * table.step + x * channels;
+
+    const __m256i offsets = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&table.offsets[i]));
+    if (_mm256_movemask_epi8(_mm256_cmpgt_epi32(offsets, safeOffsets))) {
+      remapRowScalar(src, dst, table, y, x, x + 8);
+      continue;
+    }
+    // Pixels outside the source sample pixel 0 and are blanked afterwards
+    const __m256i inside = _mm256_cmpgt_epi32(offsets, _mm256_set1_epi32(-1));
+    const __m256i topOffsets = _mm256_and_si256(offsets, inside);
+
+    const __m256i fractions =
+        _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&table.fractions[i])));
+    const __m256i fx = _mm256_and_si256(fractions, _mm256_set1_epi32(0xff));
+    const __m256i fy = _mm256_srli_epi32(fractions, 8);
+    const __m256i fxInv = _mm256_sub_epi32(scale, fx);
+    const __m256i fyInv = _mm256_sub_epi32(scale, fy);
+    const __m256i weightsTop =
+        weightPairs(_mm256_mullo_epi16(fxInv, fyInv), _mm256_mullo_epi16(fx, fyInv));
+    const __m256i weightsBottom = weightPairs(_mm256_mullo_epi16(fxInv, fy), _mm256_mullo_epi16(fx, fy));
+
+    __m256i top, topRight, bottom, bottomRight;
+    gatherRow(src, topOffsets, channels, channelMask, &top, &topRight);
+    gatherRow(src, _mm256_add_epi32(topOffsets, rowStep), channels, channelMask, &bottom, &bottomRight);
+
+    // Channels widened to 16 bits, pixels 0 and 1 of each lane in Lo, 2 and 3 in Hi
+    const __m256i topLo = _mm256_unpacklo_epi8(top, zero);
+    const __m256i topHi = _mm256_unpackhi_epi8(top, zero);
+    const __m256i topRightLo = _mm256_unpacklo_epi8(topRight, zero);
+    const __m256i topRightHi = _mm256_unpackhi_epi8(topRight, zero);
+    const __m256i bottomLo = _mm256_unpacklo_epi8(bottom, zero);
+    const __m256i bottomHi = _mm256_unpackhi_epi8(bottom, zero);
+    const __m256i bottomRightLo = _mm256_unpacklo_epi8(bottomRight, zero);
+    const __m256i bottomRightHi = _mm256_unpackhi_epi8(bottomRight, zero);
+
+    const __m256i pixel0 = REMAP_PIXEL_AVX2(lo, Lo, 0x00);
+    const __m256i pixel1 = REMAP_PIXEL_AVX2(hi, Lo, 0x55);
+    const __m256i pixel2 = REMAP_PIXEL_AVX2(lo, Hi, 0xaa);
+    const __m256i pixel3 = REMAP_PIXEL_AVX2(hi, Hi, 0xff);
+
+    __m256i pixels =
+        _mm256_packus_epi16(_mm256_packs_epi32(pixel0, pixel1), _mm256_packs_epi32(pixel2, pixel3));
+    pixels = _mm256_and_si256(pixels, inside);
+    pixels = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(pixels, compactLanes), joinLanes);
+
+    switch (channels) {
+      case 1:
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(out), _mm256_castsi256_si128(pixels));
+        break;
+      case 2:
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm256_castsi256_si128(pixels));
+        break;
+      case 3:
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm256_castsi256_si128(pixels));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(out + 16), _mm256_extracti128_si256(pixels, 1));
+        break;
+      default:
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), pixels);
+        break;
+    }
+  }
+}
+
+#undef REMAP_PIXEL_AVX2
+
+#endif
+
+// Member functions
+
+const char* remapMethodName(RemapMethod method) {
+  switch (method) {
+    case REMAP_AUTO:
+      return "auto";
+    case REMAP_SCALAR:
+      return "scalar";
+    case REMAP_AVX2:
+      return "avx2";
+  }
+  return "unknown";
+}
+
+bool remapMethodSupported(RemapMethod method) {
+  switch (method) {
+#ifdef VRMAGIC_X86
+    case REMAP_AVX2:
+      return __builtin_cpu_supports("avx2");
+#else
+    case REMAP_AVX2:
+      return false;
+#endif
+    default:
+      return true;
+  }
+}
+
+void buildRemapTable(const float* mapX,
+                     const float* mapY,
+                     size_t width,
+                     size_t height,
+                     size_t step,
+                     size_t channels,
+                     RemapTable& table) {
+  table.width = width;
+  table.height = height;
+  table.step = step;
+  table.channels = channels;
+  table.offsets.resize(width * height);
+  table.fractions.resize(width * height);
+
+  for (size_t i = 0; i < width * height; ++i) {
+    const float x = mapX[i];
+    const float y = mapY[i];
+    // Written so that NaN positions end up outside as well
+    if (!(x >= 0 && y >= 0 && x <= width - 1 && y <= height - 1)) {
+      table.offsets[i] = -1;
+      table.fractions[i] = 0;
+      continue;
+    }
+
+    int32_t px, py;
+    uint16_t fx, fy;
+    fixedPoint(x, width, &px, &fx);
+    fixedPoint(y, height, &py, &fy);
+    table.offsets[i] = py * step + px * channels;
+    table.fractions[i] = fx | fy << 8;
+  }
+}
+
+void remap(const uint8_t* src, uint8_t* dst, const RemapTable& table, RemapMethod method) {
+  if (method == REMAP_AUTO) method = remapMethodSupported(REMAP_AVX2) ? REMAP_AVX2 : REMAP_SCALAR;
+
+  for (size_t y = 0; y < table.height; ++y) {
+    size_t vectorEnd = 0;
+#ifdef VRMAGIC_X86
+    if (method == REMAP_AVX2) {
+      vectorEnd = table.width / 8 * 8;
+      remapRowAvx2(src, dst, table, y, 0, vectorEnd);
+    }
+#endif
+    remapRowScalar(src, dst, table, y, vectorEnd, table.width);
+  }
+}
+}
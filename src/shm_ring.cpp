@@ -0,0 +1,263 @@
+#include "shm_ring.hpp"
+
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace vrmagic {
+
+static const uint32_t SHM_MAGIC = 0x534d5256;
+// Bump whenever the layout below changes
+static const uint32_t SHM_VERSION = 1;
+// Slot headers and pixels start on cache lines
+static const size_t ALIGNMENT = 64;
+
+// Start of the segment, followed by the slots
+struct RingHeader {
+  // Set last, once the header is complete
+  std::atomic<uint32_t> magic;
+  uint32_t version;
+  uint32_t slots;
+  uint32_t reserved;
+  // Pixel bytes a slot holds, and the distance between slots
+  uint64_t slotBytes;
+  uint64_t slotStride;
+  // Frames written so far, frame n is complete once this exceeds n
+  std::atomic<uint64_t> written;
+  std::atomic<uint32_t> closed;
+};
+
+struct SlotHeader {
+  // 2n + 1 while frame n is written into the slot, 2n + 2 once it is complete
+  std::atomic<uint64_t> seqlock;
+  ShmFrameInfo info;
+};
+
+// Helper functions
+
+static size_t roundUp(size_t bytes) { return (bytes + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT; }
+
+static RingHeader* ringHeader(uint8_t* base) { return reinterpret_cast<RingHeader*>(base); }
+
+static SlotHeader* slotHeader(uint8_t* base, uint64_t frame) {
+  const RingHeader* header = ringHeader(base);
+  return reinterpret_cast<SlotHeader*>(base + roundUp(sizeof(RingHeader)) + frame % header->slots * header->slotStride);
+}
+
+static uint8_t* slotData(SlotHeader* slot) { return reinterpret_cast<uint8_t*>(slot) + roundUp(sizeof(SlotHeader)); }
+
+static std::string systemError(const std::string& what, const std::string& name) {
+  return what + " " + name + ": " + strerror(errno);
+}
+
+std::string shmSegmentName(const std::string& ns) {
+  std::string name = "/";
+  for (size_t i = ns[0] == '/' ? 1 : 0; i < ns.size(); ++i) name += ns[i] == '/' ? '.' : ns[i];
+  return name;
+}
+
+// Member functions
+
+ShmRingWriter::ShmRingWriter(const std::string& name_, size_t slots_)
+    : name(name_), slots(slots_), base(0), size(0) {}
+
+ShmRingWriter::~ShmRingWriter() {
+  if (!base) return;
+
+  // Readers that still have the segment mapped keep it alive, tell them to reopen
+  ringHeader(base)->closed.store(1, std::memory_order_release);
+  munmap(base, size);
+  shm_unlink(name.c_str());
+}
+
+bool ShmRingWriter::create(size_t slotBytes) {
+  if (slots < 2) return setError("A ring needs at least two slots");
+
+  // A segment left behind by a driver that crashed
+  shm_unlink(name.c_str());
+  // Readers map the segment read-only, so nobody else needs to write it
+  int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+  if (fd < 0) return setError(systemError("Cannot create", name));
+
+  const size_t stride = roundUp(sizeof(SlotHeader)) + roundUp(slotBytes);
+  const size_t bytes = roundUp(sizeof(RingHeader)) + slots * stride;
+  void* mem = MAP_FAILED;
+  if (ftruncate(fd, bytes) == 0) mem = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mem == MAP_FAILED) {
+    setError(systemError("Cannot map", name));
+    close(fd);
+    shm_unlink(name.c_str());
+    return false;
+  }
+  close(fd);
+
+  base = static_cast<uint8_t*>(mem);
+  size = bytes;
+  RingHeader* header = new (base) RingHeader();
+  header->version = SHM_VERSION;
+  header->slots = slots;
+  header->slotBytes = slotBytes;
+  header->slotStride = stride;
+  for (size_t i = 0; i < slots; ++i) new (slotHeader(base, i)) SlotHeader();
+  header->magic.store(SHM_MAGIC, std::memory_order_release);
+  return true;
+}
+
+bool ShmRingWriter::write(const ShmFrameInfo& info, const uint8_t* data) {
+  if (!base && !create(info.dataBytes)) return false;
+
+  RingHeader* header = ringHeader(base);
+  if (info.dataBytes > header->slotBytes) return setError("The frame is larger than the slots of " + name);
+
+  const uint64_t frame = header->written.load(std::memory_order_relaxed);
+  SlotHeader* slot = slotHeader(base, frame);
+  slot->seqlock.store(2 * frame + 1, std::memory_order_relaxed);
+  // Readers that see any of the new contents also see the odd sequence
+  std::atomic_thread_fence(std::memory_order_release);
+
+  slot->info = info;
+  slot->info.sequence = frame;
+  memcpy(slotData(slot), data, info.dataBytes);
+
+  slot->seqlock.store(2 * frame + 2, std::memory_order_release);
+  header->written.store(frame + 1, std::memory_order_release);
+  return true;
+}
+
+const char* ShmRingWriter::getLastError() const { return lastError.c_str(); }
+
+bool ShmRingWriter::setError(const std::string& message) {
+  lastError = message;
+  return false;
+}
+
+ShmRingReader::ShmRingReader() : base(0), size(0), next(0), missed(0) {}
+
+ShmRingReader::~ShmRingReader() { close(); }
+
+bool ShmRingReader::open(const std::string& name) {
+  close();
+
+  int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd < 0) return setError(systemError("Cannot open", name));
+
+  struct stat st;
+  void* mem = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= roundUp(sizeof(RingHeader))) {
+    mem = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  ::close(fd);
+  if (mem == MAP_FAILED) return setError(systemError("Cannot map", name));
+
+  base = static_cast<uint8_t*>(mem);
+  size = st.st_size;
+  const RingHeader* header = ringHeader(base);
+  if (header->magic.load(std::memory_order_acquire) != SHM_MAGIC || header->version != SHM_VERSION ||
+      header->slots < 2 || roundUp(sizeof(RingHeader)) + header->slots * header->slotStride > size) {
+    close();
+    return setError(name + " is not a frame ring of this version, or not initialized yet");
+  }
+
+  next = header->written.load(std::memory_order_acquire);
+  missed = 0;
+  return true;
+}
+
+void ShmRingReader::close() {
+  if (base) munmap(base, size);
+  base = 0;
+  size = 0;
+}
+
+bool ShmRingReader::isOpen() const { return base != 0; }
+
+bool ShmRingReader::writerClosed() const { return ringHeader(base)->closed.load(std::memory_order_acquire) != 0; }
+
+bool ShmRingReader::wait(int timeout) const {
+  const RingHeader* header = ringHeader(base);
+  const std::chrono::steady_clock::time_point deadline =
+      std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+  for (int spins = 0; header->written.load(std::memory_order_acquire) <= next; ++spins) {
+    if (header->closed.load(std::memory_order_relaxed) || std::chrono::steady_clock::now() > deadline) return false;
+    // Frames arrive every few ms, so yield briefly and then back off to sleeping
+    if (spins < 64) {
+      std::this_thread::yield();
+    } else {
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+  }
+  return true;
+}
+
+void ShmRingReader::seekLatest() {
+  const uint64_t written = ringHeader(base)->written.load(std::memory_order_acquire);
+  if (written > next + 1) next = written - 1;
+}
+
+const uint8_t* ShmRingReader::lockNext(ShmFrameInfo& info) {
+  const RingHeader* header = ringHeader(base);
+  for (;;) {
+    const uint64_t written = header->written.load(std::memory_order_acquire);
+    if (next >= written) return 0;
+
+    // The slot of the oldest frame may already be taken by the one written now
+    if (written - next >= header->slots) {
+      missed += written - header->slots + 1 - next;
+      next = written - header->slots + 1;
+    }
+
+    SlotHeader* slot = slotHeader(base, next);
+    const uint64_t complete = 2 * next + 2;
+    if (slot->seqlock.load(std::memory_order_acquire) == complete) {
+      info = slot->info;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot->seqlock.load(std::memory_order_relaxed) == complete) return slotData(slot);
+    }
+
+    // The writer came around the ring while we looked at the frame
+    ++missed;
+    ++next;
+  }
+}
+
+bool ShmRingReader::readNext(ShmFrameInfo& info, std::vector<uint8_t>& data) {
+  for (;;) {
+    const uint8_t* pixels = lockNext(info);
+    if (!pixels) return false;
+
+    data.resize(info.dataBytes);
+    if (info.dataBytes > 0) memcpy(&data[0], pixels, info.dataBytes);
+    ++next;
+    if (isValid(info)) return true;
+    ++missed;
+  }
+}
+
+const uint8_t* ShmRingReader::peekNext(ShmFrameInfo& info) {
+  const uint8_t* pixels = lockNext(info);
+  if (pixels) ++next;
+  return pixels;
+}
+
+bool ShmRingReader::isValid(const ShmFrameInfo& info) const {
+  // Orders the reads of the pixels before the check
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return slotHeader(base, info.sequence)->seqlock.load(std::memory_order_relaxed) == 2 * info.sequence + 2;
+}
+
+uint64_t ShmRingReader::getFramesMissed() const { return missed; }
+
+const char* ShmRingReader::getLastError() const { return lastError.c_str(); }
+
+bool ShmRingReader::setError(const std::string& message) {
+  lastError = message;
+  return false;
+}
+}
@@ -0,0 +1,644 @@
+#include "simulated_backend.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <thread>
+
+#include <ros/ros.h>
+#include <ros/console.h>
+
+namespace vrmagic {
+
+// Helper functions
+
+static thread_local std::string lastError;
+
+// mp_private of images wrapping a caller owned buffer points here, so freeImage() leaves
+// the buffer alone. Locked images point to their slot, images from newImage() to null.
+static char wrappedImageTag;
+
+static bool isBayer(VRmColorFormat format) {
+  return format == VRM_BAYER_GBRG_8 || format == VRM_BAYER_BGGR_8 || format == VRM_BAYER_RGGB_8 ||
+         format == VRM_BAYER_GRBG_8;
+}
+
+// Offsets of the red and blue sample inside a 2x2 Bayer cell, as (row, column).
+static void bayerLayout(VRmColorFormat format, int* redRow, int* redCol) {
+  switch (format) {
+    case VRM_BAYER_RGGB_8:
+      *redRow = 0, *redCol = 0;
+      break;
+    case VRM_BAYER_GRBG_8:
+      *redRow = 0, *redCol = 1;
+      break;
+    case VRM_BAYER_GBRG_8:
+      *redRow = 1, *redCol = 0;
+      break;
+    default:  // VRM_BAYER_BGGR_8
+      *redRow = 1, *redCol = 1;
+      break;
+  }
+}
+
+// Cheap 2x2 cell demosaicing, good enough for synthetic frames.
+static void convertBayer(const VRmImage* source, VRmImage* target) {
+  int redRow, redCol;
+  bayerLayout(source->m_image_format.m_color_format, &redRow, &redCol);
+  const VRmDWORD width = source->m_image_format.m_width;
+  const VRmDWORD height = source->m_image_format.m_height;
+  const bool gray = target->m_image_format.m_color_format == VRM_GRAY_8;
+
+  for (VRmDWORD y = 0; y + 1 < height; y += 2) {
+    const VRmBYTE* rows[2] = {source->mp_buffer + y * source->m_pitch,
+                              source->mp_buffer + (y + 1) * source->m_pitch};
+    VRmBYTE* out[2] = {target->mp_buffer + y * target->m_pitch, target->mp_buffer + (y + 1) * target->m_pitch};
+    for (VRmDWORD x = 0; x + 1 < width; x += 2) {
+      const int r = rows[redRow][x + redCol];
+      const int b = rows[1 - redRow][x + 1 - redCol];
+      const int g = (rows[redRow][x + 1 - redCol] + rows[1 - redRow][x + redCol]) / 2;
+      for (int dy = 0; dy < 2; ++dy) {
+        for (int dx = 0; dx < 2; ++dx) {
+          if (gray) {
+            out[dy][x + dx] = static_cast<VRmBYTE>((r + 2 * g + b) / 4);
+          } else {
+            VRmBYTE* px = out[dy] + (x + dx) * 3;
+            px[0] = static_cast<VRmBYTE>(b);
+            px[1] = static_cast<VRmBYTE>(g);
+            px[2] = static_cast<VRmBYTE>(r);
+          }
+        }
+      }
+    }
+  }
+}
+
+static void convertGrayToBgr(const VRmImage* source, VRmImage* target) {
+  for (VRmDWORD y = 0; y < source->m_image_format.m_height; ++y) {
+    const VRmBYTE* in = source->mp_buffer + y * source->m_pitch;
+    VRmBYTE* out = target->mp_buffer + y * target->m_pitch;
+    for (VRmDWORD x = 0; x < source->m_image_format.m_width; ++x) {
+      out[3 * x] = out[3 * x + 1] = out[3 * x + 2] = in[x];
+    }
+  }
+}
+
+static void convertBgrToGray(const VRmImage* source, VRmImage* target) {
+  for (VRmDWORD y = 0; y < source->m_image_format.m_height; ++y) {
+    const VRmBYTE* in = source->mp_buffer + y * source->m_pitch;
+    VRmBYTE* out = target->mp_buffer + y * target->m_pitch;
+    for (VRmDWORD x = 0; x < source->m_image_format.m_width; ++x) {
+      out[x] = static_cast<VRmBYTE>((in[3 * x] + 2 * in[3 * x + 1] + in[3 * x + 2]) / 4);
+    }
+  }
+}
+
+static void copyRows(const VRmImage* source, VRmImage* target) {
+  const size_t rowBytes = source->m_image_format.m_width * bytesPerPixel(source->m_image_format.m_color_format);
+  for (VRmDWORD y = 0; y < source->m_image_format.m_height; ++y) {
+    memcpy(target->mp_buffer + y * target->m_pitch, source->mp_buffer + y * source->m_pitch, rowBytes);
+  }
+}
+
+bool colorFormatFromString(const std::string& name, VRmColorFormat* format) {
+  if (name == "bgr_3x8") {
+    *format = VRM_BGR_3X8;
+  } else if (name == "gray_8") {
+    *format = VRM_GRAY_8;
+  } else if (name == "bayer_gbrg_8") {
+    *format = VRM_BAYER_GBRG_8;
+  } else if (name == "bayer_bggr_8") {
+    *format = VRM_BAYER_BGGR_8;
+  } else if (name == "bayer_rggb_8") {
+    *format = VRM_BAYER_RGGB_8;
+  } else if (name == "bayer_grbg_8") {
+    *format = VRM_BAYER_GRBG_8;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Member functions
+
+SimulatedBackend::SimulatedBackend(const SimulationConfig& conf_)
+    : conf(conf_),
+      selectedPort(0),
+      grabMode(VRM_PROPID_GRAB_MODE_FREERUNNING),
+      opened(false),
+      running(false),
+      period(Clock::duration::zero()) {
+  for (VRmDWORD i = 0; i < NUM_PORTS; ++i) {
+    ports.push_back(new Port());
+    ports[i]->frameCounter = 0;
+    ports[i]->lostTriggers = 0;
+    ports[i]->rng.seed(i + 1);
+  }
+}
+
+SimulatedBackend::~SimulatedBackend() {
+  closeDevice();
+  for (size_t i = 0; i < ports.size(); ++i) delete ports[i];
+}
+
+// Nothing to log or release, the simulation lives in the backend object
+bool SimulatedBackend::enableLogging() { return true; }
+
+void SimulatedBackend::cleanup() {}
+
+bool SimulatedBackend::setError(const std::string& message) {
+  lastError = message;
+  return false;
+}
+
+SimulatedBackend::Port* SimulatedBackend::getPort(VRmDWORD port) {
+  if (!opened || port < 1 || port > NUM_PORTS) return 0;
+  return ports[port - 1];
+}
+
+bool SimulatedBackend::openDevice() {
+  if (conf.width <= 0 || conf.height <= 0) return setError("Simulated image size must be positive");
+  if (conf.frameRate <= 0) return setError("Simulated frame rate must be positive");
+  if (isBayer(conf.colorFormat) && (conf.width % 2 || conf.height % 2))
+    return setError("Simulated Bayer images need an even width and height");
+
+  sourceFormat.m_width = conf.width;
+  sourceFormat.m_height = conf.height;
+  sourceFormat.m_color_format = conf.colorFormat;
+  sourceFormat.m_image_modifier = VRM_STANDARD;
+
+  targetColorFormats.clear();
+  targetColorFormats.push_back(VRM_BGR_3X8);
+  targetColorFormats.push_back(VRM_GRAY_8);
+  if (conf.colorFormat != VRM_BGR_3X8 && conf.colorFormat != VRM_GRAY_8) targetColorFormats.push_back(conf.colorFormat);
+
+  period = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / conf.frameRate));
+
+  for (VRmDWORD p = 0; p < NUM_PORTS; ++p) {
+    Port& port = *ports[p];
+    port.roi.m_left = port.roi.m_top = port.roi.m_width = port.roi.m_height = 0;
+    port.subsampling = 1;
+    port.period = period;
+    if (!resizePort(p + 1)) return false;
+  }
+
+  selectedPort = 0;
+  opened = true;
+  ROS_INFO("Opened simulated device: %d x %d, pitch %d, %.1f fps",
+           sourceFormat.m_width,
+           sourceFormat.m_height,
+           ports[0]->slots[0].image.m_pitch,
+           conf.frameRate);
+  return true;
+}
+
+void SimulatedBackend::closeDevice() {
+  stop();
+  opened = false;
+}
+
+// Reallocates the buffers of a port for the size of its sensor window.
+bool SimulatedBackend::resizePort(VRmDWORD port) {
+  Port& p = *ports[port - 1];
+
+  VRmRectI area = p.roi;
+  if (area.m_width <= 0 || area.m_height <= 0) {
+    area.m_left = area.m_top = 0;
+    area.m_width = conf.width;
+    area.m_height = conf.height;
+  }
+  if (area.m_left < 0 || area.m_top < 0 || area.m_left + area.m_width > conf.width ||
+      area.m_top + area.m_height > conf.height)
+    return setError("Region of interest exceeds the sensor");
+
+  VRmImageFormat format = sourceFormat;
+  format.m_width = area.m_width / p.subsampling;
+  format.m_height = area.m_height / p.subsampling;
+  // Bayer cells are kept whole
+  if (isBayer(format.m_color_format)) {
+    format.m_width &= ~1u;
+    format.m_height &= ~1u;
+  }
+  if (format.m_width == 0 || format.m_height == 0) return setError("Region of interest too small");
+
+  const VRmDWORD bpp = bytesPerPixel(conf.colorFormat);
+  VRmDWORD pitch = format.m_width * bpp;
+  if (conf.pitch > 0 && static_cast<VRmDWORD>(conf.pitch) >= pitch) pitch = conf.pitch;
+
+  std::lock_guard<std::mutex> lock(p.mutex);
+  p.format = format;
+  p.slots.resize(BUFFERS_PER_PORT);
+  for (size_t i = 0; i < BUFFERS_PER_PORT; ++i) {
+    Slot& s = p.slots[i];
+    s.buffer.assign(pitch * format.m_height, 0);
+    s.image.m_image_format = format;
+    s.image.mp_buffer = &s.buffer[0];
+    s.image.m_pitch = pitch;
+    s.image.m_time_stamp = 0;
+    s.image.mp_private = &s;
+    s.port = port;
+    s.frameCounter = 0;
+    s.locked = false;
+    renderPattern(port, i, s);
+  }
+  return true;
+}
+
+void SimulatedBackend::renderPattern(VRmDWORD port, size_t slot, Slot& s) {
+  // Diagonal gradient over the whole sensor, shifted per port and buffer so consecutive
+  // frames differ. A window shows its part of it.
+  const Port& p = *ports[port - 1];
+  const VRmDWORD bpp = bytesPerPixel(s.image.m_image_format.m_color_format);
+  const VRmDWORD left = p.roi.m_width > 0 ? p.roi.m_left : 0;
+  const VRmDWORD top = p.roi.m_height > 0 ? p.roi.m_top : 0;
+  for (VRmDWORD y = 0; y < s.image.m_image_format.m_height; ++y) {
+    VRmBYTE* row = &s.buffer[y * s.image.m_pitch];
+    const VRmDWORD sensorY = top + y * p.subsampling;
+    for (VRmDWORD x = 0; x < s.image.m_image_format.m_width; ++x) {
+      const VRmDWORD sensorX = left + x * p.subsampling;
+      for (VRmDWORD c = 0; c < bpp; ++c) {
+        row[x * bpp + c] = static_cast<VRmBYTE>(sensorX * bpp + c + sensorY + 32 * port + 8 * slot);
+      }
+    }
+  }
+}
+
+bool SimulatedBackend::getSourceFormat(VRmDWORD port, VRmImageFormat* format) {
+  Port* p = getPort(port);
+  if (!p) return setError("Invalid port");
+  *format = p->format;
+  return true;
+}
+
+bool SimulatedBackend::getTargetFormatListSize(VRmDWORD port, VRmDWORD* size) {
+  if (!getPort(port)) return setError("Invalid port");
+  *size = targetColorFormats.size();
+  return true;
+}
+
+bool SimulatedBackend::getTargetFormatListEntry(VRmDWORD port, VRmDWORD index, VRmImageFormat* format) {
+  Port* p = getPort(port);
+  if (!p) return setError("Invalid port");
+  if (index >= targetColorFormats.size()) return setError("Target format index out of range");
+  *format = p->format;
+  format->m_color_format = targetColorFormats[index];
+  return true;
+}
+
+bool SimulatedBackend::getPropertySupported(VRmPropId id, bool* supported) {
+  if (!opened) return setError("Device not opened");
+  *supported = id == VRM_PROPID_GRAB_SENSOR_PROPS_SELECT_E || id == VRM_PROPID_GRAB_SUBSAMPLING_E ||
+               id == VRM_PROPID_GRAB_ROI_RECTI || id == VRM_PROPID_CAM_ACQUISITION_RATE_MAX_F ||
+               id == VRM_PROPID_GRAB_MODE_E || id == VRM_PROPID_CAM_SOFT_TRIGGER_B;
+  return true;
+}
+
+bool SimulatedBackend::setPropertyValueB(VRmPropId id, bool value) {
+  if (!opened) return setError("Device not opened");
+  if (id != VRM_PROPID_CAM_SOFT_TRIGGER_B) return setError("Property not supported");
+  if (grabMode != VRM_PROPID_GRAB_MODE_TRIGGERED_SOFT) return setError("Not in software trigger mode");
+  if (!running) return setError("Device not started");
+  if (!value) return true;
+
+  // All sensors expose at once
+  const Clock::time_point now = Clock::now();
+  for (size_t i = 0; i < ports.size(); ++i) {
+    Port& p = *ports[i];
+    std::lock_guard<std::mutex> lock(p.mutex);
+    if (p.triggers.size() == BUFFERS_PER_PORT) {
+      p.triggers.pop_front();
+      ++p.lostTriggers;
+    }
+    p.triggers.push_back(now);
+    p.triggered.notify_all();
+  }
+  return true;
+}
+
+bool SimulatedBackend::setPropertyValueE(VRmPropId id, VRmPropId value) {
+  if (!opened) return setError("Device not opened");
+  if (id == VRM_PROPID_GRAB_MODE_E) {
+    if (value != VRM_PROPID_GRAB_MODE_FREERUNNING && value != VRM_PROPID_GRAB_MODE_TRIGGERED_SOFT &&
+        value != VRM_PROPID_GRAB_MODE_TRIGGERED_EXT)
+      return setError("Invalid grab mode");
+    if (running) return setError("The grab mode cannot change while streaming");
+    grabMode = value;
+    return true;
+  }
+  if (id == VRM_PROPID_GRAB_SENSOR_PROPS_SELECT_E) {
+    switch (value) {
+      case VRM_PROPID_GRAB_SENSOR_PROPS_SELECT_1:
+        selectedPort = 1;
+        break;
+      case VRM_PROPID_GRAB_SENSOR_PROPS_SELECT_2:
+        selectedPort = 2;
+        break;
+      case VRM_PROPID_GRAB_SENSOR_PROPS_SELECT_3:
+        selectedPort = 3;
+        break;
+      case VRM_PROPID_GRAB_SENSOR_PROPS_SELECT_4:
+        selectedPort = 4;
+        break;
+      default:
+        return setError("Invalid sensor selection");
+    }
+    return true;
+  }
+
+  if (id != VRM_PROPID_GRAB_SUBSAMPLING_E) return setError("Property not supported");
+  if (!selectedPort) return setError("No sensor selected");
+  if (running) return setError("Sensor properties cannot change while streaming");
+
+  Port& p = *ports[selectedPort - 1];
+  const int previous = p.subsampling;
+  switch (value) {
+    case VRM_PROPID_GRAB_SUBSAMPLING_1X1:
+      p.subsampling = 1;
+      break;
+    case VRM_PROPID_GRAB_SUBSAMPLING_2X2:
+      p.subsampling = 2;
+      break;
+    case VRM_PROPID_GRAB_SUBSAMPLING_4X4:
+      p.subsampling = 4;
+      break;
+    default:
+      return setError("Invalid subsampling");
+  }
+  if (!resizePort(selectedPort)) {
+    p.subsampling = previous;
+    return false;
+  }
+  return true;
+}
+
+bool SimulatedBackend::setPropertyValueF(VRmPropId id, float value) {
+  if (!opened) return setError("Device not opened");
+  if (id != VRM_PROPID_CAM_ACQUISITION_RATE_MAX_F) return setError("Property not supported");
+  if (!selectedPort) return setError("No sensor selected");
+  if (value <= 0) return setError("Acquisition rate must be positive");
+
+  // The sensor cannot run faster than its configured rate
+  Port& p = *ports[selectedPort - 1];
+  std::lock_guard<std::mutex> lock(p.mutex);
+  p.period = std::max(period, std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / value)));
+  return true;
+}
+
+bool SimulatedBackend::setPropertyValueRectI(VRmPropId id, const VRmRectI& value) {
+  if (!opened) return setError("Device not opened");
+  if (id != VRM_PROPID_GRAB_ROI_RECTI) return setError("Property not supported");
+  if (!selectedPort) return setError("No sensor selected");
+  if (running) return setError("Sensor properties cannot change while streaming");
+
+  Port& p = *ports[selectedPort - 1];
+  const VRmRectI previous = p.roi;
+  p.roi = value;
+  if (!resizePort(selectedPort)) {
+    p.roi = previous;
+    return false;
+  }
+  return true;
+}
+
+bool SimulatedBackend::resetFrameCounter() {
+  if (!opened) return setError("Device not opened");
+  for (size_t i = 0; i < ports.size(); ++i) {
+    std::lock_guard<std::mutex> lock(ports[i]->mutex);
+    ports[i]->frameCounter = 0;
+  }
+  return true;
+}
+
+bool SimulatedBackend::start() {
+  if (!opened) return setError("Device not opened");
+  epoch = Clock::now();
+  for (size_t i = 0; i < ports.size(); ++i) {
+    std::lock_guard<std::mutex> lock(ports[i]->mutex);
+    ports[i]->nextFrame = epoch + ports[i]->period;
+  }
+  for (size_t i = 0; i < ports.size(); ++i) {
+    std::lock_guard<std::mutex> lock(ports[i]->mutex);
+    ports[i]->triggers.clear();
+  }
+  running = true;
+  return true;
+}
+
+bool SimulatedBackend::stop() {
+  running = false;
+  // Wakes threads waiting for a trigger, they fail as on the device
+  for (size_t i = 0; i < ports.size(); ++i) {
+    std::lock_guard<std::mutex> lock(ports[i]->mutex);
+    ports[i]->triggered.notify_all();
+  }
+  return true;
+}
+
+bool SimulatedBackend::lockNextImage(VRmDWORD port, VRmImage** image, VRmDWORD* framesDropped, int timeout) {
+  Port* p = getPort(port);
+  if (!p) return setError("Invalid port");
+  if (!running) return setError("Device not started");
+
+  std::unique_lock<std::mutex> lock(p->mutex);
+
+  Slot* slot = 0;
+  for (size_t i = 0; i < p->slots.size() && !slot; ++i) {
+    if (!p->slots[i].locked) slot = &p->slots[i];
+  }
+  if (!slot) return setError("All image buffers of this port are locked");
+
+  const Clock::time_point now = Clock::now();
+  const Clock::time_point deadline = now + std::chrono::milliseconds(timeout);
+  const Clock::duration latency =
+      std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double, std::milli>(conf.lockLatency));
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+  VRmDWORD dropped = 0;
+  Clock::time_point frameTime;
+
+  if (grabMode == VRM_PROPID_GRAB_MODE_TRIGGERED_SOFT) {
+    const bool triggered = waitForTrigger(*p, lock, deadline, &frameTime, &dropped);
+    if (framesDropped) *framesDropped = dropped;
+    if (!triggered) return setError(running ? "Timeout while waiting for a trigger" : "Device stopped");
+  } else {
+    // Frames the driver ring buffer has already overwritten because we were too slow
+    while (now - p->nextFrame > static_cast<Clock::rep>(BUFFERS_PER_PORT) * p->period) {
+      p->nextFrame += p->period;
+      ++p->frameCounter;
+      ++dropped;
+    }
+
+    // Frames lost on the bus
+    frameTime = p->nextFrame;
+    while (conf.dropProbability > 0 && uniform(p->rng) < conf.dropProbability) {
+      frameTime += p->period;
+      ++p->frameCounter;
+      ++dropped;
+    }
+    p->nextFrame = frameTime + p->period;
+
+    if (framesDropped) *framesDropped = dropped;
+  }
+
+  const Clock::time_point readyAt = frameTime + latency;
+  if (readyAt > deadline) {
+    // The frame is still on its way, the next call gets it with the counter it has now
+    if (grabMode == VRM_PROPID_GRAB_MODE_TRIGGERED_SOFT) {
+      p->triggers.push_front(frameTime);
+    } else {
+      p->nextFrame = frameTime;
+    }
+    lock.unlock();
+    std::this_thread::sleep_until(deadline);
+    return setError("Timeout while waiting for the next image");
+  }
+
+  // Wait for the frame without the lock, so that triggers and unlocks go through meanwhile
+  // as on the device. The slot stays reserved.
+  slot->locked = true;
+  lock.unlock();
+  std::this_thread::sleep_until(readyAt);
+  lock.lock();
+
+  // Stamp the frame counter into the first pixels so consumers can tell frames apart
+  const VRmDWORD counter = p->frameCounter++;
+  memcpy(slot->image.mp_buffer, &counter, std::min<size_t>(sizeof(counter), slot->image.m_pitch));
+
+  slot->frameCounter = counter;
+  slot->image.m_time_stamp =
+      std::chrono::duration<double, std::milli>(frameTime - epoch).count() * (1.0 + conf.clockDrift * 1e-6);
+  *image = &slot->image;
+  return true;
+}
+
+// Takes the oldest pending trigger of a port, waiting for one until deadline or until the device
+// stops. Frames lost on the bus are skipped like in free running mode.
+bool SimulatedBackend::waitForTrigger(Port& p,
+                                      std::unique_lock<std::mutex>& lock,
+                                      Clock::time_point deadline,
+                                      Clock::time_point* frameTime,
+                                      VRmDWORD* dropped) {
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+  for (;;) {
+    if (!p.triggered.wait_until(lock, deadline, [this, &p] { return !p.triggers.empty() || !running; })) return false;
+    if (!running) return false;
+
+    *dropped += p.lostTriggers;
+    p.frameCounter += p.lostTriggers;
+    p.lostTriggers = 0;
+
+    *frameTime = p.triggers.front();
+    p.triggers.pop_front();
+    if (conf.dropProbability > 0 && uniform(p.rng) < conf.dropProbability) {
+      ++p.frameCounter;
+      ++*dropped;
+      continue;
+    }
+    return true;
+  }
+}
+
+bool SimulatedBackend::unlockNextImage(VRmImage** image) {
+  if (!image || !*image || !(*image)->mp_private || (*image)->mp_private == &wrappedImageTag)
+    return setError("Image was not locked from this device");
+  Slot* slot = static_cast<Slot*>((*image)->mp_private);
+  Port* p = getPort(slot->port);
+  if (!p) return setError("Invalid port");
+
+  std::lock_guard<std::mutex> lock(p->mutex);
+  slot->locked = false;
+  *image = 0;
+  return true;
+}
+
+bool SimulatedBackend::getFrameCounter(const VRmImage* image, VRmDWORD* frameCounter) {
+  if (!image || !image->mp_private || image->mp_private == &wrappedImageTag)
+    return setError("Image was not locked from this device");
+  *frameCounter = static_cast<const Slot*>(image->mp_private)->frameCounter;
+  return true;
+}
+
+bool SimulatedBackend::newImage(VRmImage** image, const VRmImageFormat& format) {
+  const VRmDWORD pitch = format.m_width * bytesPerPixel(format.m_color_format);
+  VRmImage* img = new VRmImage();
+  img->m_image_format = format;
+  img->m_pitch = pitch;
+  img->mp_buffer = new VRmBYTE[pitch * format.m_height];
+  img->m_time_stamp = 0;
+  img->mp_private = 0;
+  *image = img;
+  return true;
+}
+
+bool SimulatedBackend::wrapImage(VRmImage** image, const VRmImageFormat& format, VRmBYTE* buffer, VRmDWORD pitch) {
+  if (pitch < format.m_width * bytesPerPixel(format.m_color_format)) return setError("Pitch too small for format");
+  VRmImage* img = new VRmImage();
+  img->m_image_format = format;
+  img->m_pitch = pitch;
+  img->mp_buffer = buffer;
+  img->m_time_stamp = 0;
+  img->mp_private = &wrappedImageTag;
+  *image = img;
+  return true;
+}
+
+bool SimulatedBackend::freeImage(VRmImage** image) {
+  if (!image || !*image) return setError("Invalid image");
+  if ((*image)->mp_private == &wrappedImageTag) {
+    delete *image;
+    *image = 0;
+    return true;
+  }
+  if ((*image)->mp_private) return setError("Locked images must be unlocked, not freed");
+  delete[] (*image)->mp_buffer;
+  delete *image;
+  *image = 0;
+  return true;
+}
+
+bool SimulatedBackend::convertImage(const VRmImage* source, VRmImage* target) {
+  const VRmImageFormat& in = source->m_image_format;
+  const VRmImageFormat& out = target->m_image_format;
+  if (in.m_width != out.m_width || in.m_height != out.m_height) return setError("Image sizes differ");
+
+  if (in.m_color_format == out.m_color_format) {
+    copyRows(source, target);
+  } else if (isBayer(in.m_color_format) && (out.m_color_format == VRM_BGR_3X8 || out.m_color_format == VRM_GRAY_8)) {
+    convertBayer(source, target);
+  } else if (in.m_color_format == VRM_GRAY_8 && out.m_color_format == VRM_BGR_3X8) {
+    convertGrayToBgr(source, target);
+  } else if (in.m_color_format == VRM_BGR_3X8 && out.m_color_format == VRM_GRAY_8) {
+    convertBgrToGray(source, target);
+  } else {
+    return setError("Unsupported conversion");
+  }
+  return true;
+}
+
+// The names colorFormatFromString() reads
+bool SimulatedBackend::getColorFormatString(VRmColorFormat format, const char** name) {
+  switch (format) {
+    case VRM_BGR_3X8:
+      *name = "bgr_3x8";
+      return true;
+    case VRM_GRAY_8:
+      *name = "gray_8";
+      return true;
+    case VRM_BAYER_GBRG_8:
+      *name = "bayer_gbrg_8";
+      return true;
+    case VRM_BAYER_BGGR_8:
+      *name = "bayer_bggr_8";
+      return true;
+    case VRM_BAYER_RGGB_8:
+      *name = "bayer_rggb_8";
+      return true;
+    case VRM_BAYER_GRBG_8:
+      *name = "bayer_grbg_8";
+      return true;
+    default:
+      return setError("Unsupported color format");
+  }
+}
+
+const char* SimulatedBackend::getLastError() { return lastError.c_str(); }
+}
@@ -0,0 +1,104 @@
+#include "stereo_matcher.hpp"
+
+#include <algorithm>
+
+#include <stdint.h>
+
+namespace vrmagic {
+
+StereoMatcher::StereoMatcher(const Config& conf)
+    : mode(conf.pairMatching),
+      maxFrameCounterSkew(conf.maxFrameCounterSkew),
+      maxTimeSkew(conf.maxTimeSkew),
+      capacity(std::max(1, conf.pairBuffer)) {}
+
+int StereoMatcher::compare(const FrameInfo& l, const FrameInfo& r) const {
+  if (mode == PAIR_BY_TIMESTAMP) {
+    const double skew = l.sensorTime - r.sensorTime;
+    if (skew < -maxTimeSkew) return -1;
+    if (skew > maxTimeSkew) return 1;
+    return 0;
+  }
+
+  // Signed distance, robust against the 32 bit counters wrapping around
+  const int32_t skew = static_cast<int32_t>(l.frameCounter - r.frameCounter);
+  if (skew < -maxFrameCounterSkew) return -1;
+  if (skew > maxFrameCounterSkew) return 1;
+  return 0;
+}
+
+void StereoMatcher::addLeft(Frame* frame) {
+  left.push_back(frame);
+  if (left.size() > capacity) {
+    overflowLeft.push_back(left.front());
+    left.pop_front();
+  }
+}
+
+void StereoMatcher::addRight(Frame* frame) {
+  right.push_back(frame);
+  if (right.size() > capacity) {
+    overflowRight.push_back(right.front());
+    right.pop_front();
+  }
+}
+
+bool StereoMatcher::needsLeft() const { return left.size() <= right.size(); }
+
+bool StereoMatcher::popPair(Frame*& l,
+                            Frame*& r,
+                            std::vector<Frame*>& orphansLeft,
+                            std::vector<Frame*>& orphansRight) {
+  stats.orphansLeft += overflowLeft.size();
+  stats.orphansRight += overflowRight.size();
+  orphansLeft.insert(orphansLeft.end(), overflowLeft.begin(), overflowLeft.end());
+  orphansRight.insert(orphansRight.end(), overflowRight.begin(), overflowRight.end());
+  overflowLeft.clear();
+  overflowRight.clear();
+
+  while (!left.empty() && !right.empty()) {
+    const int order = compare(left.front()->info, right.front()->info);
+    if (order < 0) {
+      // Every later right frame is even newer, this left frame has no partner
+      orphansLeft.push_back(left.front());
+      left.pop_front();
+      ++stats.orphansLeft;
+    } else if (order > 0) {
+      orphansRight.push_back(right.front());
+      right.pop_front();
+      ++stats.orphansRight;
+    } else {
+      l = left.front();
+      r = right.front();
+      left.pop_front();
+      right.pop_front();
+      ++stats.pairs;
+      return true;
+    }
+  }
+  return false;
+}
+
+void StereoMatcher::flush(std::vector<Frame*>& framesLeft, std::vector<Frame*>& framesRight) {
+  framesLeft.insert(framesLeft.end(), overflowLeft.begin(), overflowLeft.end());
+  framesRight.insert(framesRight.end(), overflowRight.begin(), overflowRight.end());
+  framesLeft.insert(framesLeft.end(), left.begin(), left.end());
+  framesRight.insert(framesRight.end(), right.begin(), right.end());
+  overflowLeft.clear();
+  overflowRight.clear();
+  left.clear();
+  right.clear();
+}
+
+void StereoMatcher::countPair() { ++stats.pairs; }
+
+void StereoMatcher::countOrphan(bool isLeft) {
+  if (isLeft) {
+    ++stats.orphansLeft;
+  } else {
+    ++stats.orphansRight;
+  }
+}
+
+MatcherStats StereoMatcher::getStats() const { return stats; }
+}
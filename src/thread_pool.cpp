@@ -0,0 +1,107 @@
+#include "thread_pool.hpp"
+
+namespace vrmagic {
+
+ThreadPool::ThreadPool(size_t workers) : pending(0), nextQueue(0), stopping(false) {
+  for (size_t i = 0; i < workers; ++i) queues.push_back(new Queue());
+  for (size_t i = 0; i < workers; ++i) threads.push_back(std::thread(&ThreadPool::workerLoop, this, i));
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (size_t i = 0; i < threads.size(); ++i) threads[i].join();
+  for (size_t i = 0; i < queues.size(); ++i) delete queues[i];
+}
+
+size_t ThreadPool::getNumThreads() const { return threads.size() + 1; }
+
+void ThreadPool::run(size_t count, const std::function<void(size_t)>& task) {
+  if (queues.empty()) {
+    for (size_t i = 0; i < count; ++i) task(i);
+    return;
+  }
+
+  Batch batch;
+  batch.task = &task;
+  batch.remaining = count;
+
+  // Announce the tasks before queueing them, so pending never drops below zero
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    pending += count;
+  }
+
+  // Deal the tasks out round robin, consecutive stripes go to different workers
+  const size_t first = nextQueue++;
+  for (size_t i = 0; i < count; ++i) {
+    Queue* queue = queues[(first + i) % queues.size()];
+    std::lock_guard<std::mutex> lock(queue->mutex);
+    queue->tasks.push_back(Task{&batch, i});
+  }
+  wake.notify_all();
+
+  // Work along instead of idling, the caller has no queue of its own and only steals
+  Task stolen;
+  while (popTask(queues.size(), stolen)) {
+    execute(stolen);
+
+    std::lock_guard<std::mutex> lock(batch.mutex);
+    if (batch.remaining == 0) break;
+  }
+
+  std::unique_lock<std::mutex> lock(batch.mutex);
+  batch.done.wait(lock, [&batch] { return batch.remaining == 0; });
+}
+
+bool ThreadPool::popTask(size_t self, Task& task) {
+  if (self < queues.size()) {
+    Queue* own = queues[self];
+    std::lock_guard<std::mutex> lock(own->mutex);
+    if (!own->tasks.empty()) {
+      task = own->tasks.back();
+      own->tasks.pop_back();
+      --pending;
+      return true;
+    }
+  }
+
+  for (size_t i = 1; i <= queues.size(); ++i) {
+    Queue* victim = queues[(self + i) % queues.size()];
+    std::lock_guard<std::mutex> lock(victim->mutex);
+    if (!victim->tasks.empty()) {
+      task = victim->tasks.front();
+      victim->tasks.pop_front();
+      --pending;
+      return true;
+    }
+  }
+  return false;
+}
+
+void ThreadPool::execute(const Task& task) {
+  (*task.batch->task)(task.index);
+
+  // The caller of run() destroys the batch once remaining is zero, so it may only be
+  // touched while holding its mutex
+  std::lock_guard<std::mutex> lock(task.batch->mutex);
+  if (--task.batch->remaining == 0) task.batch->done.notify_all();
+}
+
+void ThreadPool::workerLoop(size_t index) {
+  while (true) {
+    Task task;
+    if (popTask(index, task)) {
+      execute(task);
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    wake.wait(lock, [this] { return stopping || pending > 0; });
+    if (stopping) return;
+  }
+}
+}
@@ -1,5 +1,7 @@
 #include "vrmagic_node.hpp"
 
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 #include <sstream>
 
@@ -10,55 +12,662 @@ using camera_info_manager::CameraInfoManager;
 
 namespace vrmagic {
 
+static const double IDLE_SLEEP = 0.05;
+
+// In s. The CameraInfoManager has no change notification, so set_camera_info calls are
+// picked up by polling.
+static const double CALIBRATION_CHECK_PERIOD = 1.0;
+
+// Helper functions
+
+// Pixels of a mono8 or bgr8 image as gray values, converted into buffer if needed.
+static const uint8_t *grayPixels(const sensor_msgs::Image &img, std::vector<uint8_t> &buffer, size_t *pitch) {
+  if (img.encoding == sensor_msgs::image_encodings::MONO8) {
+    *pitch = img.step;
+    return &img.data[0];
+  }
+
+  buffer.resize(img.width * img.height);
+  for (size_t y = 0; y < img.height; ++y) {
+    const uint8_t *bgr = &img.data[y * img.step];
+    uint8_t *gray = &buffer[y * img.width];
+    for (size_t x = 0; x < img.width; ++x, bgr += 3) gray[x] = (29 * bgr[0] + 150 * bgr[1] + 77 * bgr[2] + 128) >> 8;
+  }
+  *pitch = img.width;
+  return &buffer[0];
+}
+
+static bool sameCalibration(const sensor_msgs::CameraInfo &a, const sensor_msgs::CameraInfo &b) {
+  return a.width == b.width && a.height == b.height && a.distortion_model == b.distortion_model && a.D == b.D &&
+         a.K == b.K && a.R == b.R && a.P == b.P && a.binning_x == b.binning_x && a.binning_y == b.binning_y &&
+         a.roi.x_offset == b.roi.x_offset && a.roi.y_offset == b.roi.y_offset && a.roi.width == b.roi.width &&
+         a.roi.height == b.roi.height && a.roi.do_rectify == b.roi.do_rectify;
+}
+
+// Describes the sensor window in the camera info. The calibration stays that of the whole
+// sensor, consumers adjust it through the binning and roi.
+static sensor_msgs::CameraInfo windowCameraInfo(const sensor_msgs::CameraInfo &info, const SensorWindow &window) {
+  sensor_msgs::CameraInfo result = info;
+  if (window.subsampling > 1) result.binning_x = result.binning_y = window.subsampling;
+  if (window.width > 0 && window.height > 0) {
+    result.roi.x_offset = window.xOffset;
+    result.roi.y_offset = window.yOffset;
+    result.roi.width = window.width;
+    result.roi.height = window.height;
+  }
+  return result;
+}
+
+static bool previewSubscribed(const std::vector<Preview> &previews) {
+  for (size_t i = 0; i < previews.size(); ++i) {
+    if (previews[i].pub.getNumSubscribers() > 0) return true;
+  }
+  return false;
+}
+
+static void drainPipeline(PortPipeline *pipeline) {
+  while (Frame *frame = pipeline->pop(0)) pipeline->release(frame);
+}
+
+template <typename T>
+static diagnostic_msgs::KeyValue keyValue(const std::string &key, const T &value) {
+  std::ostringstream ss;
+  ss << value;
+  diagnostic_msgs::KeyValue kv;
+  kv.key = key;
+  kv.value = ss.str();
+  return kv;
+}
+
+static diagnostic_msgs::DiagnosticStatus portStatus(const std::string &name,
+                                                    VRmDWORD port,
+                                                    bool active,
+                                                    const PortStats &now,
+                                                    const PortStats &before,
+                                                    double interval) {
+  const unsigned long frames = now.frames - before.frames;
+  const unsigned long dropped = now.framesDropped - before.framesDropped;
+  const unsigned long timeouts = now.lockTimeouts - before.lockTimeouts;
+  const unsigned long skipped = now.framesSkipped - before.framesSkipped;
+  const unsigned long conversions = now.conversions - before.conversions;
+  const double lockWait = frames ? (now.lockWaitTotal - before.lockWaitTotal) / frames : 0;
+  const double conversion = conversions ? (now.conversionTotal - before.conversionTotal) / conversions : 0;
+
+  diagnostic_msgs::DiagnosticStatus status;
+  status.name = "vrmagic: " + name + " port";
+  status.hardware_id = keyValue("port", port).value;
+  if (frames == 0 && !active) {
+    status.level = diagnostic_msgs::DiagnosticStatus::OK;
+    status.message = "Idle, no subscribers";
+  } else if (frames == 0) {
+    status.level = diagnostic_msgs::DiagnosticStatus::ERROR;
+    status.message = "No frames";
+  } else if (dropped > 0 || timeouts > 0) {
+    status.level = diagnostic_msgs::DiagnosticStatus::WARN;
+    status.message = "Frames dropped";
+  } else {
+    status.level = diagnostic_msgs::DiagnosticStatus::OK;
+    status.message = "OK";
+  }
+
+  status.values.push_back(keyValue("Frame rate (Hz)", frames / interval));
+  status.values.push_back(keyValue("Dropped frames", dropped));
+  status.values.push_back(keyValue("Dropped frames total", now.framesDropped));
+  status.values.push_back(keyValue("Skipped frames", skipped));
+  status.values.push_back(keyValue("Lock timeouts", timeouts));
+  status.values.push_back(keyValue("Lock timeouts total", now.lockTimeouts));
+  status.values.push_back(keyValue("Mean lock wait (ms)", lockWait * 1000));
+  status.values.push_back(keyValue("Max lock wait (ms)", now.lockWaitMax * 1000));
+  status.values.push_back(keyValue("Mean conversion (ms)", conversion * 1000));
+  status.values.push_back(keyValue("Max conversion (ms)", now.conversionMax * 1000));
+  return status;
+}
+
+// Member functions
+
 VrMagicNode::VrMagicNode(const ros::NodeHandle &nh_, CameraHandle *cam_) {
   nh = nh_;
   cam = cam_;
 
-  leftNs = ros::NodeHandle(nh, "left");
-  rightNs = ros::NodeHandle(nh, "right");
+  Config conf = cam->getConfig();
+  stereo = conf.stereo && conf.ports.size() >= 2;
+
+  ports.resize(conf.ports.size());
+  for (size_t i = 0; i < ports.size(); ++i) {
+    const PortConfig &pc = conf.ports[i];
+    PortOutput &port = ports[i];
+    port.nh = ros::NodeHandle(nh, pc.name);
+    port.it = new image_transport::ImageTransport(port.nh);
+    port.camPub = port.it->advertiseCamera("image_raw", 2);
+
+    port.cinfo = new CameraInfoManager(port.nh, conf.cameraName + "_" + pc.name, camera_calibration_path);
+    port.cinfo->loadCameraInfo(camera_calibration_path);
+    ROS_INFO("%s calibrated: %s", pc.name.c_str(), port.cinfo->isCalibrated() ? "true" : "false");
+    port.camInfo = windowCameraInfo(port.cinfo->getCameraInfo(), pc.window);
+
+    if (conf.rectify && pc.outputFormat == OUTPUT_RAW) {
+      ROS_WARN("Raw images cannot be rectified, not rectifying %s", pc.name.c_str());
+    } else if (conf.rectify) {
+      port.rectPub = port.it->advertise("image_rect", 2);
+      port.rectifier = new Rectifier();
+      port.rectifier->setCameraInfo(port.camInfo);
+    }
+
+    if (!conf.previewFactors.empty() && pc.outputFormat == OUTPUT_RAW) {
+      ROS_WARN("Raw images cannot be shrunk, no previews of %s", pc.name.c_str());
+    } else {
+      for (size_t j = 0; j < conf.previewFactors.size(); ++j) {
+        const std::string topic = conf.previewFactors[j] == 2 ? "half/image_raw" : "quarter/image_raw";
+        Preview preview = {conf.previewFactors[j], port.it->advertiseCamera(topic, 2)};
+        port.previews.push_back(preview);
+      }
+    }
 
-  itLeft = new image_transport::ImageTransport(leftNs);
-  itRight = new image_transport::ImageTransport(rightNs);
+    if (conf.sharedMemory) {
+      port.shm = new ShmRingWriter(shmSegmentName(port.nh.getNamespace()), conf.sharedMemorySlots);
+      ROS_INFO("Writing %s to shared memory %s", pc.name.c_str(), shmSegmentName(port.nh.getNamespace()).c_str());
+    }
+  }
+  calibrationTimer =
+      nh.createWallTimer(ros::WallDuration(CALIBRATION_CHECK_PERIOD), &VrMagicNode::refreshCameraInfo, this);
 
-  camPubLeft = image_transport::ImageTransport(leftNs).advertiseCamera("image_raw", 2);
-  camPubRight = image_transport::ImageTransport(rightNs).advertiseCamera("image_raw", 2);
+  blockMatcher = 0;
+  disparityMessages = 0;
+  if (conf.disparity && !(stereo && ports[0].rectifier && ports[1].rectifier)) {
+    ROS_WARN("Disparity needs a rectified stereo pair, ignoring disparity");
+  } else if (conf.disparity) {
+    disparityPub = nh.advertise<stereo_msgs::DisparityImage>("disparity", 1);
+    blockMatcher = new BlockMatcher(conf.blockMatching);
+    disparityMessages = new MessagePool<stereo_msgs::DisparityImage>(conf.poolSize);
+  }
 
-  cinfoLeft = new CameraInfoManager(leftNs, "vrmagic_left", camera_calibration_path);
-  cinfoRight = new CameraInfoManager(rightNs, "vrmagic_right", camera_calibration_path);
+  if (conf.pipeline) {
+    // The matcher must leave the convert stage at least one frame to work with
+    conf.pairBuffer = std::max(1, std::min(conf.pairBuffer, conf.pipelineDepth - 1));
+    for (size_t i = 0; i < ports.size(); ++i) ports[i].pipeline = new PortPipeline(cam, i, conf.pipelineDepth);
+  }
+  matcher = new StereoMatcher(conf);
 
-  cinfoLeft->loadCameraInfo(camera_calibration_path);
-  cinfoRight->loadCameraInfo(camera_calibration_path);
+  // Room for the messages in flight plus those queued for subscribers, for every port and
+  // its rectified and preview images
+  size_t images = 0;
+  size_t camInfos = 0;
+  for (size_t i = 0; i < ports.size(); ++i) {
+    images += 1 + (ports[i].rectifier ? 1 : 0) + ports[i].previews.size();
+    camInfos += 1 + ports[i].previews.size();
+  }
+  imageMessages = new MessagePool<sensor_msgs::Image>(images * conf.poolSize);
+  camInfoMessages = new MessagePool<sensor_msgs::CameraInfo>(camInfos * conf.poolSize);
 
-  ROS_INFO("Left calibrated: %s", cinfoLeft->isCalibrated() ? "true" : "false");
-  ROS_INFO("Right calibrated: %s", cinfoRight->isCalibrated() ? "true" : "false");
+  streaming = true;
+  frameIndex = 0;
+  frameInfos.resize(ports.size());
+
+  if (conf.diagnosticsRate > 0) {
+    for (size_t i = 0; i < ports.size(); ++i) ports[i].lastStats = cam->takePortStats(i);
+    lastDiagnostics = ros::WallTime::now();
+
+    diagnosticsPub = nh.advertise<diagnostic_msgs::DiagnosticArray>("/diagnostics", 1);
+    diagnosticsTimer =
+        nh.createWallTimer(ros::WallDuration(1.0 / conf.diagnosticsRate), &VrMagicNode::publishDiagnostics, this);
+  }
 }
 
 VrMagicNode::~VrMagicNode() {
-  delete itLeft;
-  delete itRight;
+  MatcherStats stats = matcher->getStats();
+  if (stereo) {
+    ROS_INFO("Stereo pairs: %lu matched, %lu left and %lu right frames discarded",
+             stats.pairs,
+             stats.orphansLeft,
+             stats.orphansRight);
+  }
+  delete matcher;
+
+  for (size_t i = 0; i < ports.size(); ++i) {
+    delete ports[i].pipeline;
+    delete ports[i].rectifier;
+    delete ports[i].shm;
+  }
+  delete blockMatcher;
+  delete disparityMessages;
+
+  delete imageMessages;
+  delete camInfoMessages;
+
+  for (size_t i = 0; i < ports.size(); ++i) {
+    delete ports[i].it;
+    delete ports[i].cinfo;
+  }
+}
+
+bool VrMagicNode::updateActivity() {
+  const Config &conf = cam->getConfig();
+  if (!conf.lazyAcquisition) return true;
+
+  const bool wasPairing = pairing();
+  const bool disparity = disparityPub.getNumSubscribers() > 0;
+  const bool recording = cam->getRecorder() != 0;
+  bool active = false;
+  for (size_t i = 0; i < ports.size(); ++i) {
+    PortOutput &port = ports[i];
+    const bool wasActive = port.active;
+    port.active = port.camPub.getNumSubscribers() > 0 || port.rectPub.getNumSubscribers() > 0 ||
+                  previewSubscribed(port.previews) || (disparity && stereo && i < 2) || port.shm ||
+                  recording;
+    active = active || port.active;
+
+    if (port.pipeline) {
+      // Frames still queued from before the port went idle are stale
+      if (port.active && !wasActive) drainPipeline(port.pipeline);
+      port.pipeline->setActive(port.active);
+    }
+  }
+
+  // Frames held back for pairing would never get a partner now
+  if (conf.pipeline && wasPairing && !pairing()) {
+    matcher->flush(orphansLeft, orphansRight);
+    releaseHeldFrames();
+  }
+
+  if (conf.stopIdleSensor && active != streaming) {
+    ROS_INFO("%s the sensors", active ? "Starting" : "Stopping");
+    cam->setStreaming(active);
+    streaming = active;
+  }
+
+  return active;
+}
+
+bool VrMagicNode::pairing() const { return stereo && ports[0].active && ports[1].active; }
+
+bool VrMagicNode::publishes(int decimation) const { return frameIndex % decimation == 0; }
 
-  delete cinfoLeft;
-  delete cinfoRight;
+bool VrMagicNode::frameWanted() const {
+  const Config &conf = cam->getConfig();
+  const Decimation &d = conf.decimation;
+  // Without lazy acquisition image_raw publishes whether or not anybody subscribes, the
+  // other topics are only computed for subscribers anyway
+  bool raw = !conf.lazyAcquisition;
+  bool rect = false;
+  bool previews = false;
+  for (size_t i = 0; i < ports.size(); ++i) {
+    raw = raw || ports[i].camPub.getNumSubscribers() > 0 || ports[i].shm;
+    rect = rect || ports[i].rectPub.getNumSubscribers() > 0;
+    previews = previews || previewSubscribed(ports[i].previews);
+  }
+  return (raw && publishes(d.imageRaw)) || (rect && publishes(d.imageRect)) ||
+         (disparityPub.getNumSubscribers() > 0 && publishes(d.disparity)) || (previews && publishes(d.previews));
 }
 
 void VrMagicNode::broadcastFrame() {
-  ros::Time triggerTime = ros::Time::now();
+  if (!updateActivity()) {
+    // Nobody listens, wait for subscribers without burning CPU
+    ros::WallDuration(IDLE_SLEEP).sleep();
+    return;
+  }
+  ++frameIndex;
+
+  if (cam->getConfig().pipeline) {
+    broadcastPipelinedFrame();
+    return;
+  }
+
+  // Frames that no topic publishes are taken from the driver but not converted
+  if (!frameWanted()) {
+    for (size_t i = 0; i < ports.size(); ++i) {
+      if (ports[i].active) cam->skipFrame(i);
+    }
+    return;
+  }
+
+  std::vector<sensor_msgs::ImagePtr> imgs(ports.size());
+  for (size_t i = 0; i < ports.size(); ++i) {
+    if (ports[i].active) imgs[i] = imageMessages->acquire();
+  }
+  // Ports that could not grab get no message back, nothing is published for them this cycle
+  cam->grabFrames(imgs, ros::Time::now(), frameInfos);
+
+  // Ports outside of the stereo pair publish their frames as they come
+  const bool paired = pairing();
+  for (size_t i = paired ? 2 : 0; i < ports.size(); ++i) {
+    if (imgs[i]) publishSingleFrame(i, imgs[i]);
+  }
+  if (!paired || !imgs[0] || !imgs[1]) return;
+
+  sensor_msgs::ImagePtr left = imgs[0];
+  sensor_msgs::ImagePtr right = imgs[1];
+  FrameInfo &leftInfo = frameInfos[0];
+  FrameInfo &rightInfo = frameInfos[1];
+
+  // After a drop on one port, grab again on the port that lags behind
+  const int maxRetries = cam->getConfig().pairBuffer;
+  for (int retry = 0;; ++retry) {
+    const int order = matcher->compare(leftInfo, rightInfo);
+    if (order == 0) break;
+
+    matcher->countOrphan(order < 0);
+    if (retry == maxRetries) {
+      ROS_WARN_THROTTLE(5, "Could not match frames %u and %u, skipping", leftInfo.frameCounter, rightInfo.frameCounter);
+      return;
+    }
+
+    const bool grabbed = order < 0 ? cam->grabFrame(0, *left, ros::Time::now(), &leftInfo)
+                                   : cam->grabFrame(1, *right, ros::Time::now(), &rightInfo);
+    if (!grabbed) return;
+  }
+  matcher->countPair();
+
+  // Both images of a pair need the same stamp for stereo_image_proc
+  ros::Time stamp = std::min(left->header.stamp, right->header.stamp);
+  left->header.stamp = stamp;
+  right->header.stamp = stamp;
+
+  publishFrame(left, right, stamp);
+}
+
+void VrMagicNode::broadcastPipelinedFrame() {
+  const Config &conf = cam->getConfig();
+  const int timeout = conf.timeout;
+
+  // The pipelines run concurrently, so waiting for one port after the other costs no more
+  // than waiting for the slowest
+  const bool paired = pairing();
+  for (size_t i = paired ? 2 : 0; i < ports.size(); ++i) {
+    if (!ports[i].active) continue;
+    Frame *frame = ports[i].pipeline->pop(timeout);
+    if (!frame) {
+      ROS_WARN("No frame from the %s pipeline within %d ms", conf.ports[i].name.c_str(), timeout);
+      continue;
+    }
+    publishSingleFrame(i, frame->image);
+    ports[i].pipeline->release(frame);
+  }
+  if (!paired) return;
+
+  PortPipeline *pipelineLeft = ports[0].pipeline;
+  PortPipeline *pipelineRight = ports[1].pipeline;
+  Frame *left = 0;
+  Frame *right = 0;
+  while (!matcher->popPair(left, right, orphansLeft, orphansRight)) {
+    recycleOrphans();
+
+    const bool needsLeft = matcher->needsLeft();
+    Frame *frame = (needsLeft ? pipelineLeft : pipelineRight)->pop(timeout);
+    if (!frame) {
+      ROS_WARN("No frame from the %s pipeline within %d ms", conf.ports[needsLeft ? 0 : 1].name.c_str(), timeout);
+      return;
+    }
+
+    if (needsLeft) {
+      matcher->addLeft(frame);
+    } else {
+      matcher->addRight(frame);
+    }
+  }
+  recycleOrphans();
+
+  ros::Time stamp = std::min(left->image->header.stamp, right->image->header.stamp);
+  left->image->header.stamp = stamp;
+  right->image->header.stamp = stamp;
+
+  publishFrame(left->image, right->image, stamp);
+
+  pipelineLeft->release(left);
+  pipelineRight->release(right);
+}
+
+void VrMagicNode::recycleOrphans() {
+  if (orphansLeft.empty() && orphansRight.empty()) return;
+
+  MatcherStats stats = matcher->getStats();
+  ROS_WARN_THROTTLE(5,
+                    "Discarded unmatched frames, %lu left and %lu right so far",
+                    stats.orphansLeft,
+                    stats.orphansRight);
+  releaseHeldFrames();
+}
+
+void VrMagicNode::releaseHeldFrames() {
+  for (size_t i = 0; i < orphansLeft.size(); ++i) ports[0].pipeline->release(orphansLeft[i]);
+  for (size_t i = 0; i < orphansRight.size(); ++i) ports[1].pipeline->release(orphansRight[i]);
+  orphansLeft.clear();
+  orphansRight.clear();
+}
+
+void VrMagicNode::publishFrame(const sensor_msgs::ImagePtr &left,
+                               const sensor_msgs::ImagePtr &right,
+                               const ros::Time &stamp) {
+  const Decimation &d = cam->getConfig().decimation;
+  PortOutput &l = ports[0];
+  PortOutput &r = ports[1];
+  if (publishes(d.imageRaw)) {
+    publishImage(l.camPub, l.camInfo, left, stamp);
+    publishImage(r.camPub, r.camInfo, right, stamp);
+    publishShared(l, *left, stamp);
+    publishShared(r, *right, stamp);
+  }
+  if (publishes(d.previews)) {
+    publishPreviews(l.previews, l.camInfo, left);
+    publishPreviews(r.previews, r.camInfo, right);
+  }
+
+  const bool disparity = blockMatcher && disparityPub.getNumSubscribers() > 0 && publishes(d.disparity);
+  const bool rect = publishes(d.imageRect);
+  sensor_msgs::ImagePtr rectLeft, rectRight;
+  if (l.rectifier && (disparity || (rect && l.rectPub.getNumSubscribers() > 0))) {
+    rectLeft = rectifyImage(l.rectifier, left);
+  }
+  if (r.rectifier && (disparity || (rect && r.rectPub.getNumSubscribers() > 0))) {
+    rectRight = rectifyImage(r.rectifier, right);
+  }
+
+  if (rect && rectLeft && l.rectPub.getNumSubscribers() > 0) l.rectPub.publish(rectLeft);
+  if (rect && rectRight && r.rectPub.getNumSubscribers() > 0) r.rectPub.publish(rectRight);
+  if (disparity && rectLeft && rectRight) publishDisparity(*rectLeft, *rectRight);
+}
+
+void VrMagicNode::publishSingleFrame(size_t index, const sensor_msgs::ImagePtr &img) {
+  const Decimation &d = cam->getConfig().decimation;
+  PortOutput &port = ports[index];
+  if (publishes(d.imageRaw)) {
+    publishImage(port.camPub, port.camInfo, img, img->header.stamp);
+    publishShared(port, *img, img->header.stamp);
+  }
+  if (publishes(d.previews)) publishPreviews(port.previews, port.camInfo, img);
+  if (publishes(d.imageRect)) publishRectified(port.rectPub, port.rectifier, img);
+}
+
+void VrMagicNode::publishShared(PortOutput &port, const sensor_msgs::Image &img, const ros::Time &stamp) {
+  if (!port.shm) return;
+
+  ShmFrameInfo info = ShmFrameInfo();
+  info.stampSec = stamp.sec;
+  info.stampNsec = stamp.nsec;
+  info.frameCounter = img.header.seq;
+  info.width = img.width;
+  info.height = img.height;
+  info.step = img.step;
+  info.dataBytes = img.data.size();
+  strncpy(info.encoding, img.encoding.c_str(), sizeof(info.encoding) - 1);
+  if (!port.shm->write(info, &img.data[0])) {
+    ROS_WARN_THROTTLE(1.0, "Cannot write to shared memory: %s", port.shm->getLastError());
+  }
+}
+
+void VrMagicNode::publishPreviews(const std::vector<Preview> &previews,
+                                  const sensor_msgs::CameraInfo &camInfo,
+                                  const sensor_msgs::ImagePtr &img) {
+  for (size_t i = 0; i < previews.size(); ++i) {
+    const Preview &preview = previews[i];
+    if (preview.pub.getNumSubscribers() == 0) continue;
+
+    const size_t channels = sensor_msgs::image_encodings::numChannels(img->encoding);
+    sensor_msgs::ImagePtr small = imageMessages->acquire();
+    small->header = img->header;
+    small->encoding = img->encoding;
+    small->width = img->width / preview.factor;
+    small->height = img->height / preview.factor;
+    small->step = small->width * channels;
+    small->is_bigendian = img->is_bigendian;
+    small->data.resize(small->step * small->height);
+    downscale(&img->data[0],
+              img->step,
+              &small->data[0],
+              small->step,
+              img->width,
+              img->height,
+              channels,
+              preview.factor,
+              downscaleSums);
+
+    // The calibration still applies, through the binning
+    sensor_msgs::CameraInfoPtr info = camInfoMessages->acquire();
+    *info = camInfo;
+    info->header = small->header;
+    if (camInfo.binning_x <= 1 && camInfo.roi.width == 0) {
+      info->width = img->width;
+      info->height = img->height;
+    }
+    info->binning_x = std::max(1u, camInfo.binning_x) * preview.factor;
+    info->binning_y = std::max(1u, camInfo.binning_y) * preview.factor;
+    preview.pub.publish(small, info);
+  }
+}
+
+void VrMagicNode::publishRectified(const image_transport::Publisher &pub,
+                                   Rectifier *rectifier,
+                                   const sensor_msgs::ImagePtr &img) {
+  if (!rectifier || pub.getNumSubscribers() == 0) return;
+
+  sensor_msgs::ImagePtr rect = rectifyImage(rectifier, img);
+  if (rect) pub.publish(rect);
+}
+
+sensor_msgs::ImagePtr VrMagicNode::rectifyImage(Rectifier *rectifier, const sensor_msgs::ImagePtr &img) {
+  // The raw image is already published, but reading it is still fine
+  sensor_msgs::ImagePtr rect = imageMessages->acquire();
+  if (!rectifier->rectify(*img, *rect)) return sensor_msgs::ImagePtr();
+  return rect;
+}
+
+void VrMagicNode::publishDisparity(const sensor_msgs::Image &left, const sensor_msgs::Image &right) {
+  size_t pitch = 0;
+  const uint8_t *grayL = grayPixels(left, grayLeft, &pitch);
+  const uint8_t *grayR = grayPixels(right, grayRight, &pitch);
+
+  stereo_msgs::DisparityImagePtr msg = disparityMessages->acquire();
+  msg->header = left.header;
+  sensor_msgs::Image &img = msg->image;
+  img.header = left.header;
+  img.encoding = sensor_msgs::image_encodings::TYPE_32FC1;
+  img.width = left.width;
+  img.height = left.height;
+  img.step = left.width * sizeof(float);
+  img.is_bigendian = 0;
+  img.data.resize(img.step * img.height);
+  blockMatcher->compute(grayL, grayR, pitch, left.width, left.height, reinterpret_cast<float *>(&img.data[0]));
+
+  // Focal length and baseline of the rectified pair, from the projection of the right camera
+  const sensor_msgs::CameraInfo &rightCamInfo = ports[1].camInfo;
+  msg->f = rightCamInfo.P[0] / std::max(1u, rightCamInfo.binning_x);
+  msg->T = rightCamInfo.P[0] != 0 ? -rightCamInfo.P[3] / rightCamInfo.P[0] : 0;
+
+  size_t x0, y0, x1, y1;
+  blockMatcher->getValidWindow(left.width, left.height, &x0, &y0, &x1, &y1);
+  msg->valid_window.x_offset = x0;
+  msg->valid_window.y_offset = y0;
+  msg->valid_window.width = x1 > x0 ? x1 - x0 : 0;
+  msg->valid_window.height = y1 > y0 ? y1 - y0 : 0;
+
+  const BlockMatcherConfig &bm = blockMatcher->getConfig();
+  msg->min_disparity = bm.minDisparity;
+  msg->max_disparity = bm.minDisparity + bm.numDisparities - 1;
+  msg->delta_d = 1.0f / DISPARITY_SUBPIXELS;
+  disparityPub.publish(msg);
+}
+
+void VrMagicNode::publishImage(const image_transport::CameraPublisher &pub,
+                               const sensor_msgs::CameraInfo &camInfo,
+                               const sensor_msgs::ImagePtr &img,
+                               const ros::Time &stamp) {
+  // A recycled message keeps the capacity of D, so this copy does not allocate
+  sensor_msgs::CameraInfoPtr info = camInfoMessages->acquire();
+  *info = camInfo;
+  info->header.stamp = stamp;
+  info->header.frame_id = img->header.frame_id;
+  // With a sensor window the size stays that of the whole sensor the calibration is for
+  if (camInfo.binning_x <= 1 && camInfo.roi.width == 0) info->width = img->width;
+
+  // Published messages must not be touched anymore, they may be shared with subscribers
+  pub.publish(img, info);
+}
+
+void VrMagicNode::refreshCameraInfo(const ros::WallTimerEvent &event) {
+  const Config &conf = cam->getConfig();
+  for (size_t i = 0; i < ports.size(); ++i) {
+    PortOutput &port = ports[i];
+    sensor_msgs::CameraInfo info = windowCameraInfo(port.cinfo->getCameraInfo(), conf.ports[i].window);
+    if (sameCalibration(info, port.camInfo)) continue;
+
+    ROS_INFO("Calibration of the %s camera changed", conf.ports[i].name.c_str());
+    port.camInfo = info;
+    if (port.rectifier) port.rectifier->setCameraInfo(info);
+  }
+}
+
+void VrMagicNode::publishDiagnostics(const ros::WallTimerEvent &event) {
+  const Config &conf = cam->getConfig();
+  const ros::WallTime now = ros::WallTime::now();
+  const double interval = (now - lastDiagnostics).toSec();
+  if (interval <= 0) return;
+
+  diagnostic_msgs::DiagnosticArray msg;
+  msg.header.stamp = ros::Time::now();
+  for (size_t i = 0; i < ports.size(); ++i) {
+    PortOutput &port = ports[i];
+    PortStats stats = cam->takePortStats(i);
+    msg.status.push_back(
+        portStatus(conf.ports[i].name, conf.ports[i].port, port.active, stats, port.lastStats, interval));
+    port.lastStats = stats;
+  }
 
-  cam->grabFrameLeft(leftImageMsg, triggerTime);
-  cam->grabFrameRight(rightImageMsg, triggerTime);
+  PoolStats imagePool = cam->getImagePoolStats();
+  PoolStats messagePool = imageMessages->getStats();
+  for (size_t i = 0; i < ports.size(); ++i) {
+    if (!ports[i].pipeline) continue;
+    PoolStats pipeline = ports[i].pipeline->getMessageStats();
+    messagePool.hits += pipeline.hits;
+    messagePool.misses += pipeline.misses;
+  }
+  MatcherStats pairs = matcher->getStats();
 
-  leftCamInfo = cinfoLeft->getCameraInfo();
-  leftCamInfo.header.stamp = triggerTime;
-  leftCamInfo.header.frame_id = leftImageMsg.header.frame_id;
-  leftCamInfo.width = leftImageMsg.width;
+  diagnostic_msgs::DiagnosticStatus driver;
+  driver.name = "vrmagic: driver";
+  driver.level = diagnostic_msgs::DiagnosticStatus::OK;
+  driver.message = "OK";
+  driver.values.push_back(keyValue("Stereo pairs", pairs.pairs));
+  driver.values.push_back(keyValue("Unmatched left frames", pairs.orphansLeft));
+  driver.values.push_back(keyValue("Unmatched right frames", pairs.orphansRight));
+  driver.values.push_back(keyValue("Image pool hits", imagePool.hits));
+  driver.values.push_back(keyValue("Image pool misses", imagePool.misses));
+  driver.values.push_back(keyValue("Message pool hits", messagePool.hits));
+  driver.values.push_back(keyValue("Message pool misses", messagePool.misses));
+  const Recorder *recorder = cam->getRecorder();
+  if (recorder) {
+    RecorderStats recording = recorder->getStats();
+    driver.values.push_back(keyValue("Frames recorded", recording.framesRecorded));
+    driver.values.push_back(keyValue("Frames not recorded", recording.framesNotRecorded));
+    driver.values.push_back(keyValue("MB recorded", recording.bytesRecorded >> 20));
+    if (recorder->failed()) {
+      driver.level = diagnostic_msgs::DiagnosticStatus::ERROR;
+      driver.message = "Recording failed: " + recorder->getLastError();
+    }
+  }
+  msg.status.push_back(driver);
 
-  rightCamInfo = cinfoRight->getCameraInfo();
-  rightCamInfo.header.stamp = triggerTime;
-  rightCamInfo.header.frame_id = rightImageMsg.header.frame_id;
-  rightCamInfo.width = rightImageMsg.width;
+  diagnosticsPub.publish(msg);
 
-  camPubLeft.publish(leftImageMsg, leftCamInfo);
-  camPubRight.publish(rightImageMsg, rightCamInfo);
+  lastDiagnostics = now;
 }
 
 void VrMagicNode::spin() { broadcastFrame(); }
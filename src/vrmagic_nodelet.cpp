@@ -0,0 +1,38 @@
+// Copyright(c) 2015 Jan-Christoph Klie.
+
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+#include <ros/ros.h>
+
+#include "config_loader.hpp"
+#include "device_runner.hpp"
+
+namespace vrmagic {
+
+// Runs the driver inside a nodelet manager. Subscribers in the same manager receive the
+// published images by pointer instead of through serialization and TCPROS loopback.
+class VrMagicNodelet : public nodelet::Nodelet {
+ public:
+  VrMagicNodelet() : runner(0) {}
+  ~VrMagicNodelet() { delete runner; }
+
+ private:
+  DeviceRunner* runner;
+
+  virtual void onInit();
+};
+
+void VrMagicNodelet::onInit() {
+  ros::NodeHandle nh = getPrivateNodeHandle();
+
+  Config config;
+  if (!loadConfig(nh, config)) {
+    NODELET_FATAL("Invalid configuration, the camera is not started");
+    return;
+  }
+
+  runner = new DeviceRunner(nh, config);
+}
+}
+
+PLUGINLIB_EXPORT_CLASS(vrmagic::VrMagicNodelet, nodelet::Nodelet)
@@ -0,0 +1,144 @@
+#include "vrmusbcam_backend.hpp"
+
+#include <sstream>
+
+#include <ros/ros.h>
+#include <ros/console.h>
+
+namespace vrmagic {
+
+// Helper functions
+
+static bool matchesSelector(const VRmDeviceKey* key, const std::string& selector) {
+  if (selector.empty()) return true;
+  std::ostringstream serial;
+  serial << key->m_serial;
+  return serial.str() == selector || (key->mp_product_str && selector == key->mp_product_str);
+}
+
+// Member functions
+
+VRmUsbCamBackend::VRmUsbCamBackend(const std::string& selector_) : selector(selector_), device(0) {}
+
+VRmUsbCamBackend::~VRmUsbCamBackend() { closeDevice(); }
+
+bool VRmUsbCamBackend::enableLogging() {
+  VRmUsbCamEnableLogging();
+  return true;
+}
+
+void VRmUsbCamBackend::cleanup() { VRmUsbCamCleanup(); }
+
+bool VRmUsbCamBackend::openDevice() {
+  VRmDWORD libversion;
+  if (!VRmUsbCamGetVersion(&libversion)) return false;
+  ROS_INFO("VR Magic lib has version %d", libversion);
+
+  VRmDWORD size = 0;
+
+  ROS_INFO("Scanning for devices");
+  if (!VRmUsbCamGetDeviceKeyListSize(&size)) return false;
+  ROS_INFO("Found %d devices", size);
+
+  device = 0;
+  VRmDeviceKey* devKey = 0;
+  for (VRmDWORD i = 0; i < size && !device; ++i) {
+    if (!VRmUsbCamGetDeviceKeyListEntry(i, &devKey)) return false;
+    if (!devKey->m_busy && matchesSelector(devKey, selector)) {
+      if (!VRmUsbCamOpenDevice(devKey, &device)) {
+        VRmUsbCamFreeDeviceKey(&devKey);
+        return false;
+      }
+      ROS_INFO("Found device: %s [%s], serial %u",
+               devKey->mp_product_str,
+               devKey->mp_manufacturer_str,
+               devKey->m_serial);
+    }
+    if (!VRmUsbCamFreeDeviceKey(&devKey)) return false;
+  }
+
+  return device != 0;
+}
+
+void VRmUsbCamBackend::closeDevice() {
+  if (device) {
+    VRmUsbCamCloseDevice(device);
+    device = 0;
+  }
+}
+
+bool VRmUsbCamBackend::getSourceFormat(VRmDWORD port, VRmImageFormat* format) {
+  return VRmUsbCamGetSourceFormatEx(device, port, format);
+}
+
+bool VRmUsbCamBackend::getTargetFormatListSize(VRmDWORD port, VRmDWORD* size) {
+  return VRmUsbCamGetTargetFormatListSizeEx2(device, port, size);
+}
+
+bool VRmUsbCamBackend::getTargetFormatListEntry(VRmDWORD port, VRmDWORD index, VRmImageFormat* format) {
+  return VRmUsbCamGetTargetFormatListEntryEx2(device, port, index, format);
+}
+
+bool VRmUsbCamBackend::getPropertySupported(VRmPropId id, bool* supported) {
+  VRmBOOL result = false;
+  if (!VRmUsbCamGetPropertySupported(device, id, &result)) return false;
+  *supported = result;
+  return true;
+}
+
+bool VRmUsbCamBackend::setPropertyValueB(VRmPropId id, bool value) {
+  const VRmBOOL b = value;
+  return VRmUsbCamSetPropertyValueB(device, id, &b);
+}
+
+bool VRmUsbCamBackend::setPropertyValueE(VRmPropId id, VRmPropId value) {
+  return VRmUsbCamSetPropertyValueE(device, id, &value);
+}
+
+bool VRmUsbCamBackend::setPropertyValueF(VRmPropId id, float value) {
+  return VRmUsbCamSetPropertyValueF(device, id, &value);
+}
+
+bool VRmUsbCamBackend::setPropertyValueRectI(VRmPropId id, const VRmRectI& value) {
+  return VRmUsbCamSetPropertyValueRectI(device, id, &value);
+}
+
+bool VRmUsbCamBackend::resetFrameCounter() { return VRmUsbCamResetFrameCounter(device); }
+
+bool VRmUsbCamBackend::start() { return VRmUsbCamStart(device); }
+
+bool VRmUsbCamBackend::stop() { return VRmUsbCamStop(device); }
+
+bool VRmUsbCamBackend::lockNextImage(VRmDWORD port, VRmImage** image, VRmDWORD* framesDropped, int timeout) {
+  return VRmUsbCamLockNextImageEx2(device, port, image, framesDropped, timeout);
+}
+
+bool VRmUsbCamBackend::unlockNextImage(VRmImage** image) { return VRmUsbCamUnlockNextImage(device, image); }
+
+bool VRmUsbCamBackend::getFrameCounter(const VRmImage* image, VRmDWORD* frameCounter) {
+  return VRmUsbCamGetFrameCounter(image, frameCounter);
+}
+
+bool VRmUsbCamBackend::newImage(VRmImage** image, const VRmImageFormat& format) {
+  return VRmUsbCamNewImage(image, format);
+}
+
+bool VRmUsbCamBackend::wrapImage(VRmImage** image,
+                                 const VRmImageFormat& format,
+                                 VRmBYTE* buffer,
+                                 VRmDWORD pitch) {
+  return VRmUsbCamSetImage(image, format, buffer, pitch);
+}
+
+bool VRmUsbCamBackend::freeImage(VRmImage** image) { return VRmUsbCamFreeImage(image); }
+
+bool VRmUsbCamBackend::convertImage(const VRmImage* source, VRmImage* target) {
+  return VRmUsbCamConvertImage(source, target);
+}
+
+bool VRmUsbCamBackend::getColorFormatString(VRmColorFormat format, const char** name) {
+  return VRmUsbCamGetStringFromColorFormat(format, name);
+}
+
+const char* VRmUsbCamBackend::getLastError() { return VRmUsbCamGetLastError(); }
+}